@@ -0,0 +1,654 @@
+#include "brbt.h"
+#include "brbt_btree.h"
+#include "brbt_cache.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * reproducible workloads over the containers of the library and std::map.
+ * every workload runs on every size and key kind asked for, and reports
+ * the time, comparator calls and cache misses per operation, and the
+ * resident set size at the end of the timed part.
+ *
+ *   bench [-n sizes] [-k kinds] [-w workloads] [-s seed]
+ *
+ * lists are comma separated, sizes take k and m suffixes. small sizes
+ * are repeated until at least MIN_OPS operations were timed
+ */
+
+#define MIN_OPS (1u << 20)
+
+/* record handed to the u64 and custom kinds, and to the b tree */
+struct rec64
+{
+  uint64_t key;
+  uint64_t value;
+};
+
+struct rec32
+{
+  uint32_t key;
+  uint32_t value;
+};
+
+enum kind
+{
+  KIND_U64,
+  KIND_U32,
+  KIND_CUSTOM,
+  KIND_BTREE,
+  KIND_MAP,
+  KIND_COUNT,
+};
+
+static char const* const kind_names[KIND_COUNT] = {
+  "u64", "u32", "custom", "btree", "map",
+};
+
+enum workload
+{
+  WORK_SEQ,
+  WORK_RAND,
+  WORK_ZIPF,
+  WORK_HIT,
+  WORK_MISS,
+  WORK_CHURN,
+  WORK_SCAN,
+  WORK_EVICT,
+  WORK_COUNT,
+};
+
+static char const* const work_names[WORK_COUNT] = {
+  "seq", "rand", "zipf", "hit", "miss", "churn", "scan", "evict",
+};
+
+/* the std::map baseline, std_map.cpp */
+extern unsigned long long bench_map_compares;
+void*
+bench_map_create(void);
+void
+bench_map_destroy(void* m);
+void
+bench_map_insert(void* m, uint64_t key, uint64_t value);
+int
+bench_map_find(void* m, uint64_t key);
+void
+bench_map_erase(void* m, uint64_t key);
+uint64_t
+bench_map_scan(void* m);
+
+/* calls of the comparator of the custom kind */
+static unsigned long long compares;
+
+static int
+compare_u64(void const* lhs, void const* rhs)
+{
+  uint64_t a, b;
+  memcpy(&a, lhs, sizeof a);
+  memcpy(&b, rhs, sizeof b);
+  compares++;
+  return (a > b) - (a < b);
+}
+
+static inline uint64_t
+splitmix(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* resident set size in bytes, the peak where the current one is unknown */
+static unsigned long
+rss(void)
+{
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f) {
+    unsigned long size, resident;
+    int const n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    if (n == 2)
+      return resident * (unsigned long)sysconf(_SC_PAGESIZE);
+  }
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (unsigned long)ru.ru_maxrss * 1024;
+}
+
+/* hardware cache misses of this thread, -1 when perf_event is missing */
+static int perf_fd = -1;
+
+static void
+perf_open(void)
+{
+#if defined(__linux__)
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof attr;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static void
+perf_start(void)
+{
+#if defined(__linux__)
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static unsigned long long
+perf_stop(void)
+{
+  unsigned long long count = 0;
+#if defined(__linux__)
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &count, sizeof count) != sizeof count)
+      count = 0;
+  }
+#endif
+  return count;
+}
+
+/* zipfian ranks over [0, n) with the skew of ycsb, after gray et al. */
+struct zipf
+{
+  double theta, alpha, zetan, eta;
+  unsigned n;
+  uint64_t state;
+};
+
+static void
+zipf_init(struct zipf* z, unsigned n, double theta, uint64_t seed)
+{
+  double zeta2 = 0;
+  z->zetan = 0;
+  for (unsigned i = 1; i <= n; i++) {
+    z->zetan += 1 / pow(i, theta);
+    if (i == 2)
+      zeta2 = z->zetan;
+  }
+
+  z->theta = theta;
+  z->alpha = 1 / (1 - theta);
+  z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+  z->n = n;
+  z->state = seed;
+}
+
+static unsigned
+zipf_next(struct zipf* z)
+{
+  double const u =
+    (double)(splitmix(z->state++) >> 11) / (double)(1ull << 53);
+  double const uz = u * z->zetan;
+
+  if (uz < 1)
+    return 0;
+  if (uz < 1 + pow(0.5, z->theta))
+    return 1;
+
+  unsigned const r =
+    (unsigned)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return r < z->n ? r : z->n - 1;
+}
+
+/* one container of any of the kinds */
+struct bench
+{
+  enum kind kind;
+  struct brbt_type type;
+  struct brbt_policy policy;
+  struct brbt_cache cache;
+  struct brbt tree;
+  struct brbt_btree btree;
+  void* map;
+};
+
+/* max_capacity bounds the tree and evicts the least recently used */
+static void
+bench_create(struct bench* b, enum kind kind, unsigned max_capacity)
+{
+  memset(b, 0, sizeof *b);
+  b->kind = kind;
+
+  b->type.membs =
+    kind == KIND_U32 ? sizeof(struct rec32) : sizeof(struct rec64);
+  b->type.kind = kind == KIND_U32      ? BRBT_KEY_U32
+                 : kind == KIND_CUSTOM ? BRBT_KEY_CUSTOM
+                                       : BRBT_KEY_U64;
+  b->type.cmp = compare_u64;
+
+  struct brbt_policy const* policy = &b->policy;
+  b->policy = brbt_create_default_policy();
+  if (max_capacity) {
+    brbt_cache_init(&b->cache, BRBT_CACHE_LRU, max_capacity);
+    policy = &b->cache.policy;
+  }
+
+  switch (kind) {
+    case KIND_BTREE:
+      b->btree = brbt_btree_create(&b->type, policy, NULL);
+      break;
+    case KIND_MAP:
+      b->map = bench_map_create();
+      break;
+    default:
+      b->tree = brbt_create(&b->type, policy, NULL);
+      break;
+  }
+}
+
+static void
+bench_destroy(struct bench* b)
+{
+  switch (b->kind) {
+    case KIND_BTREE:
+      brbt_btree_destroy(&b->btree);
+      break;
+    case KIND_MAP:
+      bench_map_destroy(b->map);
+      break;
+    default:
+      brbt_destroy(&b->tree);
+      break;
+  }
+}
+
+static inline void
+bench_insert(struct bench* b, uint64_t key)
+{
+  struct rec64 r = { key, key };
+  struct rec32 r32 = { (uint32_t)key, (uint32_t)key };
+
+  switch (b->kind) {
+    case KIND_U32:
+      brbt_insert(&b->tree, &r32, 0);
+      break;
+    case KIND_BTREE:
+      brbt_btree_insert(&b->btree, &r, 0);
+      break;
+    case KIND_MAP:
+      bench_map_insert(b->map, key, key);
+      break;
+    default:
+      brbt_insert(&b->tree, &r, 0);
+      break;
+  }
+}
+
+static inline int
+bench_find(struct bench* b, uint64_t key)
+{
+  uint32_t const k32 = (uint32_t)key;
+
+  switch (b->kind) {
+    case KIND_U32:
+      return brbt_find(&b->tree, &k32) != BRBT_NIL;
+    case KIND_BTREE:
+      return brbt_btree_find(&b->btree, &key) != BRBT_NIL;
+    case KIND_MAP:
+      return bench_map_find(b->map, key);
+    default:
+      return brbt_find(&b->tree, &key) != BRBT_NIL;
+  }
+}
+
+static inline void
+bench_delete(struct bench* b, uint64_t key)
+{
+  uint32_t k32 = (uint32_t)key;
+
+  switch (b->kind) {
+    case KIND_U32:
+      brbt_delete(&b->tree, &k32);
+      break;
+    case KIND_BTREE:
+      brbt_btree_delete(&b->btree, &key);
+      break;
+    case KIND_MAP:
+      bench_map_erase(b->map, key);
+      break;
+    default:
+      brbt_delete(&b->tree, &key);
+      break;
+  }
+}
+
+static void
+sum_value(struct brbt* tree, void* userdata, brbt_node node)
+{
+  *(uint64_t*)userdata += ((struct rec64*)brbt_get(tree, node))->value;
+}
+
+static uint64_t
+bench_scan(struct bench* b)
+{
+  uint64_t sum = 0;
+
+  switch (b->kind) {
+    case KIND_BTREE:
+      brbt_btree_range(&b->btree, NULL, NULL, sum_value, &sum);
+      break;
+    case KIND_MAP:
+      sum = bench_map_scan(b->map);
+      break;
+    default:
+      brbt_for(&b->tree, i, {
+        sum += b->kind == KIND_U32
+                 ? ((struct rec32*)brbt_get(&b->tree, i))->value
+                 : ((struct rec64*)brbt_get(&b->tree, i))->value;
+      });
+      break;
+  }
+
+  return sum;
+}
+
+/* inputs of a size, shared by every kind */
+struct inputs
+{
+  unsigned n;
+  uint64_t* keys;
+  uint64_t* misses;
+  uint64_t* zipf;
+};
+
+static void
+inputs_make(struct inputs* in, unsigned n, uint64_t seed)
+{
+  in->n = n;
+  in->keys = malloc(sizeof(uint64_t) * n);
+  in->misses = malloc(sizeof(uint64_t) * n);
+  in->zipf = malloc(sizeof(uint64_t) * n);
+  if (!in->keys || !in->misses || !in->zipf) {
+    fprintf(stderr, "out of memory for %u keys\n", n);
+    exit(1);
+  }
+
+  /* splitmix is a bijection, the streams never collide for 64 bit keys */
+  for (unsigned i = 0; i < n; i++) {
+    in->keys[i] = splitmix(seed + i);
+    in->misses[i] = splitmix(seed + n + i);
+  }
+
+  struct zipf z;
+  zipf_init(&z, n, 0.99, seed);
+  for (unsigned i = 0; i < n; i++)
+    in->zipf[i] = splitmix(seed + zipf_next(&z));
+}
+
+static void
+inputs_free(struct inputs* in)
+{
+  free(in->keys);
+  free(in->misses);
+  free(in->zipf);
+}
+
+/* visits every index below n once in a scattered order */
+static inline unsigned
+scatter(unsigned i, unsigned n)
+{
+  return (unsigned)(((unsigned long long)i * 2654435761u) % n);
+}
+
+static void
+fill(struct bench* b, struct inputs const* in)
+{
+  for (unsigned i = 0; i < in->n; i++)
+    bench_insert(b, in->keys[i]);
+}
+
+/* runs the timed part of a workload, returns the operations it did */
+static unsigned long long
+run(struct bench* b, enum workload w, struct inputs* in, uint64_t* sink)
+{
+  unsigned const n = in->n;
+  unsigned long long ops = 0;
+
+  switch (w) {
+    case WORK_SEQ:
+      for (unsigned i = 0; i < n; i++)
+        bench_insert(b, i);
+      ops = n;
+      break;
+
+    case WORK_RAND:
+    case WORK_EVICT:
+      for (unsigned i = 0; i < n; i++)
+        bench_insert(b, in->keys[i]);
+      for (unsigned i = 0; w == WORK_EVICT && i < n; i++)
+        bench_insert(b, in->misses[i]);
+      ops = w == WORK_EVICT ? 2ull * n : n;
+      break;
+
+    case WORK_ZIPF:
+      for (unsigned i = 0; i < n; i++)
+        bench_insert(b, in->zipf[i]);
+      ops = n;
+      break;
+
+    case WORK_HIT:
+      for (unsigned i = 0; i < n; i++)
+        *sink += bench_find(b, in->keys[scatter(i, n)]);
+      ops = n;
+      break;
+
+    case WORK_MISS:
+      for (unsigned i = 0; i < n; i++)
+        *sink += bench_find(b, in->misses[i]);
+      ops = n;
+      break;
+
+    case WORK_CHURN:
+      /* swaps the keys for the misses one at a time, and back */
+      for (unsigned i = 0; i < n; i++) {
+        unsigned const j = scatter(i, n);
+        bench_delete(b, in->keys[j]);
+        bench_insert(b, in->misses[j]);
+        uint64_t const t = in->keys[j];
+        in->keys[j] = in->misses[j];
+        in->misses[j] = t;
+      }
+      ops = 2ull * n;
+      break;
+
+    case WORK_SCAN:
+      *sink += bench_scan(b);
+      ops = n;
+      break;
+
+    case WORK_COUNT:
+      break;
+  }
+
+  return ops;
+}
+
+static _Bool
+needs_fill(enum workload w)
+{
+  return w == WORK_HIT || w == WORK_MISS || w == WORK_CHURN || w == WORK_SCAN;
+}
+
+static void
+measure(enum workload w, enum kind k, struct inputs* in)
+{
+  /* eviction needs select, which std::map lacks */
+  if (w == WORK_EVICT && k == KIND_MAP)
+    return;
+
+  unsigned const rounds = in->n >= MIN_OPS ? 1 : MIN_OPS / in->n;
+  unsigned long long ops = 0, cmps = 0, misses = 0;
+  unsigned long resident = 0;
+  double elapsed = 0;
+  uint64_t sink = 0;
+
+  for (unsigned r = 0; r < rounds; r++) {
+    struct bench b;
+    bench_create(&b, k, w == WORK_EVICT ? in->n : 0);
+    if (needs_fill(w))
+      fill(&b, in);
+
+    unsigned long long const c0 = compares + bench_map_compares;
+    perf_start();
+    double const t0 = now();
+
+    ops += run(&b, w, in, &sink);
+
+    elapsed += now() - t0;
+    misses += perf_stop();
+    cmps += compares + bench_map_compares - c0;
+
+    if (r == rounds - 1)
+      resident = rss();
+    bench_destroy(&b);
+  }
+
+  char cmp_col[32] = "-", miss_col[32] = "-";
+  if (k == KIND_CUSTOM || k == KIND_MAP)
+    snprintf(cmp_col, sizeof cmp_col, "%.1f", (double)cmps / ops);
+  if (perf_fd >= 0)
+    snprintf(miss_col, sizeof miss_col, "%.2f", (double)misses / ops);
+
+  printf("%-6s %-7s %10u %10.1f %8s %8s %9.1f\n",
+         work_names[w],
+         kind_names[k],
+         in->n,
+         elapsed / ops * 1e9,
+         cmp_col,
+         miss_col,
+         resident / 1048576.0);
+
+  /* keeps the lookups from being optimized out */
+  if (sink == 42)
+    fputc('\n', stderr);
+  fflush(stdout);
+}
+
+/* parses a comma separated list of names into a mask */
+static unsigned
+parse_names(char const* arg, char const* const* names, unsigned count)
+{
+  unsigned mask = 0;
+  char buf[256];
+  snprintf(buf, sizeof buf, "%s", arg);
+
+  for (char* tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+    unsigned i = 0;
+    while (i < count && strcmp(tok, names[i]) != 0)
+      i++;
+    if (i == count) {
+      fprintf(stderr, "unknown name %s\n", tok);
+      exit(2);
+    }
+    mask |= 1u << i;
+  }
+
+  return mask;
+}
+
+static unsigned
+parse_sizes(char const* arg, unsigned* sizes, unsigned max)
+{
+  unsigned count = 0;
+  char buf[256];
+  snprintf(buf, sizeof buf, "%s", arg);
+
+  for (char* tok = strtok(buf, ","); tok && count < max;
+       tok = strtok(NULL, ",")) {
+    char* end;
+    unsigned long long v = strtoull(tok, &end, 10);
+    if (*end == 'k')
+      v *= 1000;
+    else if (*end == 'm')
+      v *= 1000000;
+
+    if (v == 0 || v > BRBT_MAX_CAPACITY) {
+      fprintf(stderr, "bad size %s\n", tok);
+      exit(2);
+    }
+    sizes[count++] = (unsigned)v;
+  }
+
+  return count;
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned sizes[16] = { 1000, 100000, 1000000 };
+  unsigned size_count = 3;
+  unsigned kinds = (1u << KIND_COUNT) - 1;
+  unsigned works = (1u << WORK_COUNT) - 1;
+  uint64_t seed = 1;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-n") == 0)
+      size_count = parse_sizes(argv[i + 1], sizes, 16);
+    else if (strcmp(argv[i], "-k") == 0)
+      kinds = parse_names(argv[i + 1], kind_names, KIND_COUNT);
+    else if (strcmp(argv[i], "-w") == 0)
+      works = parse_names(argv[i + 1], work_names, WORK_COUNT);
+    else if (strcmp(argv[i], "-s") == 0)
+      seed = strtoull(argv[i + 1], NULL, 10);
+    else {
+      fprintf(stderr, "usage: %s [-n sizes] [-k kinds] [-w workloads] "
+                      "[-s seed]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  perf_open();
+
+  printf("%-6s %-7s %10s %10s %8s %8s %9s\n",
+         "work", "kind", "n", "ns/op", "cmp/op", "miss/op", "rss MiB");
+
+  for (unsigned s = 0; s < size_count; s++) {
+    struct inputs in;
+    inputs_make(&in, sizes[s], seed);
+
+    for (unsigned w = 0; w < WORK_COUNT; w++)
+      for (unsigned k = 0; k < KIND_COUNT; k++)
+        if ((works >> w & 1) && (kinds >> k & 1))
+          measure(w, k, &in);
+
+    inputs_free(&in);
+  }
+
+  return 0;
+}
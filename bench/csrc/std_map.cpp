@@ -0,0 +1,63 @@
+// the std::map baseline of the benchmarks, behind a c interface
+
+#include <cstdint>
+#include <map>
+
+extern "C" {
+unsigned long long bench_map_compares = 0;
+}
+
+namespace {
+
+struct counting_less
+{
+  bool operator()(std::uint64_t lhs, std::uint64_t rhs) const
+  {
+    bench_map_compares++;
+    return lhs < rhs;
+  }
+};
+
+using map = std::map<std::uint64_t, std::uint64_t, counting_less>;
+
+} // namespace
+
+extern "C" void*
+bench_map_create()
+{
+  return new map();
+}
+
+extern "C" void
+bench_map_destroy(void* m)
+{
+  delete static_cast<map*>(m);
+}
+
+extern "C" void
+bench_map_insert(void* m, std::uint64_t key, std::uint64_t value)
+{
+  static_cast<map*>(m)->emplace(key, value);
+}
+
+extern "C" int
+bench_map_find(void* m, std::uint64_t key)
+{
+  auto* mp = static_cast<map*>(m);
+  return mp->find(key) != mp->end();
+}
+
+extern "C" void
+bench_map_erase(void* m, std::uint64_t key)
+{
+  static_cast<map*>(m)->erase(key);
+}
+
+extern "C" std::uint64_t
+bench_map_scan(void* m)
+{
+  std::uint64_t sum = 0;
+  for (auto const& kv : *static_cast<map*>(m))
+    sum += kv.second;
+  return sum;
+}
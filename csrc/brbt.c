@@ -1,4 +1,5 @@
 #include "brbt.h"
+#include "brbt_internal.h"
 
 #ifndef true
 #define true 1
@@ -14,22 +15,207 @@
  * on left leaning red-black trees.
  */
 
-#define left(x) get_bk(tree, x)->left
-#define right(x) get_bk(tree, x)->right
-#define col(x) get_bk(tree, x)->red
-#define nextfree(x) get_bk(tree, x)->next_free
+#define left(x) link_left(tree, x)
+#define right(x) link_right(tree, x)
+#define col(x) link_col(tree, x)
+#define nextfree(x) link_next_free(tree, x)
+#define set_left(x, v) link_set_left(tree, x, v)
+#define set_right(x, v) link_set_right(tree, x, v)
+#define set_col(x, v) link_set_col(tree, x, v)
+#define set_nextfree(x, v) link_set_next_free(tree, x, v)
+#define cnt(x) (*(unsigned*)((char*)get_bk(tree, x) + tree->_bk_count))
+#define agg(x) ((void*)((char*)get_bk(tree, x) + tree->_bk_agg))
 #define assert(x) ((x) ? (void)(0) : tree->_policy->abort(tree, __LINE__))
+/* assert guarding a write past a fixed array, which traps
+ * should the abort function return */
+#define assert_bounds(x)                                                       \
+  ((x) ? (void)(0)                                                             \
+       : (tree->_policy->abort(tree, __LINE__), __builtin_trap()))
 #define keyoff tree->_type->keyoff
 #define membs tree->_type->membs
 
+#ifdef BRBT_STATS
+#define count_stat(field, n) (tree->_counters.field += (n))
+#else
+#define count_stat(field, n) ((void)0)
+#endif
+
+/* left link of a node sitting on the free list,
+ * lets a linear scan tell free and live nodes apart */
+#define FREE_MARK (BRBT_NIL - 1)
+
 static inline struct brbt_bookkeeping_info*
 get_bk(struct brbt* tree, unsigned idx)
 {
   assert(tree);
   assert(idx != BRBT_NIL);
 
-  return &tree->bk[idx];
+  return (struct brbt_bookkeeping_info*)((char*)tree->bk +
+                                         (unsigned long)tree->_bk_stride * idx);
+}
+
+#ifdef BRBT_DIRTY
+/* nodes covered by a word of the dirty map */
+#define DIRTY_WORD_NODES (64ull << BRBT_DIRTY_SHIFT)
+#endif
+
+/* notes a write to the record or bookkeeping row of a node */
+static inline void
+mark_dirty(struct brbt* tree, brbt_node x)
+{
+#ifdef BRBT_DIRTY
+  /* parallel bulk operations write neighbouring nodes from several
+   * threads, so bits are set atomically, and only once */
+  unsigned const run = x >> BRBT_DIRTY_SHIFT;
+  unsigned long long* const word = &tree->_dirty[run / 64];
+  unsigned long long const bit = 1ull << (run % 64);
+  if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+    __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+#else
+  (void)tree;
+  (void)x;
+#endif
+}
+
+/* packed bookkeeping keeps the color in the top bit of right. links
+ * narrower than a brbt_node are widened, mapping their all ones
+ * patterns back onto BRBT_NIL and FREE_MARK */
+#if defined(BRBT_BOOKKEEPING_SMALL)
+typedef unsigned short link_t;
+#else
+typedef brbt_node link_t;
+#endif
+
+#define LINK_NIL ((link_t)-1)
+#define LINK_RED ((link_t)(LINK_NIL ^ (LINK_NIL >> 1)))
+#define LINK_RIGHT_NIL ((link_t)(LINK_NIL >> 1))
+
+static inline brbt_node
+link_widen(link_t l)
+{
+#if defined(BRBT_BOOKKEEPING_SMALL)
+  return l >= LINK_NIL - 1 ? BRBT_NIL - (LINK_NIL - l) : l;
+#else
+  return l;
+#endif
+}
+
+static inline link_t
+link_narrow(brbt_node x)
+{
+  return (link_t)x;
+}
+
+static inline brbt_node
+link_left(struct brbt* tree, brbt_node x)
+{
+  return link_widen(get_bk(tree, x)->left);
+}
+
+static inline void
+link_set_left(struct brbt* tree, brbt_node x, brbt_node v)
+{
+  mark_dirty(tree, x);
+  get_bk(tree, x)->left = link_narrow(v);
+}
+
+#if defined(BRBT_BOOKKEEPING_PACKED) || defined(BRBT_BOOKKEEPING_SMALL)
+/* the right link held in a raw right word */
+static inline brbt_node
+link_right_of(link_t r)
+{
+  r &= LINK_RIGHT_NIL;
+  return r == LINK_RIGHT_NIL ? BRBT_NIL : r;
+}
+
+static inline brbt_node
+link_right(struct brbt* tree, brbt_node x)
+{
+  return link_right_of(get_bk(tree, x)->right);
+}
+
+static inline void
+link_set_right(struct brbt* tree, brbt_node x, brbt_node v)
+{
+  mark_dirty(tree, x);
+  struct brbt_bookkeeping_info* bk = get_bk(tree, x);
+  link_t const r = v == BRBT_NIL ? LINK_RIGHT_NIL : (link_t)v;
+  bk->right = (bk->right & LINK_RED) | r;
+}
+
+static inline _Bool
+link_col(struct brbt* tree, brbt_node x)
+{
+  return (get_bk(tree, x)->right & LINK_RED) != 0;
+}
+
+static inline void
+link_set_col(struct brbt* tree, brbt_node x, _Bool red)
+{
+  mark_dirty(tree, x);
+  struct brbt_bookkeeping_info* bk = get_bk(tree, x);
+  bk->right = red ? (bk->right | LINK_RED) : (bk->right & ~LINK_RED);
+}
+
+/* free nodes have no color, the whole of right holds the next one */
+static inline brbt_node
+link_next_free(struct brbt* tree, brbt_node x)
+{
+  return link_widen(get_bk(tree, x)->right);
+}
+
+static inline void
+link_set_next_free(struct brbt* tree, brbt_node x, brbt_node v)
+{
+  mark_dirty(tree, x);
+  get_bk(tree, x)->right = link_narrow(v);
+}
+#else
+static inline brbt_node
+link_right_of(link_t r)
+{
+  return r;
+}
+
+static inline brbt_node
+link_right(struct brbt* tree, brbt_node x)
+{
+  return get_bk(tree, x)->right;
+}
+
+static inline void
+link_set_right(struct brbt* tree, brbt_node x, brbt_node v)
+{
+  mark_dirty(tree, x);
+  get_bk(tree, x)->right = v;
+}
+
+static inline _Bool
+link_col(struct brbt* tree, brbt_node x)
+{
+  return get_bk(tree, x)->red;
+}
+
+static inline void
+link_set_col(struct brbt* tree, brbt_node x, _Bool red)
+{
+  mark_dirty(tree, x);
+  get_bk(tree, x)->red = red;
+}
+
+static inline brbt_node
+link_next_free(struct brbt* tree, brbt_node x)
+{
+  return get_bk(tree, x)->next_free;
+}
+
+static inline void
+link_set_next_free(struct brbt* tree, brbt_node x, brbt_node v)
+{
+  mark_dirty(tree, x);
+  get_bk(tree, x)->next_free = v;
 }
+#endif
 
 static inline void*
 get_key(struct brbt* tree, char* data)
@@ -40,13 +226,43 @@ get_key(struct brbt* tree, char* data)
   return &data[keyoff];
 }
 
+/* bytesize of a key within a record, 0 for custom keys without keylen */
+static inline unsigned
+key_bytes(struct brbt* tree)
+{
+  return tree->_type->kind == BRBT_KEY_CUSTOM ? tree->_type->keylen
+                                              : brbt_key_size(tree->_type);
+}
+
+/* the copy of the key kept in the bookkeeping array */
+static inline void*
+inline_key(struct brbt* tree, brbt_node idx)
+{
+  return (char*)get_bk(tree, idx) + tree->_bk_key;
+}
+
 void*
 brbt_get(struct brbt* tree, brbt_node idx)
 {
   assert(tree);
   assert(idx != BRBT_NIL);
 
-  return &tree->ptr[membs * idx];
+  return &tree->ptr[(unsigned long)tree->_data_stride * idx];
+}
+
+/* interleaved nodes are a bookkeeping row followed by the record,
+ * both arrays then step over whole nodes */
+static void
+place_records(struct brbt* tree)
+{
+  tree->_data_stride = membs;
+  tree->_data_off = 0;
+
+  if (tree->_type->layout == BRBT_LAYOUT_INTERLEAVED) {
+    tree->_data_off = (tree->_bk_stride + 7) / 8 * 8;
+    tree->_bk_stride = tree->_data_off + (membs + 7) / 8 * 8;
+    tree->_data_stride = tree->_bk_stride;
+  }
 }
 
 struct brbt
@@ -60,20 +276,78 @@ brbt_create(struct brbt_type const* type,
   tree.bk = NULL;
   tree.size = 0;
   tree.capacity = 0;
-  tree.first_free = 0;
+  tree.first_free = BRBT_NIL;
+  tree.next_uninitialized = 0;
   tree.root = BRBT_NIL;
 
   tree._policy = policy;
   tree._type = type;
   tree.userdata = userdata;
 
+  /* optional fields follow the links, the aggregate
+   * and the inline key come last and are aligned to 8 bytes */
+  tree._bk_stride = sizeof(struct brbt_bookkeeping_info);
+  tree._bk_count = 0;
+  tree._bk_agg = 0;
+  tree._bk_key = 0;
+
+  if (type->flags & BRBT_COUNTED) {
+    tree._bk_count = tree._bk_stride;
+    tree._bk_stride += sizeof(unsigned);
+  }
+
+  if (type->aggregate) {
+    if (type->aggbs == 0 || type->aggbs > BRBT_AGGREGATE_MAX)
+      policy->abort(&tree, __LINE__);
+
+    tree._bk_agg = (tree._bk_stride + 7) / 8 * 8;
+    tree._bk_stride = tree._bk_agg + (type->aggbs + 7) / 8 * 8;
+  }
+
+  if (type->inline_key) {
+    if (type->inline_key > BRBT_INLINE_KEY_MAX)
+      policy->abort(&tree, __LINE__);
+
+    /* built-in kinds compare the whole key against the copy */
+    if (brbt_key_size(type) > type->inline_key)
+      policy->abort(&tree, __LINE__);
+
+    tree._bk_key = (tree._bk_stride + 7) / 8 * 8;
+    tree._bk_stride = tree._bk_key + (type->inline_key + 7) / 8 * 8;
+  }
+
+  place_records(&tree);
+
+  tree._index = NULL;
+  tree._index_mask = 0;
+
+  tree._tombs = NULL;
+  tree._tomb_words = 0;
+  tree._tomb_count = 0;
+  tree._tomb_scan = 0;
+
+#ifdef BRBT_NO_STDLIB
+  /* the index is allocated with malloc */
+  if (type->hash)
+    policy->abort(&tree, __LINE__);
+#endif
+
+#ifdef BRBT_STATS
+  __builtin_memset(&tree._counters, 0, sizeof tree._counters);
+#endif
+
+#ifdef BRBT_DIRTY
+  tree._dirty = NULL;
+  tree._dirty_words = 0;
+#endif
+
   return tree;
 }
 
 unsigned
 brbt_size(struct brbt* tree)
 {
-  return tree->size;
+  return tree->size - tree->_tomb_count;
 }
 
 unsigned
@@ -82,296 +356,2369 @@ brbt_capacity(struct brbt* tree)
   return tree->capacity;
 }
 
-static brbt_node
-node_free(struct brbt* tree, brbt_node h)
+/* the slot a key probes first, the hash is mixed as user hashes are
+ * often the identity */
+static inline unsigned
+index_slot(struct brbt* tree, void const* key)
 {
-  tree->size--;
+  unsigned long long const h = tree->_type->hash(key) * 0x9e3779b97f4a7c15ull;
+  return (unsigned)(h >> 32) & tree->_index_mask;
+}
 
-  if (tree->_type->deleter)
-    tree->_type->deleter(tree, h);
+static inline unsigned
+index_home(struct brbt* tree, brbt_node node)
+{
+  return index_slot(tree, get_key(tree, brbt_get(tree, node)));
+}
 
-  if (tree->_policy->remove_hook)
-    tree->_policy->remove_hook(tree, h);
+/* adds a node to the index, which is never more than half full */
+static void
+index_add(struct brbt* tree, brbt_node node)
+{
+  if (!tree->_index)
+    return;
 
-  if (tree->first_free == BRBT_NIL) {
-    /* no other free nodes */
-    tree->first_free = h;
-    nextfree(h) = BRBT_NIL;
-  } else {
-    /* this node is before the first free node */
-    nextfree(h) = tree->first_free;
-    tree->first_free = h;
-  }
+  unsigned i = index_home(tree, node);
+  while (tree->_index[i] != BRBT_NIL)
+    i = (i + 1) & tree->_index_mask;
 
-  return h;
+  tree->_index[i] = node;
 }
 
-/* can return BRBT_NIL if allocation fail occurs */
-static brbt_node
-node_alloc(struct brbt* tree)
+/* takes a node out of the index, moving the entries of its cluster back
+ * into the gap where their probe sequence allows it, so that there are
+ * no tombstones. nodes that were never added are ignored */
+static void
+index_remove(struct brbt* tree, brbt_node node)
 {
-  assert(tree);
+  if (!tree->_index)
+    return;
 
-  if (tree->size >= tree->capacity) {
-    /* try to reallocate */
-    if (tree->_policy->resize) {
-      unsigned const old_cap = tree->capacity;
-      struct brbt_allocator_out out = tree->_policy->resize(tree, BRBT_GROW);
-      tree->ptr = out.data_array;
-      tree->bk = out.bk_array;
-      tree->capacity = out.size;
-      unsigned const new_cap = tree->capacity;
-
-      /* TODO: implement the -1u marker/init technique i use elsewhere
-       * as to amortize the initialization costs of
-       * allocating many nodes */
-      for (unsigned i = old_cap; i < new_cap; i++) {
-        tree->bk[i].left = BRBT_NIL;
-        tree->bk[i].right = BRBT_NIL;
-
-        if (i < tree->capacity - 1)
-          tree->bk[i].next_free = i + 1;
-        else
-          tree->bk[i].next_free = BRBT_NIL;
-      }
+  unsigned const mask = tree->_index_mask;
+  unsigned i = index_home(tree, node);
+  while (tree->_index[i] != node) {
+    if (tree->_index[i] == BRBT_NIL)
+      return;
+    i = (i + 1) & mask;
+  }
 
-    } else {
-      /* if we cant reallocate to gain a larger capacity,
-       * we need to maybe remove a value.
-       * if theres no free function, just assert false
-       * (in the future, we should just fail insertion functions)
-       */
-      assert(tree->_policy->select);
-      node_free(tree, tree->_policy->select(tree));
+  for (unsigned j = (i + 1) & mask; tree->_index[j] != BRBT_NIL;
+       j = (j + 1) & mask) {
+    /* an entry may fill the gap unless its home lies in (i, j] */
+    unsigned const home = index_home(tree, tree->_index[j]);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      tree->_index[i] = tree->_index[j];
+      i = j;
     }
   }
 
-  tree->size++;
+  tree->_index[i] = BRBT_NIL;
+}
 
-  brbt_node h = tree->first_free;
-  tree->first_free = nextfree(h);
+/* empties the index */
+static void
+index_reset(struct brbt* tree)
+{
+  if (!tree->_index)
+    return;
 
-  return h;
+  for (unsigned long long i = 0; i <= tree->_index_mask; i++)
+    tree->_index[i] = BRBT_NIL;
 }
 
 void
-brbt_clear(struct brbt* tree)
+brbt_index_rebuild(struct brbt* tree)
 {
-  if (tree->size == 0)
+  if (!tree->_index)
     return;
 
-  brbt_for(tree, i, { node_free(tree, i); });
-  tree->size = 0;
-  tree->root = BRBT_NIL;
+  index_reset(tree);
+  brbt_for(tree, i, { index_add(tree, i); });
+}
 
-  // /* clear all the nodes before the first free node */
-  // for (brbt_node i = 0; i < tree->first_free; i++)
-  //   node_free(tree, i);
+_Bool
+brbt_index_fit(struct brbt* tree)
+{
+  if (!tree->_type->hash)
+    return true;
 
-  // /* for each free node, clear the nodes after it and
-  //  * before the next free node
-  //  */
+  unsigned long long slots = 16;
+  while (slots < 2ull * tree->capacity)
+    slots *= 2;
 
-  // brbt_node current = tree->first_free;
-  // while (current != BRBT_NIL) {
-  //   brbt_node until = nextfree(current);
-  //   if (until == BRBT_NIL)
-  //     until = tree->capacity;
+  if (tree->_index && slots <= tree->_index_mask + 1ull)
+    return true;
 
-  //   for (brbt_node i = current + 1; i < until; i++)
-  //     node_free(tree, i);
-  // }
-}
+#ifdef BRBT_NO_STDLIB
+  return false;
+#else
+  if (slots > 1ull << 32)
+    return false;
 
-void
-brbt_destroy(struct brbt* tree)
-{
-  volatile brbt_node begin = 0;
-  brbt_node follower = tree->first_free;
+  brbt_node* const index = malloc(sizeof(brbt_node) * slots);
+  if (!index)
+    return false;
 
-  while (begin != BRBT_NIL) {
-    brbt_node end = follower == BRBT_NIL ? tree->capacity : follower;
+  brbt_node* const old = tree->_index;
+  unsigned long long const old_slots = old ? tree->_index_mask + 1ull : 0;
 
-    for (brbt_node i = begin; i < end; i++)
-      node_free(tree, i);
+  tree->_index = index;
+  tree->_index_mask = (unsigned)(slots - 1);
+  index_reset(tree);
 
-    begin = follower;
-    follower = follower == BRBT_NIL ? 0 : nextfree(follower);
-  }
+  for (unsigned long long i = 0; i < old_slots; i++)
+    if (old[i] != BRBT_NIL)
+      index_add(tree, old[i]);
 
-  tree->_policy->free(tree);
+  free(old);
+  return true;
+#endif
 }
 
-static inline int
-compare(struct brbt* tree, brbt_node node, void const* key)
+/* sizes the tombstones to the capacity, allocating them if create is
+ * set. returns false if they could not grow */
+static _Bool
+tomb_fit(struct brbt* tree, _Bool create)
 {
-  assert(node != BRBT_NIL);
-  assert(key);
+  if (!tree->_tombs && !create)
+    return true;
+
+  unsigned const words = (tree->capacity + 63) / 64;
+  if (tree->_tombs && words <= tree->_tomb_words)
+    return true;
+
+#ifdef BRBT_NO_STDLIB
+  return false;
+#else
+  unsigned long long* const tombs =
+    realloc(tree->_tombs, sizeof(unsigned long long) * (words ? words : 1));
+  if (!tombs)
+    return false;
 
-  void* key_off = get_key(tree, brbt_get(tree, node));
-  return tree->_type->cmp(key, key_off);
+  for (unsigned i = tree->_tomb_words; i < words; i++)
+    tombs[i] = 0;
+  tree->_tombs = tombs;
+  tree->_tomb_words = words;
+  return true;
+#endif
 }
 
-#define compare(node, key) compare(tree, node, key)
+static inline void
+tomb_clear(struct brbt* tree, brbt_node h)
+{
+  if (brbt_tombstone(tree, h)) {
+    tree->_tombs[h / 64] &= ~(1ull << (h % 64));
+    tree->_tomb_count--;
+  }
+}
 
-static inline _Bool
-is_red(struct brbt* tree, brbt_node node)
+/* runs the maintenance of every pending tombstone, before operations
+ * that move nodes around wholesale */
+static void
+tomb_flush(struct brbt* tree)
 {
-  assert(tree);
+  if (tree->_tomb_count)
+    brbt_maintenance(tree, tree->_tomb_count);
+}
 
-  /* nil nodes considered black */
-  if (node == BRBT_NIL)
-    return false;
+/* pushes a node onto the free list. the node has to be out of the
+ * index already, which hashes its key, before a deleter may have freed
+ * the storage of the key */
+static void
+node_release(struct brbt* tree, brbt_node h)
+{
+  tree->size--;
+  tomb_clear(tree, h);
 
-  return col(node);
+  set_left(h, FREE_MARK);
+  set_nextfree(h, tree->first_free);
+  tree->first_free = h;
 }
 
-#define is_red(x) is_red(tree, x)
-
-static brbt_node
-rotate_left(struct brbt* tree, brbt_node h)
+/* runs the deleter and the remove hook of a node leaving the tree */
+static void
+node_drop(struct brbt* tree, brbt_node h)
 {
-  assert(tree);
-  assert(h != BRBT_NIL);
-  assert(is_red(right(h)));
+  if (tree->_type->deleter)
+    tree->_type->deleter(tree, h);
 
-  brbt_node x = right(h);
-  right(h) = left(x);
-  left(x) = h;
-  col(x) = col(h);
-  col(h) = true;
-  return x;
+  if (tree->_policy->remove_hook)
+    tree->_policy->remove_hook(tree, h);
 }
 
 static brbt_node
-rotate_right(struct brbt* tree, brbt_node h)
+node_free(struct brbt* tree, brbt_node h)
 {
-  assert(tree);
-  assert(h != BRBT_NIL);
-  assert(is_red(left(h)));
-
-  brbt_node x = left(h);
-  left(h) = right(x);
-  right(x) = h;
-  col(x) = col(h);
-  col(h) = true;
-  return x;
+  index_remove(tree, h);
+  node_drop(tree, h);
+  node_release(tree, h);
+  return h;
 }
 
-#define rotl(x) rotate_left(tree, x)
-#define rotr(x) rotate_right(tree, x)
+/* bytes a node takes up across both arrays */
+static inline unsigned
+node_bytes(struct brbt* tree)
+{
+  if (tree->_type->layout == BRBT_LAYOUT_INTERLEAVED)
+    return tree->_bk_stride;
+  return tree->_bk_stride + membs;
+}
 
-static void
-color_flip(struct brbt* tree, brbt_node node)
+/* asks the policy for room for at least min_capacity nodes */
+static _Bool
+grow(struct brbt* tree, unsigned min_capacity)
 {
-  assert(tree);
-  assert(node != BRBT_NIL);
+  if (!tree->_policy->resize)
+    return false;
 
-  col(node) = !col(node);
-  if (left(node) != BRBT_NIL)
-    col(left(node)) = !col(left(node));
-  if (right(node) != BRBT_NIL)
-    col(right(node)) = !col(right(node));
+  unsigned const old_capacity = tree->capacity;
+  struct brbt_allocator_out out =
+    tree->_policy->resize(tree, BRBT_GROW, min_capacity);
+  count_stat(resizes, 1);
+
+  /* a failed allocation may still have moved one of the arrays */
+  if (out.data_array)
+    tree->ptr = out.data_array;
+  if (out.bk_array)
+    tree->bk = out.bk_array;
+  /* anything past the largest index the links can hold stays unused */
+  unsigned const size =
+    out.size > BRBT_MAX_CAPACITY ? BRBT_MAX_CAPACITY : out.size;
+  if (size > tree->capacity && out.data_array && out.bk_array)
+    tree->capacity = size;
+
+  /* nodes the side tables cannot cover stay unused */
+  if (!brbt_dirty_fit(tree) || !brbt_index_fit(tree) || !tomb_fit(tree, false))
+    tree->capacity = old_capacity;
+
+  count_stat(grown_bytes,
+             (unsigned long long)(tree->capacity - old_capacity) *
+               node_bytes(tree));
+
+  return tree->capacity >= min_capacity;
 }
 
-#define color_flip(x) color_flip(tree, x)
+/* whether node_alloc can hand out a node without growing */
+static inline _Bool
+has_room(struct brbt* tree)
+{
+  return tree->first_free != BRBT_NIL ||
+         tree->next_uninitialized < tree->capacity;
+}
 
+/* nodes past the high-water mark have never been handed out
+ * and need no initialization, so growing only bumps the capacity.
+ * returns BRBT_NIL if there is no room, see make_room */
 static brbt_node
-new_node(struct brbt* tree, void* data_in)
+node_alloc(struct brbt* tree)
 {
   assert(tree);
-  assert(data_in);
 
-  brbt_node node = node_alloc(tree);
-  if (node == BRBT_NIL)
+  if (!has_room(tree))
     return BRBT_NIL;
-  col(node) = true;
-  left(node) = BRBT_NIL;
-  right(node) = BRBT_NIL;
 
-  void* data = brbt_get(tree, node);
-  __builtin_memcpy(data, data_in, membs);
+  tree->size++;
 
-  if (tree->_policy->insert_hook)
-    tree->_policy->insert_hook(tree, node);
+  if (tree->first_free != BRBT_NIL) {
+    brbt_node h = tree->first_free;
+    tree->first_free = nextfree(h);
+    return h;
+  }
 
-  return node;
+  return tree->next_uninitialized++;
 }
 
-static brbt_node
-fixup(struct brbt* tree, brbt_node h)
+/* runs the deleter and the remove hook of every live node, without
+ * writing to the arrays. nodes handed out through the slot api are not
+ * linked into the tree, so it scans the nodes below the high-water mark,
+ * skipping the marked free ones */
+static void
+drop_all(struct brbt* tree)
 {
-  assert(tree);
-  assert(h != BRBT_NIL);
+  if (!tree->_type->deleter && !tree->_policy->remove_hook)
+    return;
 
-  if (is_red(right(h)) && !is_red(left(h)))
-    h = rotl(h);
-  if (is_red(left(h)) && is_red(left(left(h))))
-    h = rotr(h);
-  if (is_red(left(h)) && is_red(right(h)))
-    color_flip(h);
+  /* stops at the last live node */
+  unsigned live = tree->size;
+  for (brbt_node i = 0; live > 0 && i < tree->next_uninitialized; i++)
+    if (left(i) != FREE_MARK) {
+      node_drop(tree, i);
+      live--;
+    }
+}
 
-  return h;
+void
+brbt_clear(struct brbt* tree)
+{
+  drop_all(tree);
+
+  /* every node is free again, nodes past the high-water mark need
+   * no initialization, so there is no free list to build */
+  tree->size = 0;
+  tree->root = BRBT_NIL;
+  tree->first_free = BRBT_NIL;
+  tree->next_uninitialized = 0;
+  index_reset(tree);
+
+  if (tree->_tomb_count)
+    for (unsigned i = 0; i < tree->_tomb_words; i++)
+      tree->_tombs[i] = 0;
+  tree->_tomb_count = 0;
 }
 
-__attribute__((hot, flatten)) static brbt_node
-insert_impl(struct brbt* tree,
-            brbt_node node,
-            void* data,
-            _Bool replace,
-            brbt_node* insert_out)
+void
+brbt_destroy(struct brbt* tree)
 {
-  if (node == BRBT_NIL) {
-    *insert_out = new_node(tree, data);
-    return *insert_out;
-  }
+  /* the arrays are not written to, they may be mapped read only */
+  drop_all(tree);
+
+  tree->size = 0;
+  tree->_policy->free(tree);
 
-  int cmp = compare(node, get_key(tree, data));
+#ifndef BRBT_NO_STDLIB
+  free(tree->_index);
+  tree->_index = NULL;
+  tree->_index_mask = 0;
 
-  if (cmp == 0) {
-    if (replace) {
-      tree->_type->deleter(tree, node);
-      __builtin_memcpy(brbt_get(tree, node), data, membs);
-    }
-  } else if (cmp < 0)
-    left(node) = insert_impl(tree, left(node), data, replace, insert_out);
-  else
-    right(node) = insert_impl(tree, right(node), data, replace, insert_out);
+  free(tree->_tombs);
+  tree->_tombs = NULL;
+  tree->_tomb_words = 0;
+  tree->_tomb_count = 0;
+#endif
 
-  return fixup(tree, node);
+#ifdef BRBT_DIRTY
+  free(tree->_dirty);
+  tree->_dirty = NULL;
+  tree->_dirty_words = 0;
+#endif
 }
 
-brbt_node
-brbt_insert(struct brbt* tree, void* node_in, _Bool replace)
+_Bool
+brbt_dirty_fit(struct brbt* tree)
 {
-  assert(tree);
-  assert(node_in);
+#ifdef BRBT_DIRTY
+  unsigned long long const words =
+    (tree->capacity + DIRTY_WORD_NODES - 1) / DIRTY_WORD_NODES;
+  if (words <= tree->_dirty_words)
+    return true;
+
+  unsigned long long* map =
+    realloc(tree->_dirty, sizeof(unsigned long long) * words);
+  if (!map)
+    return false;
 
-  brbt_node out;
-  tree->root = insert_impl(tree, tree->root, node_in, replace, &out);
+  for (unsigned i = tree->_dirty_words; i < words; i++)
+    map[i] = 0;
+  tree->_dirty = map;
+  tree->_dirty_words = words;
+#else
+  (void)tree;
+#endif
+  return true;
+}
+
+_Bool
+brbt_slot_reserve(struct brbt* tree, unsigned n)
+{
+  assert(tree);
+
+  /* every slot that is not in use is either free or past the mark */
+  if (tree->capacity - tree->size >= n)
+    return true;
+
+  unsigned long const want = (unsigned long)tree->size + n;
+  if (want > BRBT_MAX_CAPACITY)
+    return false;
+
+  return grow(tree, (unsigned)want);
+}
+
+brbt_node
+brbt_slot_alloc(struct brbt* tree)
+{
+  brbt_node const slot = node_alloc(tree);
+
+  /* a slot off the free list still carries the mark */
+  if (slot != BRBT_NIL)
+    set_left(slot, BRBT_NIL);
+
+  return slot;
+}
+
+void
+brbt_slot_free(struct brbt* tree, brbt_node slot)
+{
+  assert(slot < tree->capacity);
+  node_free(tree, slot);
+}
+
+void
+brbt_slot_release(struct brbt* tree, brbt_node slot)
+{
+  assert(slot < tree->capacity);
+  index_remove(tree, slot);
+  node_release(tree, slot);
+}
+
+void
+brbt_slot_clear(struct brbt* tree)
+{
+  for (brbt_node i = 0; i < tree->next_uninitialized; i++)
+    if (left(i) != FREE_MARK)
+      node_free(tree, i);
+
+  tree->size = 0;
+  tree->first_free = BRBT_NIL;
+  tree->next_uninitialized = 0;
+}
+
+void
+brbt_shrink(struct brbt* tree)
+{
+  assert(tree);
+
+  if (tree->_policy->pinned || !tree->_policy->resize)
+    return;
+
+  brbt_compact(tree, NULL);
+
+  struct brbt_allocator_out out =
+    tree->_policy->resize(tree, BRBT_SHRINK, tree->size);
+  count_stat(resizes, 1);
+
+  if (out.data_array)
+    tree->ptr = out.data_array;
+  if (out.bk_array)
+    tree->bk = out.bk_array;
+  if (out.size >= tree->size && out.size < tree->capacity)
+    tree->capacity = out.size;
+}
+
+/* refreshes the inline copy of the key of a node after its data changed */
+static inline void
+sync_key(struct brbt* tree, brbt_node node)
+{
+  mark_dirty(tree, node);
+
+  if (tree->_type->inline_key)
+    __builtin_memcpy(inline_key(tree, node),
+                     get_key(tree, brbt_get(tree, node)),
+                     tree->_type->inline_key);
+}
+
+/* where the key of a node is read from during descents */
+static inline void*
+node_key(struct brbt* tree, brbt_node node)
+{
+  return tree->_type->inline_key ? inline_key(tree, node)
+                                 : get_key(tree, brbt_get(tree, node));
+}
+
+/* compares a key against the key of a node */
+__attribute__((always_inline)) static inline int
+compare_kind(struct brbt* tree,
+             brbt_node node,
+             void const* key,
+             enum brbt_key_kind const kind)
+{
+  assert(node != BRBT_NIL);
+  assert(key);
+
+  count_stat(compares, 1);
+  return compare_keys(tree, key, node_key(tree, node), kind);
+}
+
+static inline int
+compare(struct brbt* tree, brbt_node node, void const* key)
+{
+  return compare_kind(tree, node, key, tree->_type->kind);
+}
+
+#define compare(node, key) compare(tree, node, key)
+
+#define dispatch_kind(fn, ...)                                                 \
+  brbt_dispatch_kind(tree->_type->kind, fn, __VA_ARGS__)
+
+static inline _Bool
+is_red(struct brbt* tree, brbt_node node)
+{
+  assert(tree);
+
+  /* nil nodes considered black */
+  if (node == BRBT_NIL)
+    return false;
+
+  return col(node);
+}
+
+#define is_red(x) is_red(tree, x)
+
+static inline unsigned
+subtree_size(struct brbt* tree, brbt_node node)
+{
+  return node == BRBT_NIL ? 0 : cnt(node);
+}
+
+/* whether nodes carry fields that depend on their subtree */
+static inline _Bool
+augmented(struct brbt* tree)
+{
+  return (tree->_type->flags & BRBT_COUNTED) || tree->_type->aggregate;
+}
+
+static inline void const*
+subtree_agg(struct brbt* tree, brbt_node node)
+{
+  return node == BRBT_NIL ? NULL : agg(node);
+}
+
+/* recomputes the augmented fields of a node from its children */
+static inline void
+refresh(struct brbt* tree, brbt_node h)
+{
+  if (augmented(tree))
+    mark_dirty(tree, h);
+
+  if (tree->_type->flags & BRBT_COUNTED)
+    cnt(h) = 1 + subtree_size(tree, left(h)) + subtree_size(tree, right(h));
+
+  if (tree->_type->aggregate)
+    tree->_type->aggregate(tree,
+                           agg(h),
+                           subtree_agg(tree, left(h)),
+                           h,
+                           subtree_agg(tree, right(h)));
+}
+
+static brbt_node
+rotate_left(struct brbt* tree, brbt_node h)
+{
+  assert(tree);
+  assert(h != BRBT_NIL);
+  assert(is_red(right(h)));
+  count_stat(rotations, 1);
+
+  brbt_node x = right(h);
+  set_right(h, left(x));
+  set_left(x, h);
+  set_col(x, col(h));
+  set_col(h, true);
+  refresh(tree, h);
+  refresh(tree, x);
+  return x;
+}
+
+static brbt_node
+rotate_right(struct brbt* tree, brbt_node h)
+{
+  assert(tree);
+  assert(h != BRBT_NIL);
+  assert(is_red(left(h)));
+  count_stat(rotations, 1);
+
+  brbt_node x = left(h);
+  set_left(h, right(x));
+  set_right(x, h);
+  set_col(x, col(h));
+  set_col(h, true);
+  refresh(tree, h);
+  refresh(tree, x);
+  return x;
+}
+
+#define rotl(x) rotate_left(tree, x)
+#define rotr(x) rotate_right(tree, x)
+
+static void
+color_flip(struct brbt* tree, brbt_node node)
+{
+  assert(tree);
+  assert(node != BRBT_NIL);
+  count_stat(color_flips, 1);
+
+  set_col(node, !col(node));
+  if (left(node) != BRBT_NIL)
+    set_col(left(node), !col(left(node)));
+  if (right(node) != BRBT_NIL)
+    set_col(right(node), !col(right(node)));
+}
+
+#define color_flip(x) color_flip(tree, x)
+
+static brbt_node
+new_node(struct brbt* tree, void const* data_in, void const* key)
+{
+  assert(tree);
+  assert(data_in || key);
+
+  brbt_node node = node_alloc(tree);
+  if (node == BRBT_NIL)
+    return BRBT_NIL;
+  set_col(node, true);
+  set_left(node, BRBT_NIL);
+  set_right(node, BRBT_NIL);
+
+  /* emplaced nodes only get their key */
+  void* data = brbt_get(tree, node);
+  if (data_in)
+    __builtin_memcpy(data, data_in, membs);
+  else
+    __builtin_memcpy(get_key(tree, data), key, key_bytes(tree));
+  sync_key(tree, node);
+  refresh(tree, node);
+  index_add(tree, node);
+
+  if (tree->_policy->insert_hook)
+    tree->_policy->insert_hook(tree, node);
+
+  return node;
+}
+
+static brbt_node
+fixup(struct brbt* tree, brbt_node h)
+{
+  assert(tree);
+  assert(h != BRBT_NIL);
+
+  if (is_red(right(h)) && !is_red(left(h)))
+    h = rotl(h);
+  if (is_red(left(h)) && is_red(left(left(h))))
+    h = rotr(h);
+  if (is_red(left(h)) && is_red(right(h)))
+    color_flip(h);
+
+  return h;
+}
+
+/* the path taken from the root during a descent.
+ * an LLRB holding at most 2^32 nodes is no deeper than
+ * 2 * log2(n + 1), so BRBT_MAX_DEPTH entries always suffice
+ */
+struct path
+{
+  brbt_node node[BRBT_MAX_DEPTH];
+
+  /* the direction taken out of node[i], 0 for left, 1 for right */
+  unsigned char dir[BRBT_MAX_DEPTH];
+
+  /* color of node[i] and its left child before the operation,
+   * used by insert to stop rebalancing early */
+  unsigned char sig[BRBT_MAX_DEPTH];
+
+  unsigned depth;
+};
+
+static inline void
+path_push(struct brbt* tree, struct path* p, brbt_node node, _Bool dir)
+{
+  assert_bounds(p->depth < BRBT_MAX_DEPTH);
+
+  p->node[p->depth] = node;
+  p->dir[p->depth] = dir;
+  p->depth++;
+}
+
+/* points the link that leads to depth d of the path at node */
+static inline void
+relink(struct brbt* tree, struct path const* p, unsigned d, brbt_node node)
+{
+  if (d == 0)
+    tree->root = node;
+  else if (p->dir[d - 1])
+    set_right(p->node[d - 1], node);
+  else
+    set_left(p->node[d - 1], node);
+}
+
+/* walks from the bottom of the path up to the root,
+ * restoring the LLRB invariants. links are only written
+ * when fixup replaced the subtree root */
+static void
+ascend(struct brbt* tree, struct path const* p)
+{
+  for (unsigned d = p->depth; d-- > 0;) {
+    brbt_node const h = p->node[d];
+    refresh(tree, h);
+
+    brbt_node const x = fixup(tree, h);
+    if (x != h)
+      relink(tree, p, d, x);
+  }
+
+  if (tree->root != BRBT_NIL)
+    set_col(tree->root, false);
+}
+
+static inline unsigned char
+signature(struct brbt* tree, brbt_node node)
+{
+  return col(node) | (is_red(left(node)) << 1);
+}
+
+/* walks down towards key, recording the path and the signature of
+ * every node on it. returns the node holding key, or BRBT_NIL when
+ * the path ends at the link the key belongs under */
+__attribute__((always_inline)) static inline brbt_node
+descend_kind(struct brbt* tree,
+             void const* key,
+             struct path* p,
+             enum brbt_key_kind const kind)
+{
+  brbt_node h = tree->root;
+
+  while (h != BRBT_NIL) {
+    int const cmp = compare_kind(tree, h, key, kind);
+    if (cmp == 0)
+      return h;
+
+    p->sig[p->depth] = signature(tree, h);
+    path_push(tree, p, h, cmp > 0);
+    h = cmp < 0 ? left(h) : right(h);
+  }
+
+  return BRBT_NIL;
+}
+
+static brbt_node
+descend(struct brbt* tree, void const* key, struct path* p)
+{
+  dispatch_kind(descend_kind, tree, key, p);
+}
+
+/* makes room for one more node, by growing the arrays or by
+ * evicting the node picked by select. the victim is deleted
+ * from the tree like any other node, so paths recorded
+ * before must be walked again if evicted is set */
+static _Bool
+make_room(struct brbt* tree, _Bool* evicted)
+{
+  *evicted = false;
+
+  /* try to reallocate, an empty allocation falls back to select.
+   * a tree at max_capacity goes straight to select, sparing the policy
+   * a resize to the same size on every eviction */
+  unsigned const max_cap = tree->_policy->max_capacity;
+  if ((max_cap == 0 || tree->capacity < max_cap) &&
+      grow(tree, tree->capacity + 1))
+    return true;
+
+  /* if we cant reallocate to gain a larger capacity,
+   * we need to maybe remove a value.
+   * without a select function, or none to pick, the insert fails
+   */
+  if (!tree->_policy->select)
+    return false;
+
+  brbt_node const victim = tree->_policy->select(tree);
+  if (victim == BRBT_NIL)
+    return false;
+
+  brbt_delete(tree, get_key(tree, brbt_get(tree, victim)));
+  count_stat(evictions, 1);
+  *evicted = true;
+
+  return has_room(tree);
+}
+
+/* links in a node for key unless it is present, which is a copy of
+ * record, or only has the key copied in for a null record */
+__attribute__((hot)) static brbt_node
+insert_impl(struct brbt* tree,
+            void const* key,
+            void const* record,
+            _Bool replace,
+            _Bool* inserted)
+{
+  struct path p;
+  p.depth = 0;
+  *inserted = false;
+
+  brbt_node h = descend(tree, key, &p);
+
+  /* evicting restructures the tree, walk down again */
+  _Bool evicted;
+  if (h == BRBT_NIL && !has_room(tree) && make_room(tree, &evicted) &&
+      evicted) {
+    p.depth = 0;
+    h = descend(tree, key, &p);
+  }
+
+  if (h != BRBT_NIL) {
+    /* a tombstone is taken over by the new record */
+    _Bool const revive = brbt_tombstone(tree, h);
+    if (revive) {
+      tomb_clear(tree, h);
+      node_drop(tree, h);
+    } else if (replace && tree->_type->deleter) {
+      tree->_type->deleter(tree, h);
+    }
+
+    if (replace || revive) {
+      if (record)
+        __builtin_memcpy(brbt_get(tree, h), record, membs);
+      sync_key(tree, h);
+
+      /* the new data may change the aggregates above it */
+      if (augmented(tree)) {
+        refresh(tree, h);
+        for (unsigned d = p.depth; d > 0;)
+          refresh(tree, p.node[--d]);
+      }
+    }
+
+    if (revive) {
+      *inserted = true;
+      if (tree->_policy->insert_hook)
+        tree->_policy->insert_hook(tree, h);
+    }
+
+    return h;
+  }
+
+  brbt_node const out = new_node(tree, record, key);
+  if (out == BRBT_NIL)
+    return BRBT_NIL;
+
+  *inserted = true;
+  relink(tree, &p, p.depth, out);
+
+  /* the tree was a valid LLRB before the insert, so fixup is a
+   * no-op on every node whose children still look the way they
+   * did before. as soon as a subtree root comes back unchanged in
+   * identity, color and left child color, nothing above it can
+   * change either, and rebalancing stops */
+  unsigned d = p.depth;
+  while (d > 0) {
+    brbt_node const h = p.node[--d];
+    refresh(tree, h);
+
+    brbt_node const x = fixup(tree, h);
+    if (x != h)
+      relink(tree, &p, d, x);
+    else if (signature(tree, h) == p.sig[d])
+      break;
+  }
+
+  /* the rest of the path only needs its augmented fields updated */
+  if (augmented(tree))
+    while (d > 0)
+      refresh(tree, p.node[--d]);
+
+  set_col(tree->root, false);
   return out;
 }
 
-brbt_node
-brbt_find(struct brbt* tree, void const* key)
+brbt_node
+brbt_insert(struct brbt* tree, void* node_in, _Bool replace)
+{
+  assert(tree);
+  assert(node_in);
+
+  _Bool inserted;
+  return insert_impl(
+    tree, get_key(tree, node_in), node_in, replace, &inserted);
+}
+
+brbt_node
+brbt_find_or_insert(struct brbt* tree, void* node_in, _Bool* inserted)
+{
+  assert(tree);
+  assert(node_in);
+  assert(inserted);
+
+  return insert_impl(tree, get_key(tree, node_in), node_in, false, inserted);
+}
+
+void*
+brbt_emplace(struct brbt* tree, void const* key, _Bool* inserted)
+{
+  assert(tree);
+  assert(key);
+  assert(key_bytes(tree) != 0);
+
+  _Bool fresh;
+  brbt_node const node = insert_impl(tree, key, NULL, false, &fresh);
+  if (inserted)
+    *inserted = fresh;
+
+  return node == BRBT_NIL ? NULL : brbt_get(tree, node);
+}
+
+/* the most keys a 2-3 tree of black height h can hold, 3^h - 1 */
+static unsigned long long
+max_keys(unsigned h)
+{
+  unsigned long long out = 1;
+  while (h--)
+    out *= 3;
+  return out - 1;
+}
+
+/* how build_range spreads n keys below a node of black height h.
+ * h is chosen such that 2^h - 1 <= n <= 3^h - 1, each level then
+ * spreads the keys evenly over either a 2-node, with a keys left of
+ * its root, or a 3-node, a black node leaning on a red left child,
+ * with a keys left of the red node and b keys between the two */
+struct range_shape
+{
+  _Bool three;
+  unsigned a;
+  unsigned b;
+};
+
+static struct range_shape
+range_shape(unsigned n, unsigned h)
+{
+  struct range_shape out;
+  out.three = n - 1 > 2 * max_keys(h - 1);
+
+  if (!out.three) {
+    out.a = n / 2;
+    out.b = 0;
+    return out;
+  }
+
+  unsigned const m = n - 2;
+  out.a = m / 3 + (m % 3 > 0);
+  out.b = m / 3 + (m % 3 > 1);
+  return out;
+}
+
+/* links a black node of the given children */
+static brbt_node
+build_node(struct brbt* tree, brbt_node root, brbt_node l, brbt_node r)
+{
+  set_left(root, l);
+  set_right(root, r);
+  set_col(root, false);
+  refresh(tree, root);
+  return root;
+}
+
+/* links the n nodes starting at lo into an LLRB of black height h */
+static brbt_node
+build_range(struct brbt* tree, brbt_node lo, unsigned n, unsigned h)
+{
+  if (n == 0)
+    return BRBT_NIL;
+
+  struct range_shape const s = range_shape(n, h);
+
+  if (!s.three) {
+    brbt_node const root = lo + s.a;
+    return build_node(tree,
+                      root,
+                      build_range(tree, lo, s.a, h - 1),
+                      build_range(tree, root + 1, n - 1 - s.a, h - 1));
+  }
+
+  brbt_node const red = lo + s.a;
+  brbt_node const root = red + 1 + s.b;
+
+  build_node(tree,
+             red,
+             build_range(tree, lo, s.a, h - 1),
+             build_range(tree, red + 1, s.b, h - 1));
+  set_col(red, true);
+
+  return build_node(
+    tree, root, red, build_range(tree, root + 1, n - 2 - s.a - s.b, h - 1));
+}
+
+/* black height of a balanced LLRB of n nodes */
+static unsigned
+build_height(unsigned n)
+{
+  unsigned h = 0;
+  while (h < 32 && (2ull << h) - 1 <= n)
+    h++;
+
+  return h;
+}
+
+/* links nodes [0, n) of the tree into a balanced LLRB */
+static brbt_node
+build_tree(struct brbt* tree, unsigned n)
+{
+  return build_range(tree, 0, n, build_height(n));
+}
+
+/* copies n sorted records in as the nodes from lo */
+static void
+build_copy(struct brbt* tree, char const* records, brbt_node lo, unsigned n)
+{
+  if (n == 0)
+    return;
+
+  char const* const src = records + (unsigned long)membs * lo;
+  if (tree->_data_stride == membs)
+    __builtin_memcpy(brbt_get(tree, lo), src, (unsigned long)membs * n);
+  else
+    for (unsigned i = 0; i < n; i++)
+      __builtin_memcpy(
+        brbt_get(tree, lo + i), src + (unsigned long)membs * i, membs);
+
+  for (unsigned i = 0; i < n; i++)
+    sync_key(tree, lo + i);
+}
+
+/* builds a range of a sorted input as build_range does,
+ * forking on the children down to the levels of fork */
+struct build_task
+{
+  struct brbt* tree;
+  struct brbt_fork const* fork;
+  unsigned depth;
+  char const* records;
+
+  brbt_node lo;
+  unsigned n;
+  unsigned h;
+  brbt_node out;
+};
+
+static void
+build_run(void* arg)
+{
+  struct build_task* const t = arg;
+  struct brbt* const tree = t->tree;
+
+  if (!t->fork || t->depth >= t->fork->levels || t->n < 2) {
+    build_copy(tree, t->records, t->lo, t->n);
+    t->out = build_range(tree, t->lo, t->n, t->h);
+    return;
+  }
+
+  struct range_shape const s = range_shape(t->n, t->h);
+  struct build_task l = *t;
+  struct build_task r = *t;
+  l.depth = r.depth = t->depth + 1;
+  l.h = r.h = t->h - 1;
+  l.n = s.a;
+
+  if (!s.three) {
+    brbt_node const root = t->lo + s.a;
+    r.lo = root + 1;
+    r.n = t->n - 1 - s.a;
+    t->fork->both(build_run, &l, &r);
+
+    build_copy(tree, t->records, root, 1);
+    t->out = build_node(tree, root, l.out, r.out);
+    return;
+  }
+
+  /* the keys between the red node and the root follow the other two */
+  brbt_node const red = t->lo + s.a;
+  brbt_node const root = red + 1 + s.b;
+  r.lo = root + 1;
+  r.n = t->n - 2 - s.a - s.b;
+  t->fork->both(build_run, &l, &r);
+
+  struct build_task m = l;
+  m.lo = red + 1;
+  m.n = s.b;
+  build_run(&m);
+
+  build_copy(tree, t->records, red, 1);
+  build_copy(tree, t->records, root, 1);
+  build_node(tree, red, l.out, m.out);
+  set_col(red, true);
+  t->out = build_node(tree, root, red, r.out);
+}
+
+_Bool
+brbt_build_sorted_fork(struct brbt* tree,
+                       void const* records,
+                       unsigned count,
+                       struct brbt_fork const* fork)
+{
+  assert(tree);
+  assert(tree->size == 0);
+
+  if (count == 0)
+    return true;
+
+  assert(records);
+
+  if (tree->capacity < count && !grow(tree, count))
+    return false;
+
+  struct build_task t;
+  t.tree = tree;
+  t.fork = fork;
+  t.depth = 0;
+  t.records = records;
+  t.lo = 0;
+  t.n = count;
+  t.h = build_height(count);
+  build_run(&t);
+
+  tree->root = t.out;
+  tree->size = count;
+
+  /* every other node lies past the high-water mark */
+  tree->first_free = BRBT_NIL;
+  tree->next_uninitialized = count;
+
+  for (brbt_node i = 0; i < count; i++)
+    index_add(tree, i);
+
+  if (tree->_policy->insert_hook)
+    for (brbt_node i = 0; i < count; i++)
+      tree->_policy->insert_hook(tree, i);
+
+  return true;
+}
+
+_Bool
+brbt_build_sorted(struct brbt* tree, void const* records, unsigned count)
+{
+  return brbt_build_sorted_fork(tree, records, count, NULL);
+}
+
+static void
+swap_bytes(char* a, char* b, unsigned n)
+{
+  char buf[64];
+
+  while (n > 0) {
+    unsigned const c = n < sizeof buf ? n : sizeof buf;
+    __builtin_memcpy(buf, a, c);
+    __builtin_memcpy(a, b, c);
+    __builtin_memcpy(b, buf, c);
+    a += c, b += c, n -= c;
+  }
+}
+
+void
+brbt_compact(struct brbt* tree, brbt_node* remap_out)
+{
+  assert(tree);
+  tomb_flush(tree);
+
+  brbt_node const hwm = tree->next_uninitialized;
+
+  if (remap_out)
+    for (brbt_node i = 0; i < tree->capacity; i++)
+      remap_out[i] = BRBT_NIL;
+
+  /* number the nodes in order, the new index of each node is kept in
+   * its next_free field. colors are lost, the tree is relinked below */
+  brbt_node stack[BRBT_MAX_DEPTH];
+  unsigned si = 0;
+  brbt_node next = 0;
+
+  for (brbt_node h = tree->root; h != BRBT_NIL || si > 0;) {
+    if (h != BRBT_NIL) {
+      assert_bounds(si < BRBT_MAX_DEPTH);
+      stack[si++] = h;
+      h = left(h);
+      continue;
+    }
+
+    h = stack[--si];
+    brbt_node const r = right(h);
+
+    if (remap_out)
+      remap_out[h] = next;
+    set_nextfree(h, next++);
+    h = r;
+  }
+
+  /* apply the permutation in place, every step puts one
+   * record into its final slot */
+  for (brbt_node i = 0; i < hwm; i++) {
+    while (left(i) != FREE_MARK && nextfree(i) != i) {
+      brbt_node const dst = nextfree(i);
+
+      if (left(dst) == FREE_MARK) {
+        __builtin_memcpy(brbt_get(tree, dst), brbt_get(tree, i), membs);
+        set_nextfree(dst, dst);
+        set_left(dst, BRBT_NIL);
+        set_left(i, FREE_MARK);
+        break;
+      }
+
+      swap_bytes(brbt_get(tree, i), brbt_get(tree, dst), membs);
+      set_nextfree(i, nextfree(dst));
+      set_nextfree(dst, dst);
+    }
+  }
+
+  for (brbt_node i = 0; i < tree->size; i++)
+    sync_key(tree, i);
+
+  tree->root = build_tree(tree, tree->size);
+  tree->first_free = BRBT_NIL;
+  tree->next_uninitialized = tree->size;
+  brbt_index_rebuild(tree);
+}
+
+/* join based bulk operations. they work on subtrees within one tree,
+ * each passed around along with its black height. no subtree they hand
+ * back has a red root, and none of them touches tree->root, so disjoint
+ * subtrees can be worked on at once */
+struct part
+{
+  brbt_node root;
+
+  /* black nodes on every path down from root, counting root */
+  unsigned bh;
+};
+
+/* nodes dropped on the way, chained through their left links.
+ * they are only freed once the whole operation is done */
+struct drops
+{
+  brbt_node head;
+  brbt_node tail;
+};
+
+static struct part
+part_of(struct brbt* tree, brbt_node h, unsigned bh)
+{
+  /* turning a red root black adds a black node to every path */
+  if (h != BRBT_NIL && col(h)) {
+    set_col(h, false);
+    bh++;
+  }
+
+  struct part out;
+  out.root = h;
+  out.bh = bh;
+  return out;
+}
+
+static struct part
+part_nil(void)
+{
+  struct part out;
+  out.root = BRBT_NIL;
+  out.bh = 0;
+  return out;
+}
+
+static struct part
+part_tree(struct brbt* tree)
+{
+  unsigned bh = 0;
+  for (brbt_node h = tree->root; h != BRBT_NIL; h = left(h))
+    bh += !col(h);
+
+  return part_of(tree, tree->root, bh);
+}
+
+/* the subtrees below the root of t */
+static void
+expose(struct brbt* tree, struct part t, struct part* l, struct part* r)
+{
+  *l = part_of(tree, left(t.root), t.bh - 1);
+  *r = part_of(tree, right(t.root), t.bh - 1);
+}
+
+/* links l, k and r into one tree, every key of l is less than the one of
+ * k, which is less than every key of r. k goes in red, in place of the
+ * subtree of the taller tree that is as high as the other one, and the
+ * path above it is fixed up as after an insert. O(difference in height) */
+static struct part
+join(struct brbt* tree, struct part l, brbt_node k, struct part r)
+{
+  if (l.bh == r.bh) {
+    set_left(k, l.root);
+    set_right(k, r.root);
+    set_col(k, false);
+    refresh(tree, k);
+    return part_of(tree, k, l.bh + 1);
+  }
+
+  struct path p;
+  p.depth = 0;
+
+  brbt_node h;
+  unsigned bh;
+
+  if (l.bh > r.bh) {
+    /* right links are black, every step sheds a black node */
+    for (h = l.root, bh = l.bh; bh > r.bh; bh--) {
+      path_push(tree, &p, h, 1);
+      h = right(h);
+    }
+
+    set_left(k, h);
+    set_right(k, r.root);
+  } else {
+    for (h = r.root, bh = r.bh; bh > l.bh || is_red(h);) {
+      path_push(tree, &p, h, 0);
+      bh -= !col(h);
+      h = left(h);
+    }
+
+    set_left(k, l.root);
+    set_right(k, h);
+  }
+
+  set_col(k, true);
+  refresh(tree, k);
+  relink(tree, &p, p.depth, k);
+
+  brbt_node top = p.node[0];
+  for (unsigned d = p.depth; d-- > 0;) {
+    brbt_node const x = p.node[d];
+    refresh(tree, x);
+
+    brbt_node const y = fixup(tree, x);
+    if (y == x)
+      continue;
+
+    if (d == 0)
+      top = y;
+    else
+      relink(tree, &p, d, y);
+  }
+
+  return part_of(tree, top, l.bh > r.bh ? l.bh : r.bh);
+}
+
+/* unlinks the largest node of t, rest receives the others */
+static brbt_node
+split_last(struct brbt* tree, struct part t, struct part* rest)
+{
+  struct part l, r;
+  expose(tree, t, &l, &r);
+
+  if (r.root == BRBT_NIL) {
+    *rest = l;
+    return t.root;
+  }
+
+  struct part m;
+  brbt_node const last = split_last(tree, r, &m);
+  *rest = join(tree, l, t.root, m);
+  return last;
+}
+
+/* join without a node in between */
+static struct part
+join2(struct brbt* tree, struct part l, struct part r)
+{
+  if (l.root == BRBT_NIL)
+    return r;
+  if (r.root == BRBT_NIL)
+    return l;
+
+  struct part rest;
+  brbt_node const k = split_last(tree, l, &rest);
+  return join(tree, rest, k, r);
+}
+
+/* splits t into the keys less than key and the keys greater than it, and
+ * returns the node holding key, unlinked, or BRBT_NIL. O(log n) */
+static brbt_node
+split(struct brbt* tree,
+      struct part t,
+      void const* key,
+      struct part* lo,
+      struct part* hi)
+{
+  if (t.root == BRBT_NIL) {
+    *lo = *hi = t;
+    return BRBT_NIL;
+  }
+
+  struct part l, r, m;
+  expose(tree, t, &l, &r);
+
+  int const cmp = compare(t.root, key);
+  if (cmp == 0) {
+    *lo = l;
+    *hi = r;
+    return t.root;
+  }
+
+  brbt_node hit;
+  if (cmp < 0) {
+    hit = split(tree, l, key, lo, &m);
+    *hi = join(tree, m, t.root, r);
+  } else {
+    hit = split(tree, r, key, &m, hi);
+    *lo = join(tree, l, t.root, m);
+  }
+
+  return hit;
+}
+
+static void
+drops_push(struct brbt* tree, struct drops* d, brbt_node h)
+{
+  set_left(h, d->head);
+  if (d->head == BRBT_NIL)
+    d->tail = h;
+  d->head = h;
+}
+
+static void
+drops_append(struct brbt* tree, struct drops* d, struct drops const* e)
+{
+  if (e->head == BRBT_NIL)
+    return;
+
+  if (d->head != BRBT_NIL)
+    set_left(e->tail, d->head);
+  else
+    d->tail = e->tail;
+  d->head = e->head;
+}
+
+static void
+drops_subtree(struct brbt* tree, struct drops* d, brbt_node h)
+{
+  if (h == BRBT_NIL)
+    return;
+
+  drops_subtree(tree, d, left(h));
+  drops_subtree(tree, d, right(h));
+  drops_push(tree, d, h);
+}
+
+/* frees the dropped nodes, with the remove hook if hook is set */
+static void
+drops_free(struct brbt* tree, struct drops const* d, _Bool hook)
+{
+  for (brbt_node h = d->head; h != BRBT_NIL;) {
+    brbt_node const next = left(h);
+
+    index_remove(tree, h);
+    if (hook)
+      node_drop(tree, h);
+    else if (tree->_type->deleter)
+      tree->_type->deleter(tree, h);
+    node_release(tree, h);
+
+    h = next;
+  }
+}
+
+enum set_op
+{
+  SET_UNION,
+  SET_INTERSECTION,
+  SET_DIFFERENCE,
+};
+
+/* one step of a set operation on the subtree a of tree. the union takes
+ * the keys of a second subtree b of tree, the others those of the subtree
+ * below other_node of other, which is only read */
+struct set_task
+{
+  enum set_op op;
+  struct brbt* tree;
+  struct brbt* other;
+  struct brbt_fork const* fork;
+  unsigned depth;
+
+  struct part a;
+  struct part b;
+  brbt_node other_node;
+
+  struct part out;
+  struct drops drops;
+};
+
+static void
+set_run(void* arg);
+
+/* runs the steps on both sides of a node, forking on the top levels */
+static void
+set_both(struct set_task* t, struct set_task* l, struct set_task* r)
+{
+  struct set_task* const sides[2] = { l, r };
+  for (unsigned i = 0; i < 2; i++) {
+    sides[i]->op = t->op;
+    sides[i]->tree = t->tree;
+    sides[i]->other = t->other;
+    sides[i]->fork = t->fork;
+    sides[i]->depth = t->depth + 1;
+    sides[i]->drops.head = BRBT_NIL;
+    sides[i]->drops.tail = BRBT_NIL;
+  }
+
+  if (t->fork && t->depth < t->fork->levels) {
+    t->fork->both(set_run, l, r);
+  } else {
+    set_run(l);
+    set_run(r);
+  }
+
+  drops_append(t->tree, &t->drops, &l->drops);
+  drops_append(t->tree, &t->drops, &r->drops);
+}
+
+/* the node of every key of a that is also in b is kept, the one of b is
+ * dropped */
+static void
+union_step(struct set_task* t)
+{
+  struct brbt* const tree = t->tree;
+
+  if (t->a.root == BRBT_NIL || t->b.root == BRBT_NIL) {
+    t->out = t->a.root == BRBT_NIL ? t->b : t->a;
+    return;
+  }
+
+  struct set_task l, r;
+  brbt_node const k = t->a.root;
+  expose(tree, t->a, &l.a, &r.a);
+
+  brbt_node const dup =
+    split(tree, t->b, get_key(tree, brbt_get(tree, k)), &l.b, &r.b);
+  if (dup != BRBT_NIL)
+    drops_push(tree, &t->drops, dup);
+
+  set_both(t, &l, &r);
+  t->out = join(tree, l.out, k, r.out);
+}
+
+static void
+intersection_step(struct set_task* t)
+{
+  struct brbt* const tree = t->tree;
+  brbt_node const o = t->other_node;
+
+  if (t->a.root == BRBT_NIL || o == BRBT_NIL) {
+    drops_subtree(tree, &t->drops, t->a.root);
+    t->out = part_nil();
+    return;
+  }
+
+  struct set_task l, r;
+  void const* const key = get_key(t->other, brbt_get(t->other, o));
+  brbt_node const hit = split(tree, t->a, key, &l.a, &r.a);
+  l.other_node = link_left(t->other, o);
+  r.other_node = link_right(t->other, o);
+
+  set_both(t, &l, &r);
+  t->out = hit != BRBT_NIL ? join(tree, l.out, hit, r.out)
+                           : join2(tree, l.out, r.out);
+}
+
+static void
+difference_step(struct set_task* t)
+{
+  struct brbt* const tree = t->tree;
+  brbt_node const o = t->other_node;
+
+  if (t->a.root == BRBT_NIL || o == BRBT_NIL) {
+    t->out = t->a;
+    return;
+  }
+
+  struct set_task l, r;
+  void const* const key = get_key(t->other, brbt_get(t->other, o));
+  brbt_node const hit = split(tree, t->a, key, &l.a, &r.a);
+  if (hit != BRBT_NIL)
+    drops_push(tree, &t->drops, hit);
+  l.other_node = link_left(t->other, o);
+  r.other_node = link_right(t->other, o);
+
+  set_both(t, &l, &r);
+  t->out = join2(tree, l.out, r.out);
+}
+
+static void
+set_run(void* arg)
+{
+  struct set_task* const t = arg;
+
+  switch (t->op) {
+    case SET_UNION:
+      union_step(t);
+      break;
+    case SET_INTERSECTION:
+      intersection_step(t);
+      break;
+    case SET_DIFFERENCE:
+      difference_step(t);
+      break;
+  }
+}
+
+static struct set_task
+set_task(enum set_op op,
+         struct brbt* tree,
+         struct brbt* other,
+         struct brbt_fork const* fork)
+{
+  struct set_task t;
+  t.op = op;
+  t.tree = tree;
+  t.other = other;
+  t.fork = fork;
+  t.depth = 0;
+  t.a = part_tree(tree);
+  t.b = part_nil();
+  t.other_node = other ? other->root : BRBT_NIL;
+  t.drops.head = BRBT_NIL;
+  t.drops.tail = BRBT_NIL;
+  return t;
+}
+
+/* moves the records of b in order into new nodes [base, base + size of b)
+ * of tree, and links them into a balanced subtree. b is left empty,
+ * having run its remove hook on every record.
+ * returns false, changing neither, if tree could not grow */
+static _Bool
+adopt(struct brbt* tree, struct brbt* b, struct part* out)
+{
+  assert(b->_type == tree->_type);
+
+  unsigned const m = b->size;
+  brbt_node const base = tree->next_uninitialized;
+  *out = part_nil();
+
+  if (m == 0)
+    return true;
+  if ((unsigned long long)base + m > BRBT_MAX_CAPACITY)
+    return false;
+  if (tree->capacity < base + m && !grow(tree, base + m))
+    return false;
+
+  brbt_node i = base;
+  brbt_for(b, x, {
+    __builtin_memcpy(brbt_get(tree, i), brbt_get(b, x), membs);
+    sync_key(tree, i);
+    if (b->_policy->remove_hook)
+      b->_policy->remove_hook(b, x);
+    i++;
+  });
+
+  tree->size += m;
+  tree->next_uninitialized = base + m;
+
+  b->size = 0;
+  b->root = BRBT_NIL;
+  b->first_free = BRBT_NIL;
+  b->next_uninitialized = 0;
+  index_reset(b);
+
+  unsigned const h = build_height(m);
+  out->root = build_range(tree, base, m, h);
+  out->bh = h;
+  return true;
+}
+
+/* indexes the nodes from base that survived, and runs the insert hook
+ * on them */
+static void
+adopt_hooks(struct brbt* tree, brbt_node base)
+{
+  for (brbt_node i = base; i < tree->next_uninitialized; i++) {
+    if (left(i) == FREE_MARK)
+      continue;
+
+    index_add(tree, i);
+    if (tree->_policy->insert_hook)
+      tree->_policy->insert_hook(tree, i);
+  }
+}
+
+_Bool
+brbt_join(struct brbt* a, struct brbt* b)
+{
+  struct brbt* const tree = a;
+  assert(a);
+  assert(b);
+  tomb_flush(a);
+  tomb_flush(b);
+
+  if (b->size == 0)
+    return true;
+
+  /* every key of a has to be less than every key of b */
+  if (a->root != BRBT_NIL) {
+    void* const first = brbt_get(b, brbt_minimum(b, b->root));
+    assert(compare(brbt_maximum(a, a->root), get_key(b, first)) > 0);
+  }
+
+  brbt_node const base = a->next_uninitialized;
+  struct part t;
+  if (!adopt(a, b, &t))
+    return false;
+
+  a->root = join2(a, part_tree(a), t).root;
+  adopt_hooks(a, base);
+  return true;
+}
+
+/* moves the subtree below h in order into nodes from *next of dst */
+static void
+move_out(struct brbt* tree, brbt_node h, struct brbt* dst, brbt_node* next)
+{
+  if (h == BRBT_NIL)
+    return;
+
+  /* released nodes lose their links */
+  brbt_node const l = left(h);
+  brbt_node const r = right(h);
+
+  move_out(tree, l, dst, next);
+
+  __builtin_memcpy(brbt_get(dst, *next), brbt_get(tree, h), membs);
+  sync_key(dst, *next);
+  (*next)++;
+
+  index_remove(tree, h);
+  if (tree->_policy->remove_hook)
+    tree->_policy->remove_hook(tree, h);
+  node_release(tree, h);
+
+  move_out(tree, r, dst, next);
+}
+
+static unsigned
+subtree_nodes(struct brbt* tree, brbt_node h)
+{
+  if (h == BRBT_NIL)
+    return 0;
+  return 1 + subtree_nodes(tree, left(h)) + subtree_nodes(tree, right(h));
+}
+
+_Bool
+brbt_split(struct brbt* tree, void const* key, struct brbt* hi)
+{
+  assert(tree);
+  assert(key);
+  assert(hi);
+  assert(hi != tree);
+  assert(hi->_type == tree->_type);
+  assert(hi->size == 0);
+  tomb_flush(tree);
+
+  struct part lo, up;
+  brbt_node const hit = split(tree, part_tree(tree), key, &lo, &up);
+  if (hit != BRBT_NIL)
+    up = join(tree, part_nil(), hit, up);
+
+  unsigned const n = subtree_nodes(tree, up.root);
+  if (hi->capacity < n && !grow(hi, n)) {
+    tree->root = join2(tree, lo, up).root;
+    return false;
+  }
+
+  /* hi holds no nodes, forget about its free list */
+  hi->first_free = BRBT_NIL;
+  hi->next_uninitialized = 0;
+
+  brbt_node next = 0;
+  move_out(tree, up.root, hi, &next);
+  tree->root = lo.root;
+
+  hi->root = build_tree(hi, n);
+  hi->size = n;
+  hi->next_uninitialized = n;
+  brbt_index_rebuild(hi);
+
+  if (hi->_policy->insert_hook)
+    for (brbt_node i = 0; i < n; i++)
+      hi->_policy->insert_hook(hi, i);
+
+  return true;
+}
+
+_Bool
+brbt_union_fork(struct brbt* a, struct brbt* b, struct brbt_fork const* fork)
+{
+  struct brbt* const tree = a;
+  assert(a);
+  assert(b);
+  assert(a != b);
+  tomb_flush(a);
+  tomb_flush(b);
+
+  brbt_node const base = a->next_uninitialized;
+  struct set_task t = set_task(SET_UNION, a, NULL, fork);
+  if (!adopt(a, b, &t.b))
+    return false;
+
+  set_run(&t);
+  a->root = t.out.root;
+
+  /* the records of b that lost to a, b already saw them leave */
+  drops_free(a, &t.drops, false);
+  adopt_hooks(a, base);
+  return true;
+}
+
+void
+brbt_intersection_fork(struct brbt* a,
+                       struct brbt* b,
+                       struct brbt_fork const* fork)
+{
+  struct brbt* const tree = a;
+  assert(a);
+  assert(b);
+  assert(a != b);
+  assert(a->_type == b->_type);
+  tomb_flush(a);
+  tomb_flush(b);
+
+  struct set_task t = set_task(SET_INTERSECTION, a, b, fork);
+  set_run(&t);
+  a->root = t.out.root;
+  drops_free(a, &t.drops, true);
+}
+
+void
+brbt_difference_fork(struct brbt* a,
+                     struct brbt* b,
+                     struct brbt_fork const* fork)
+{
+  struct brbt* const tree = a;
+  assert(a);
+  assert(b);
+  assert(a != b);
+  assert(a->_type == b->_type);
+  tomb_flush(a);
+  tomb_flush(b);
+
+  struct set_task t = set_task(SET_DIFFERENCE, a, b, fork);
+  set_run(&t);
+  a->root = t.out.root;
+  drops_free(a, &t.drops, true);
+}
+
+_Bool
+brbt_union(struct brbt* a, struct brbt* b)
+{
+  return brbt_union_fork(a, b, NULL);
+}
+
+void
+brbt_intersection(struct brbt* a, struct brbt* b)
+{
+  brbt_intersection_fork(a, b, NULL);
+}
+
+void
+brbt_difference(struct brbt* a, struct brbt* b)
+{
+  brbt_difference_fork(a, b, NULL);
+}
+
+__attribute__((always_inline)) static inline brbt_node
+find_kind(struct brbt* tree, void const* key, enum brbt_key_kind const kind)
+{
+  unsigned current_node = tree->root;
+
+  while (current_node != BRBT_NIL) {
+    int comp = compare_kind(tree, current_node, key, kind);
+
+    if (comp > 0)
+      current_node = right(current_node);
+    else if (comp < 0)
+      current_node = left(current_node);
+    else
+      return current_node;
+  }
+
+  return BRBT_NIL;
+}
+
+/* every link is loaded exactly once and checked against limit before
+ * it is followed, and the walk gives up past the deepest tree there can
+ * be, so torn links and cycles end it without leaving the arrays */
+__attribute__((always_inline)) static inline brbt_node
+find_racy_kind(struct brbt* tree,
+               void const* key,
+               unsigned limit,
+               enum brbt_key_kind const kind)
+{
+  brbt_node h = __atomic_load_n(&tree->root, __ATOMIC_RELAXED);
+
+  if (!tree->ptr || !tree->bk)
+    return BRBT_NIL;
+
+  /* racing readers stay off the counters */
+  for (unsigned depth = 0; h < limit && depth <= BRBT_MAX_DEPTH; depth++) {
+    int const comp = compare_keys(tree, key, node_key(tree, h), kind);
+    if (comp == 0)
+      return h;
+
+    struct brbt_bookkeeping_info* bk = get_bk(tree, h);
+    h = comp > 0
+          ? link_right_of(__atomic_load_n(&bk->right, __ATOMIC_RELAXED))
+          : link_widen(__atomic_load_n(&bk->left, __ATOMIC_RELAXED));
+  }
+
+  return BRBT_NIL;
+}
+
+brbt_node
+brbt_find_racy(struct brbt* tree, void const* key, unsigned limit)
+{
+  dispatch_kind(find_racy_kind, tree, key, limit);
+}
+
+/* probes the hash index, entries of other keys with the same home only
+ * cost a compare each */
+static brbt_node
+index_find(struct brbt* tree, void const* key)
+{
+  for (unsigned i = index_slot(tree, key);; i = (i + 1) & tree->_index_mask) {
+    brbt_node const node = tree->_index[i];
+    if (node == BRBT_NIL || compare(node, key) == 0)
+      return node;
+  }
+}
+
+/* the node with key, tombstones included */
+__attribute__((always_inline)) static inline brbt_node
+find_node(struct brbt* tree, void const* key)
+{
+  if (tree->_index)
+    return index_find(tree, key);
+
+  dispatch_kind(find_kind, tree, key);
+}
+
+__attribute__((hot)) brbt_node
+brbt_find(struct brbt* tree, void const* key)
+{
+  assert(tree);
+  assert(key);
+
+  brbt_node const node = find_node(tree, key);
+  if (node != BRBT_NIL && brbt_tombstone(tree, node))
+    return BRBT_NIL;
+
+  return node;
+}
+
+brbt_node
+brbt_lower_bound(struct brbt* tree, void const* key)
+{
+  assert(tree);
+  assert(key);
+
+  brbt_node best = BRBT_NIL;
+
+  for (brbt_node h = tree->root; h != BRBT_NIL;) {
+    int const cmp = compare(h, key);
+    if (cmp == 0)
+      return h;
+
+    if (cmp < 0)
+      best = h, h = left(h);
+    else
+      h = right(h);
+  }
+
+  return best;
+}
+
+brbt_node
+brbt_upper_bound(struct brbt* tree, void const* key)
+{
+  assert(tree);
+  assert(key);
+
+  brbt_node best = BRBT_NIL;
+
+  for (brbt_node h = tree->root; h != BRBT_NIL;) {
+    if (compare(h, key) < 0)
+      best = h, h = left(h);
+    else
+      h = right(h);
+  }
+
+  return best;
+}
+
+brbt_node
+brbt_floor(struct brbt* tree, void const* key)
+{
+  assert(tree);
+  assert(key);
+
+  brbt_node best = BRBT_NIL;
+
+  for (brbt_node h = tree->root; h != BRBT_NIL;) {
+    int const cmp = compare(h, key);
+    if (cmp == 0)
+      return h;
+
+    if (cmp > 0)
+      best = h, h = right(h);
+    else
+      h = left(h);
+  }
+
+  return best;
+}
+
+brbt_node
+brbt_ceil(struct brbt* tree, void const* key)
+{
+  return brbt_lower_bound(tree, key);
+}
+
+void
+brbt_range(struct brbt* tree,
+           void const* lo,
+           void const* hi,
+           brbt_iterator fn,
+           void* userdata)
+{
+  assert(tree);
+  assert(fn);
+
+  struct brbt_cursor cur = brbt_cursor(tree);
+
+  if (lo)
+    brbt_cursor_lower_bound(&cur, lo);
+  else
+    brbt_cursor_first(&cur);
+
+  for (; !brbt_cursor_at_end(&cur); brbt_cursor_next(&cur)) {
+    brbt_node const node = brbt_cursor_node(&cur);
+    if (hi && compare(node, hi) <= 0)
+      break;
+
+    fn(tree, userdata, node);
+  }
+}
+
+brbt_node
+brbt_select(struct brbt* tree, unsigned k)
+{
+  assert(tree);
+  assert(tree->_type->flags & BRBT_COUNTED);
+
+  for (brbt_node h = tree->root; h != BRBT_NIL;) {
+    unsigned const l = subtree_size(tree, left(h));
+
+    if (k < l)
+      h = left(h);
+    else if (k == l)
+      return h;
+    else
+      k -= l + 1, h = right(h);
+  }
+
+  return BRBT_NIL;
+}
+
+unsigned
+brbt_rank(struct brbt* tree, void const* key)
+{
+  assert(tree);
+  assert(key);
+  assert(tree->_type->flags & BRBT_COUNTED);
+
+  unsigned rank = 0;
+
+  for (brbt_node h = tree->root; h != BRBT_NIL;) {
+    if (compare(h, key) <= 0)
+      h = left(h);
+    else
+      rank += subtree_size(tree, left(h)) + 1, h = right(h);
+  }
+
+  return rank;
+}
+
+unsigned
+brbt_count_range(struct brbt* tree, void const* lo, void const* hi)
+{
+  unsigned const a = lo ? brbt_rank(tree, lo) : 0;
+  unsigned const b = hi ? brbt_rank(tree, hi) : tree->size;
+  return b > a ? b - a : 0;
+}
+
+void*
+brbt_aggregate_of(struct brbt* tree, brbt_node node)
+{
+  assert(tree);
+  assert(tree->_type->aggregate);
+
+  return agg(node);
+}
+
+void
+brbt_refresh(struct brbt* tree, brbt_node node)
+{
+  assert(tree);
+  assert(node != BRBT_NIL);
+
+  if (!augmented(tree))
+    return;
+
+  struct path p;
+  p.depth = 0;
+
+  brbt_node const h = descend(tree, node_key(tree, node), &p);
+  assert(h == node);
+
+  refresh(tree, h);
+  for (unsigned d = p.depth; d > 0;)
+    refresh(tree, p.node[--d]);
+}
+
+/* scratch space for partial aggregates */
+struct agg_buf
+{
+  _Alignas(16) unsigned char bytes[BRBT_AGGREGATE_MAX];
+};
+
+/* accumulates pieces of a range aggregate in order. acc and tmp
+ * swap after each combine, as the callback may not alias */
+struct agg_acc
+{
+  struct agg_buf buf[2];
+  unsigned cur;
+  _Bool empty;
+};
+
+static void
+acc_combine(struct brbt* tree,
+            struct agg_acc* acc,
+            void const* lhs,
+            brbt_node node,
+            void const* rhs)
+{
+  void* out = acc->buf[acc->cur ^ 1].bytes;
+  tree->_type->aggregate(tree, out, lhs, node, rhs);
+  acc->cur ^= 1;
+  acc->empty = false;
+}
+
+static inline void const*
+acc_get(struct agg_acc const* acc)
+{
+  return acc->empty ? NULL : acc->buf[acc->cur].bytes;
+}
+
+_Bool
+brbt_range_aggregate(struct brbt* tree,
+                     void const* lo,
+                     void const* hi,
+                     void* out)
+{
+  assert(tree);
+  assert(out);
+  assert(tree->_type->aggregate);
+
+  /* find the topmost node within the range, everything
+   * within the range lies in its subtree */
+  brbt_node split = tree->root;
+  while (split != BRBT_NIL) {
+    if (lo && compare(split, lo) > 0)
+      split = right(split);
+    else if (hi && compare(split, hi) <= 0)
+      split = left(split);
+    else
+      break;
+  }
+
+  if (split == BRBT_NIL)
+    return false;
+
+  struct agg_buf piece;
+  struct agg_acc lhs, rhs;
+  lhs.cur = rhs.cur = 0;
+  lhs.empty = rhs.empty = true;
+
+  /* walking down the left side, every node within the range
+   * brings its whole right subtree along and precedes what was
+   * collected so far */
+  for (brbt_node n = left(split); n != BRBT_NIL;) {
+    if (lo && compare(n, lo) > 0) {
+      n = right(n);
+      continue;
+    }
+
+    if (!lo) {
+      acc_combine(tree, &lhs, agg(n), BRBT_NIL, acc_get(&lhs));
+      break;
+    }
+
+    tree->_type->aggregate(
+      tree, piece.bytes, NULL, n, subtree_agg(tree, right(n)));
+    acc_combine(tree, &lhs, piece.bytes, BRBT_NIL, acc_get(&lhs));
+    n = left(n);
+  }
+
+  /* and mirrored for the right side */
+  for (brbt_node n = right(split); n != BRBT_NIL;) {
+    if (hi && compare(n, hi) <= 0) {
+      n = left(n);
+      continue;
+    }
+
+    if (!hi) {
+      acc_combine(tree, &rhs, acc_get(&rhs), BRBT_NIL, agg(n));
+      break;
+    }
+
+    tree->_type->aggregate(
+      tree, piece.bytes, subtree_agg(tree, left(n)), n, NULL);
+    acc_combine(tree, &rhs, acc_get(&rhs), BRBT_NIL, piece.bytes);
+    n = right(n);
+  }
+
+  tree->_type->aggregate(tree, out, acc_get(&lhs), split, acc_get(&rhs));
+  return true;
+}
+
+/* number of lookups brbt_find_many keeps in flight */
+#define FIND_GROUP 8
+
+static inline void
+prefetch_node(struct brbt* tree, brbt_node node)
+{
+  if (node == BRBT_NIL)
+    return;
+
+  __builtin_prefetch(get_bk(tree, node));
+  if (!tree->_type->inline_key)
+    __builtin_prefetch(get_key(tree, brbt_get(tree, node)));
+}
+
+/* interleaves FIND_GROUP descents. every lookup takes a single step
+ * per round and prefetches the node it moves to, so by the time it
+ * comes around again its next node is usually in cache */
+__attribute__((always_inline)) static inline int
+find_many_kind(struct brbt* tree,
+               void const* const* keys,
+               unsigned n,
+               brbt_node* out,
+               enum brbt_key_kind const kind)
+{
+  brbt_node node[FIND_GROUP];
+  unsigned slot[FIND_GROUP];
+  unsigned next = 0, active = 0;
+
+  for (unsigned g = 0; g < FIND_GROUP; g++) {
+    node[g] = tree->root;
+    slot[g] = next < n ? next++ : BRBT_NIL;
+    active += slot[g] != BRBT_NIL;
+  }
+
+  prefetch_node(tree, tree->root);
+
+  while (active > 0) {
+    for (unsigned g = 0; g < FIND_GROUP; g++) {
+      if (slot[g] == BRBT_NIL)
+        continue;
+
+      brbt_node const h = node[g];
+      int const comp =
+        h == BRBT_NIL ? 0 : compare_kind(tree, h, keys[slot[g]], kind);
+
+      if (comp != 0) {
+        node[g] = comp > 0 ? right(h) : left(h);
+        prefetch_node(tree, node[g]);
+        continue;
+      }
+
+      /* found or fell off the tree, start on the next key */
+      out[slot[g]] = h;
+      node[g] = tree->root;
+      slot[g] = next < n ? next++ : BRBT_NIL;
+      active -= slot[g] == BRBT_NIL;
+    }
+  }
+
+  return 0;
+}
+
+static int
+find_many(struct brbt* tree,
+          void const* const* keys,
+          unsigned n,
+          brbt_node* out)
+{
+  dispatch_kind(find_many_kind, tree, keys, n, out);
+}
+
+void
+brbt_find_many(struct brbt* tree,
+               void const* const* keys,
+               unsigned n,
+               brbt_node* out)
 {
   assert(tree);
-  assert(key);
+  assert(n == 0 || (keys && out));
 
-  unsigned current_node = tree->root;
+  if (tree->root == BRBT_NIL) {
+    for (unsigned i = 0; i < n; i++)
+      out[i] = BRBT_NIL;
+    return;
+  }
 
-  while (current_node != BRBT_NIL) {
-    int comp = compare(current_node, key);
+  find_many(tree, keys, n, out);
 
-    if (comp > 0)
-      current_node = right(current_node);
-    else if (comp < 0)
-      current_node = left(current_node);
-    else
-      return current_node;
+  if (tree->_tomb_count)
+    for (unsigned i = 0; i < n; i++)
+      if (out[i] != BRBT_NIL && brbt_tombstone(tree, out[i]))
+        out[i] = BRBT_NIL;
+}
+
+static inline int
+compare_records(struct brbt* tree, void* lhs, void* rhs)
+{
+  count_stat(compares, 1);
+  return compare_keys(
+    tree, get_key(tree, lhs), get_key(tree, rhs), tree->_type->kind);
+}
+
+static void
+sift_down(struct brbt* tree, void** records, unsigned root, unsigned end)
+{
+  for (unsigned child; (child = 2 * root + 1) < end; root = child) {
+    if (child + 1 < end &&
+        compare_records(tree, records[child], records[child + 1]) < 0)
+      child++;
+    if (compare_records(tree, records[root], records[child]) >= 0)
+      return;
+
+    void* tmp = records[root];
+    records[root] = records[child];
+    records[child] = tmp;
   }
+}
 
-  return BRBT_NIL;
+/* heapsort, keeps brbt free of allocations */
+static void
+sort_records(struct brbt* tree, void** records, unsigned n)
+{
+  for (unsigned i = n / 2; i-- > 0;)
+    sift_down(tree, records, i, n);
+
+  for (unsigned end = n; end-- > 1;) {
+    void* tmp = records[0];
+    records[0] = records[end];
+    records[end] = tmp;
+    sift_down(tree, records, 0, end);
+  }
+}
+
+void
+brbt_insert_many(struct brbt* tree,
+                 void** records,
+                 unsigned n,
+                 _Bool replace,
+                 brbt_node* out)
+{
+  assert(tree);
+  assert(n == 0 || records);
+
+  sort_records(tree, records, n);
+
+  for (unsigned i = 0; i < n; i++) {
+    brbt_node const node = brbt_insert(tree, records[i], replace);
+    if (out)
+      out[i] = node;
+  }
 }
 
 brbt_node
@@ -386,6 +2733,18 @@ brbt_minimum(struct brbt* tree, unsigned node)
   return node;
 }
 
+brbt_node
+brbt_maximum(struct brbt* tree, brbt_node node)
+{
+  assert(tree);
+  assert(node != BRBT_NIL);
+
+  while (right(node) != BRBT_NIL)
+    node = right(node);
+
+  return node;
+}
+
 static unsigned
 move_red_left(struct brbt* tree, unsigned h)
 {
@@ -395,7 +2754,7 @@ move_red_left(struct brbt* tree, unsigned h)
   color_flip(h);
 
   if (right(h) != BRBT_NIL && is_red(left(right(h)))) {
-    right(h) = rotr(right(h));
+    set_right(h, rotr(right(h)));
     h = rotl(h);
     color_flip(h);
   }
@@ -419,88 +2778,371 @@ move_red_right(struct brbt* tree, unsigned h)
   return h;
 }
 
+/* descends from node, which sits at the bottom of the path,
+ * to the smallest node of its subtree and unlinks it.
+ * the path is left holding every node that needs a fixup */
 static brbt_node
-delete_min_impl(struct brbt* tree, brbt_node h, _Bool free_node)
+unlink_min(struct brbt* tree, struct path* p, brbt_node h)
 {
-  if (!tree)
-    return 0;
-  if (h == BRBT_NIL)
-    return 0;
+  while (left(h) != BRBT_NIL) {
+    if (!is_red(left(h)) && !is_red(left(left(h)))) {
+      brbt_node const x = move_red_left(tree, h);
+      if (x != h)
+        relink(tree, p, p->depth, x);
+      h = x;
+    }
+
+    path_push(tree, p, h, 0);
+    h = left(h);
+  }
 
+  /* a node without a left child in an LLRB has no right child */
+  relink(tree, p, p->depth, BRBT_NIL);
+  return h;
+}
+
+void
+brbt_delete_min(struct brbt* tree, brbt_node node)
+{
   assert(tree);
-  assert(h != BRBT_NIL);
 
-  if (left(h) == BRBT_NIL) {
-    if (free_node)
-      node_free(tree, h);
-    return BRBT_NIL;
+  if (tree->root == BRBT_NIL)
+    return;
+
+  /* deleting inside of a subtree still has to rebalance
+   * from the root down, so go through the keyed path */
+  if (node != BRBT_NIL && node != tree->root) {
+    brbt_delete(tree, get_key(tree, brbt_get(tree, brbt_minimum(tree, node))));
+    return;
   }
-  if (!is_red(left(h)) && !is_red(left(left(h))))
-    h = move_red_left(tree, h);
 
-  left(h) = delete_min_impl(tree, left(h), free_node);
+  if (!is_red(left(tree->root)) && !is_red(right(tree->root)))
+    set_col(tree->root, true);
+
+  struct path p;
+  p.depth = 0;
 
-  return fixup(tree, h);
+  node_free(tree, unlink_min(tree, &p, tree->root));
+  ascend(tree, &p);
 }
 
-void
-brbt_delete_min(struct brbt* tree, brbt_node node)
+/* deletes a node with a given key */
+__attribute__((hot)) void
+brbt_delete(struct brbt* tree, void* key)
 {
-  if (node == BRBT_NIL)
-    node = tree->root;
+  assert(tree);
+  assert(key);
+
+  if (tree->root == BRBT_NIL)
+    return;
+
+  if (!is_red(left(tree->root)) && !is_red(right(tree->root)))
+    set_col(tree->root, true);
+
+  struct path p;
+  p.depth = 0;
+
+  brbt_node h = tree->root;
+  for (;;) {
+    brbt_node const h0 = h;
+    int cmp = compare(h, key);
+    _Bool dir;
+
+    if (cmp < 0) {
+      /* key is not within the tree */
+      if (left(h) == BRBT_NIL)
+        break;
+
+      if (!is_red(left(h)) && !is_red(left(left(h))))
+        h = move_red_left(tree, h);
+
+      dir = 0;
+    } else {
+      if (is_red(left(h))) {
+        h = rotr(h);
+        cmp = compare(h, key);
+      }
+
+      if (cmp == 0 && right(h) == BRBT_NIL) {
+        relink(tree, &p, p.depth, BRBT_NIL);
+        node_free(tree, h);
+        break;
+      }
+
+      /* key is not within the tree */
+      if (right(h) == BRBT_NIL) {
+        if (h != h0)
+          relink(tree, &p, p.depth, h);
+        break;
+      }
+
+      if (!is_red(right(h)) && !is_red(left(right(h)))) {
+        brbt_node const x = move_red_right(tree, h);
+        if (x != h)
+          cmp = compare(x, key);
+        h = x;
+      }
+
+      if (cmp == 0) {
+        /* swap the successor into the place of the deleted node */
+        relink(tree, &p, p.depth, h);
+        unsigned const hit = p.depth;
+        path_push(tree, &p, h, 1);
+
+        brbt_node const min = unlink_min(tree, &p, right(h));
+        set_left(min, left(h));
+        set_right(min, right(h));
+        set_col(min, col(h));
+        p.node[hit] = min;
+        relink(tree, &p, hit, min);
+
+        node_free(tree, h);
+        break;
+      }
+
+      dir = 1;
+    }
+
+    if (h != h0)
+      relink(tree, &p, p.depth, h);
 
-  delete_min_impl(tree, node, true);
+    path_push(tree, &p, h, dir);
+    h = dir ? right(h) : left(h);
+  }
+
+  ascend(tree, &p);
 }
 
-static brbt_node
-delete_impl(struct brbt* tree, unsigned h, void* key)
+void
+brbt_delete_deferred(struct brbt* tree, void* key)
 {
-  if (!tree)
-    return 0;
-  if (h == BRBT_NIL)
-    return 0;
-  if (!key)
-    return 0;
+  assert(tree);
+  assert(key);
+
+  brbt_node const node = find_node(tree, key);
+  if (node == BRBT_NIL || brbt_tombstone(tree, node))
+    return;
+
+  if (!tomb_fit(tree, true)) {
+    brbt_delete(tree, key);
+    return;
+  }
+
+  tree->_tombs[node / 64] |= 1ull << (node % 64);
+  tree->_tomb_count++;
+}
+
+/* tombstones deleted per sorted batch */
+#define MAINTENANCE_BATCH 64
 
+unsigned
+brbt_maintenance(struct brbt* tree, unsigned budget)
+{
   assert(tree);
-  assert(h != BRBT_NIL);
+
+  void* batch[MAINTENANCE_BATCH];
+
+  while (budget > 0 && tree->_tomb_count > 0) {
+    unsigned limit = budget < tree->_tomb_count ? budget : tree->_tomb_count;
+    if (limit > MAINTENANCE_BATCH)
+      limit = MAINTENANCE_BATCH;
+
+    /* there are at least limit tombstones, so the scan collects them
+     * before it would wrap around to where it started */
+    unsigned n = 0;
+    unsigned w = tree->_tomb_scan;
+    while (n < limit) {
+      for (unsigned long long bits = tree->_tombs[w]; bits && n < limit;
+           bits &= bits - 1)
+        batch[n++] = brbt_get(tree, w * 64 + __builtin_ctzll(bits));
+
+      if (n < limit)
+        w = (w + 1) % tree->_tomb_words;
+    }
+    tree->_tomb_scan = w;
+
+    /* records never move in a delete, the pointers stay valid */
+    sort_records(tree, batch, n);
+    for (unsigned i = 0; i < n; i++)
+      brbt_delete(tree, get_key(tree, batch[i]));
+
+    budget -= n;
+  }
+
+  return tree->_tomb_count;
+}
+
+struct brbt_cursor
+brbt_cursor(struct brbt* tree)
+{
+  struct brbt_cursor out;
+  out.tree = tree;
+  out.depth = 0;
+  return out;
+}
+
+static inline void
+cursor_push(struct brbt_cursor* cur, brbt_node node)
+{
+  struct brbt* tree = cur->tree;
+  assert_bounds(cur->depth < BRBT_MAX_DEPTH);
+  cur->path[cur->depth++] = node;
+}
+
+/* descends from node along one side, pushing every node on the way */
+static void
+cursor_dive(struct brbt_cursor* cur, brbt_node node, _Bool dir)
+{
+  struct brbt* tree = cur->tree;
+
+  while (node != BRBT_NIL) {
+    cursor_push(cur, node);
+    node = dir ? right(node) : left(node);
+  }
+}
+
+static _Bool
+cursor_step(struct brbt_cursor* cur, _Bool dir);
+
+/* moves past tombstones in direction dir */
+static _Bool
+cursor_skip(struct brbt_cursor* cur, _Bool dir)
+{
+  struct brbt* tree = cur->tree;
+
+  while (cur->depth > 0 && brbt_tombstone(tree, cur->path[cur->depth - 1]))
+    if (!cursor_step(cur, dir))
+      return false;
+
+  return cur->depth > 0;
+}
+
+void
+brbt_cursor_first(struct brbt_cursor* cur)
+{
+  cur->depth = 0;
+  cursor_dive(cur, cur->tree->root, 0);
+  cursor_skip(cur, 1);
+}
+
+void
+brbt_cursor_last(struct brbt_cursor* cur)
+{
+  cur->depth = 0;
+  cursor_dive(cur, cur->tree->root, 1);
+  cursor_skip(cur, 0);
+}
+
+/* descends towards key, and truncates the path at the last node
+ * that satisfied the bound. exact only accepts a matching node,
+ * strict skips over nodes equal to the key */
+static void
+cursor_bound(struct brbt_cursor* cur,
+             void const* key,
+             _Bool exact,
+             _Bool strict)
+{
+  struct brbt* tree = cur->tree;
   assert(key);
 
-#define del(node, key) delete_impl(tree, node, key)
-  if (compare(h, key) < 0) {
-    if (!is_red(left(h)) && !is_red(left(left(h))))
-      h = move_red_left(tree, h);
+  unsigned best = 0;
+  cur->depth = 0;
 
-    left(h) = del(left(h), key);
-  } else {
-    if (is_red(left(h)))
-      h = rotr(h);
-
-    if (compare(h, key) == 0 && (right(h) == BRBT_NIL))
-      return node_free(tree, h), BRBT_NIL;
-
-    if (!is_red(right(h)) && !is_red(left(right(h))))
-      h = move_red_right(tree, h);
-
-    if (compare(h, key) == 0) {
-      brbt_node min = brbt_minimum(tree, right(h));
-      right(h) = delete_min_impl(tree, right(h), false);
-      left(min) = left(h);
-      right(min) = right(h);
-      node_free(tree, h);
-      h = min;
+  for (brbt_node h = tree->root; h != BRBT_NIL;) {
+    cursor_push(cur, h);
+    int const cmp = compare(h, key);
+
+    if (cmp == 0 && !strict) {
+      best = cur->depth;
+      break;
+    }
+
+    if (cmp < 0) {
+      if (!exact)
+        best = cur->depth;
+      h = left(h);
     } else
-      right(h) = del(right(h), key);
+      h = right(h);
   }
 
-  return fixup(tree, h);
+  cur->depth = best;
 }
 
-/* deletes a node with a given key */
 void
-brbt_delete(struct brbt* tree, void* key)
+brbt_cursor_seek(struct brbt_cursor* cur, void const* key)
+{
+  cursor_bound(cur, key, true, false);
+
+  if (cur->depth > 0 && brbt_tombstone(cur->tree, cur->path[cur->depth - 1]))
+    cur->depth = 0;
+}
+
+void
+brbt_cursor_lower_bound(struct brbt_cursor* cur, void const* key)
+{
+  cursor_bound(cur, key, false, false);
+  cursor_skip(cur, 1);
+}
+
+void
+brbt_cursor_upper_bound(struct brbt_cursor* cur, void const* key)
+{
+  cursor_bound(cur, key, false, true);
+  cursor_skip(cur, 1);
+}
+
+/* moves to the in-order neighbour in direction dir */
+static _Bool
+cursor_step(struct brbt_cursor* cur, _Bool dir)
+{
+  struct brbt* tree = cur->tree;
+
+  if (cur->depth == 0)
+    return false;
+
+  brbt_node const h = cur->path[cur->depth - 1];
+  brbt_node const child = dir ? right(h) : left(h);
+
+  if (child != BRBT_NIL) {
+    cursor_push(cur, child);
+    cursor_dive(cur, dir ? left(child) : right(child), !dir);
+    return true;
+  }
+
+  /* climb until we leave a subtree on its far side */
+  while (--cur->depth > 0) {
+    brbt_node const from = cur->path[cur->depth];
+    brbt_node const parent = cur->path[cur->depth - 1];
+
+    if ((dir ? left(parent) : right(parent)) == from)
+      return true;
+  }
+
+  return false;
+}
+
+_Bool
+brbt_cursor_next(struct brbt_cursor* cur)
+{
+  return cursor_step(cur, 1) && cursor_skip(cur, 1);
+}
+
+_Bool
+brbt_cursor_prev(struct brbt_cursor* cur)
+{
+  return cursor_step(cur, 0) && cursor_skip(cur, 0);
+}
+
+_Bool
+brbt_cursor_at_end(struct brbt_cursor const* cur)
+{
+  return cur->depth == 0;
+}
+
+brbt_node
+brbt_cursor_node(struct brbt_cursor const* cur)
 {
-  tree->root = delete_impl(tree, tree->root, key);
+  return cur->depth == 0 ? BRBT_NIL : cur->path[cur->depth - 1];
 }
 
 brbt_node
@@ -520,3 +3162,75 @@ brbt_root(struct brbt* tree)
 {
   return tree->root;
 }
+
+void
+brbt_stats(struct brbt* tree, struct brbt_stats* out)
+{
+  assert(tree);
+  assert(out);
+
+#ifdef BRBT_STATS
+  out->counters = tree->_counters;
+#else
+  __builtin_memset(&out->counters, 0, sizeof out->counters);
+#endif
+
+  out->size = tree->size;
+  out->capacity = tree->capacity;
+  out->free_list = tree->next_uninitialized - tree->size;
+  out->untouched = tree->capacity - tree->next_uninitialized;
+
+  out->black_height = 0;
+  for (brbt_node h = tree->root; h != BRBT_NIL; h = left(h))
+    out->black_height += !col(h);
+
+  /* preorder, a pending right child for every level above */
+  brbt_node node[BRBT_MAX_DEPTH + 1];
+  unsigned depth[BRBT_MAX_DEPTH + 1];
+  unsigned top = 0;
+  unsigned long long depths = 0;
+
+  out->height = 0;
+  if (tree->root != BRBT_NIL) {
+    node[top] = tree->root;
+    depth[top++] = 0;
+  }
+
+  while (top > 0) {
+    brbt_node const h = node[--top];
+    unsigned const d = depth[top];
+
+    depths += d;
+    if (d + 1 > out->height)
+      out->height = d + 1;
+
+    assert_bounds(top + 2 <= BRBT_MAX_DEPTH + 1);
+    if (right(h) != BRBT_NIL) {
+      node[top] = right(h);
+      depth[top++] = d + 1;
+    }
+    if (left(h) != BRBT_NIL) {
+      node[top] = left(h);
+      depth[top++] = d + 1;
+    }
+  }
+
+  out->average_depth = tree->size ? (double)depths / tree->size : 0;
+}
+
+void
+brbt_stats_reset(struct brbt* tree)
+{
+  assert(tree);
+#ifdef BRBT_STATS
+  __builtin_memset(&tree->_counters, 0, sizeof tree->_counters);
+#endif
+}
+
+void
+brbt_mark_dirty(struct brbt* tree, brbt_node node)
+{
+  assert(tree);
+  assert(node < tree->capacity);
+  mark_dirty(tree, node);
+}
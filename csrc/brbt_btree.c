@@ -0,0 +1,738 @@
+#include "brbt_btree.h"
+#include "brbt_internal.h"
+
+#ifndef true
+#define true 1
+#endif
+
+#ifndef false
+#define false 0
+#endif
+
+#define assert(x)                                                              \
+  ((x) ? (void)(0)                                                             \
+       : tree->records._policy->abort(&tree->records, __LINE__))
+
+/*
+ * a B+ tree, records are only referenced from the leaves, inner nodes
+ * hold separators. key i of an inner node is no larger than any key
+ * below child i + 1, and larger than every key below child i.
+ * every node but the root holds at least half of the order in keys
+ */
+
+/* nodes start with their key count, leaves also link to the next leaf */
+struct node_head
+{
+  unsigned count;
+  brbt_node next;
+};
+
+static struct brbt_type const node_type = { .membs = BRBT_BTREE_NODE_BYTES };
+
+/* walked down path, the index of the child taken at every inner node */
+struct path
+{
+  brbt_node node[BRBT_BTREE_MAX_HEIGHT];
+  unsigned idx[BRBT_BTREE_MAX_HEIGHT];
+  unsigned depth;
+};
+
+/* bytesize of the keys copied into the nodes */
+static inline unsigned
+key_width(struct brbt_type const* type)
+{
+  return type->kind == BRBT_KEY_CUSTOM ? type->keylen : brbt_key_size(type);
+}
+
+static inline char*
+node_at(struct brbt_btree* tree, brbt_node node)
+{
+  return brbt_get(&tree->nodes, node);
+}
+
+static inline struct node_head*
+head(char* p)
+{
+  return (struct node_head*)p;
+}
+
+static inline char*
+key_at(struct brbt_btree* tree, char* p, unsigned i)
+{
+  return p + sizeof(struct node_head) + (unsigned long)tree->_key_stride * i;
+}
+
+/* records of a leaf, children of an inner node */
+static inline brbt_node*
+links(struct brbt_btree* tree, char* p)
+{
+  return (brbt_node*)(p + tree->_links_off);
+}
+
+static inline void*
+record_key(struct brbt_btree* tree, brbt_node record)
+{
+  return (char*)brbt_get(&tree->records, record) +
+         tree->records._type->keyoff;
+}
+
+static inline void
+prefetch_node(struct brbt_btree* tree, brbt_node node)
+{
+  char const* p = node_at(tree, node);
+  for (unsigned off = 0; off < BRBT_BTREE_NODE_BYTES; off += 64)
+    __builtin_prefetch(p + off);
+}
+
+struct brbt_btree
+brbt_btree_create(struct brbt_type const* type,
+                  struct brbt_policy const* policy,
+                  void* userdata)
+{
+  struct brbt_btree tree;
+  tree.records = brbt_create(type, policy, userdata);
+  tree.nodes = brbt_create(&node_type, policy, userdata);
+  tree.root = BRBT_NIL;
+  tree.height = 0;
+
+  unsigned const width = key_width(type);
+  if (width == 0 || width > BRBT_BTREE_NODE_BYTES)
+    policy->abort(&tree.records, __LINE__);
+
+  /* comparators are handed keys aligned to 8 bytes */
+  tree._key_stride =
+    type->kind == BRBT_KEY_CUSTOM ? (width + 7) / 8 * 8 : width;
+
+  /* as many keys as fit next to one link more than there are keys */
+  unsigned order = (BRBT_BTREE_NODE_BYTES - sizeof(struct node_head)) /
+                   tree._key_stride;
+  for (; order >= 3; order--) {
+    unsigned long const keys =
+      sizeof(struct node_head) + (unsigned long)tree._key_stride * order;
+    tree._links_off = (keys + 3) / 4 * 4;
+    if (tree._links_off + sizeof(brbt_node) * (order + 1) <=
+        BRBT_BTREE_NODE_BYTES)
+      break;
+  }
+
+  /* splits need at least three keys to leave both halves non-empty */
+  if (order < 3)
+    policy->abort(&tree.records, __LINE__);
+
+  tree._order = order;
+
+  /* the kernels read the keys in whole blocks, which have to stay
+   * inside the node */
+  unsigned long const blocks =
+    ((unsigned long)tree._key_stride * order + BRBT_RANK_BLOCK - 1) /
+    BRBT_RANK_BLOCK * BRBT_RANK_BLOCK;
+  tree._rank = sizeof(struct node_head) + blocks <= BRBT_BTREE_NODE_BYTES
+                 ? brbt_rank_kernel(type->kind)
+                 : NULL;
+
+  return tree;
+}
+
+void
+brbt_btree_destroy(struct brbt_btree* tree)
+{
+  brbt_destroy(&tree->records);
+
+  /* no node has a record of its own, emptied first the node array only
+   * has its arrays and side tables released */
+  tree->nodes.size = 0;
+  brbt_destroy(&tree->nodes);
+}
+
+void
+brbt_btree_clear(struct brbt_btree* tree)
+{
+  brbt_slot_clear(&tree->records);
+
+  tree->nodes.size = 0;
+  tree->nodes.first_free = BRBT_NIL;
+  tree->nodes.next_uninitialized = 0;
+
+  tree->root = BRBT_NIL;
+  tree->height = 0;
+}
+
+unsigned
+brbt_btree_size(struct brbt_btree* tree)
+{
+  return tree->records.size;
+}
+
+void*
+brbt_btree_get(struct brbt_btree* tree, brbt_node record)
+{
+  return brbt_get(&tree->records, record);
+}
+
+/* index of the first key of a node not less than key */
+__attribute__((always_inline)) static inline unsigned
+lower_kind(struct brbt_btree* tree,
+           char* p,
+           void const* key,
+           enum brbt_key_kind const kind)
+{
+  unsigned const n = head(p)->count;
+  unsigned i = 0;
+
+  if (kind != BRBT_KEY_BYTES && kind != BRBT_KEY_CUSTOM && tree->_rank)
+    return tree->_rank(key_at(tree, p, 0), n, key, false);
+
+  while (i < n &&
+         compare_keys(&tree->records, key_at(tree, p, i), key, kind) < 0)
+    i++;
+
+  return i;
+}
+
+/* index of the first key of a node greater than key,
+ * which is the child of an inner node that key lies under */
+__attribute__((always_inline)) static inline unsigned
+upper_kind(struct brbt_btree* tree,
+           char* p,
+           void const* key,
+           enum brbt_key_kind const kind)
+{
+  unsigned const n = head(p)->count;
+  unsigned i = 0;
+
+  if (kind != BRBT_KEY_BYTES && kind != BRBT_KEY_CUSTOM && tree->_rank)
+    return tree->_rank(key_at(tree, p, 0), n, key, true);
+
+  while (i < n &&
+         compare_keys(&tree->records, key_at(tree, p, i), key, kind) <= 0)
+    i++;
+
+  return i;
+}
+
+static inline int
+compare(struct brbt_btree* tree, void const* lhs, void const* rhs)
+{
+  return compare_keys(&tree->records, lhs, rhs, tree->records._type->kind);
+}
+
+static inline unsigned
+lower(struct brbt_btree* tree, char* p, void const* key)
+{
+  return lower_kind(tree, p, key, tree->records._type->kind);
+}
+
+__attribute__((always_inline)) static inline brbt_node
+find_kind(struct brbt_btree* tree,
+          void const* key,
+          enum brbt_key_kind const kind)
+{
+  brbt_node node = tree->root;
+  if (node == BRBT_NIL)
+    return BRBT_NIL;
+
+  for (unsigned h = tree->height; h > 1; h--) {
+    prefetch_node(tree, node);
+    char* p = node_at(tree, node);
+    node = links(tree, p)[upper_kind(tree, p, key, kind)];
+  }
+
+  prefetch_node(tree, node);
+  char* p = node_at(tree, node);
+  unsigned const i = lower_kind(tree, p, key, kind);
+
+  if (i < head(p)->count &&
+      compare_keys(&tree->records, key_at(tree, p, i), key, kind) == 0)
+    return links(tree, p)[i];
+
+  return BRBT_NIL;
+}
+
+brbt_node
+brbt_btree_find(struct brbt_btree* tree, void const* key)
+{
+  assert(tree);
+  assert(key);
+
+  brbt_dispatch_kind(tree->records._type->kind, find_kind, tree, key);
+}
+
+/* walks down to the leaf key belongs in, recording the inner nodes */
+static brbt_node
+descend(struct brbt_btree* tree, void const* key, struct path* p)
+{
+  brbt_node node = tree->root;
+  p->depth = 0;
+
+  for (unsigned h = tree->height; h > 1; h--) {
+    char* np = node_at(tree, node);
+    unsigned const i =
+      key ? upper_kind(tree, np, key, tree->records._type->kind) : 0;
+
+    p->node[p->depth] = node;
+    p->idx[p->depth++] = i;
+    node = links(tree, np)[i];
+  }
+
+  return node;
+}
+
+/* shifting primitives, the key count is left to the caller.
+ * a leaf has as many links as keys, an inner node one more */
+static void
+insert_key(struct brbt_btree* tree, char* p, unsigned i, void const* key)
+{
+  unsigned const n = head(p)->count;
+  __builtin_memmove(
+    key_at(tree, p, i + 1), key_at(tree, p, i), (n - i) * tree->_key_stride);
+  __builtin_memcpy(
+    key_at(tree, p, i), key, key_width(tree->records._type));
+}
+
+static void
+insert_link(struct brbt_btree* tree,
+            char* p,
+            unsigned i,
+            unsigned n,
+            brbt_node link)
+{
+  brbt_node* l = links(tree, p);
+  __builtin_memmove(l + i + 1, l + i, (n - i) * sizeof *l);
+  l[i] = link;
+}
+
+static void
+remove_key(struct brbt_btree* tree, char* p, unsigned i)
+{
+  unsigned const n = head(p)->count;
+  __builtin_memmove(key_at(tree, p, i),
+                    key_at(tree, p, i + 1),
+                    (n - i - 1) * tree->_key_stride);
+}
+
+static void
+remove_link(struct brbt_btree* tree, char* p, unsigned i, unsigned n)
+{
+  brbt_node* l = links(tree, p);
+  __builtin_memmove(l + i, l + i + 1, (n - i - 1) * sizeof *l);
+}
+
+static inline void
+copy_key(struct brbt_btree* tree, void* dst, void const* src)
+{
+  __builtin_memcpy(dst, src, key_width(tree->records._type));
+}
+
+/* splits the full node n into n and r while inserting key at i, along
+ * with link as record of a leaf or as right hand child of an inner node.
+ * the key r is accounted by in the parent is written to sep */
+static void
+split(struct brbt_btree* tree,
+      brbt_node n,
+      brbt_node r,
+      unsigned i,
+      void const* key,
+      brbt_node link,
+      _Bool inner,
+      void* sep)
+{
+  _Alignas(8) unsigned char keys[2 * BRBT_BTREE_NODE_BYTES];
+  brbt_node kids[BRBT_BTREE_NODE_BYTES / sizeof(brbt_node) + 2];
+
+  unsigned const order = tree->_order;
+  unsigned const stride = tree->_key_stride;
+  unsigned const total = order + 1;
+  char* np = node_at(tree, n);
+  char* rp = node_at(tree, r);
+
+  /* lay the entries out in order, as if the node had room */
+  __builtin_memcpy(keys, key_at(tree, np, 0), i * stride);
+  copy_key(tree, keys + i * stride, key);
+  __builtin_memcpy(
+    keys + (i + 1) * stride, key_at(tree, np, i), (order - i) * stride);
+
+  unsigned const at = i + inner;
+  unsigned const nlinks = order + inner;
+  __builtin_memcpy(kids, links(tree, np), at * sizeof *kids);
+  kids[at] = link;
+  __builtin_memcpy(
+    kids + at + 1, links(tree, np) + at, (nlinks - at) * sizeof *kids);
+
+  struct node_head* nh = head(np);
+  struct node_head* rh = head(rp);
+
+  if (!inner) {
+    /* leaves keep every key, r starts with the separator */
+    unsigned const left = (total + 1) / 2;
+    nh->count = left;
+    rh->count = total - left;
+
+    __builtin_memcpy(key_at(tree, np, 0), keys, left * stride);
+    __builtin_memcpy(links(tree, np), kids, left * sizeof *kids);
+    __builtin_memcpy(
+      key_at(tree, rp, 0), keys + left * stride, rh->count * stride);
+    __builtin_memcpy(links(tree, rp), kids + left, rh->count * sizeof *kids);
+
+    rh->next = nh->next;
+    nh->next = r;
+    copy_key(tree, sep, key_at(tree, rp, 0));
+    return;
+  }
+
+  /* inner nodes move the middle key up */
+  unsigned const m = total / 2;
+  nh->count = m;
+  rh->count = total - m - 1;
+  rh->next = BRBT_NIL;
+
+  __builtin_memcpy(key_at(tree, np, 0), keys, m * stride);
+  __builtin_memcpy(links(tree, np), kids, (m + 1) * sizeof *kids);
+  copy_key(tree, sep, keys + m * stride);
+  __builtin_memcpy(
+    key_at(tree, rp, 0), keys + (m + 1) * stride, rh->count * stride);
+  __builtin_memcpy(
+    links(tree, rp), kids + m + 1, (rh->count + 1) * sizeof *kids);
+}
+
+/* inserts key and link into the leaf at i, splitting nodes up the path
+ * as they overflow. enough nodes must have been reserved */
+static void
+insert_up(struct brbt_btree* tree,
+          struct path const* p,
+          brbt_node node,
+          unsigned i,
+          void const* key,
+          brbt_node link)
+{
+  _Alignas(8) unsigned char sep[2][BRBT_BTREE_NODE_BYTES];
+  unsigned d = p->depth;
+  _Bool inner = false;
+
+  for (unsigned flip = 0;; flip ^= 1) {
+    char* np = node_at(tree, node);
+    unsigned const n = head(np)->count;
+
+    if (n < tree->_order) {
+      insert_key(tree, np, i, key);
+      insert_link(tree, np, i + inner, n + inner, link);
+      head(np)->count = n + 1;
+      return;
+    }
+
+    brbt_node const r = brbt_slot_alloc(&tree->nodes);
+    split(tree, node, r, i, key, link, inner, sep[flip]);
+    key = sep[flip];
+    link = r;
+
+    /* the root split, the tree grows a level */
+    if (d == 0) {
+      brbt_node const root = brbt_slot_alloc(&tree->nodes);
+      char* rp = node_at(tree, root);
+      head(rp)->count = 1;
+      head(rp)->next = BRBT_NIL;
+      copy_key(tree, key_at(tree, rp, 0), key);
+      links(tree, rp)[0] = node;
+      links(tree, rp)[1] = r;
+
+      tree->root = root;
+      tree->height++;
+      return;
+    }
+
+    d--;
+    node = p->node[d];
+    i = p->idx[d];
+    inner = true;
+  }
+}
+
+/* makes room for a record by deleting the one picked by select */
+static _Bool
+evict(struct brbt_btree* tree)
+{
+  brbt_policy_select select = tree->records._policy->select;
+  if (!select)
+    return false;
+
+  brbt_node const victim = select(&tree->records);
+  if (victim == BRBT_NIL)
+    return false;
+
+  unsigned const size = tree->records.size;
+  brbt_btree_delete(tree, record_key(tree, victim));
+  return tree->records.size < size;
+}
+
+brbt_node
+brbt_btree_insert(struct brbt_btree* tree, void* record, _Bool replace)
+{
+  assert(tree);
+  assert(record);
+
+  void const* key = (char*)record + tree->records._type->keyoff;
+  struct path p;
+  brbt_node leaf;
+  unsigned i = 0;
+
+  for (;;) {
+    leaf = descend(tree, key, &p);
+
+    if (leaf != BRBT_NIL) {
+      char* lp = node_at(tree, leaf);
+      i = lower(tree, lp, key);
+
+      if (i < head(lp)->count && compare(tree, key_at(tree, lp, i), key) == 0) {
+        brbt_node const found = links(tree, lp)[i];
+        if (replace) {
+          if (tree->records._type->deleter)
+            tree->records._type->deleter(&tree->records, found);
+          __builtin_memcpy(brbt_get(&tree->records, found),
+                           record,
+                           tree->records._type->membs);
+        }
+        return found;
+      }
+    }
+
+    /* a split at every level and a new root at worst */
+    if (!brbt_slot_reserve(&tree->nodes, tree->height + 1))
+      return BRBT_NIL;
+
+    /* a full tree at max_capacity goes straight to select, sparing the
+     * policy a resize to the same size on every eviction */
+    unsigned const max_cap = tree->records._policy->max_capacity;
+    if (tree->records.size < tree->records.capacity ||
+        ((max_cap == 0 || tree->records.capacity < max_cap) &&
+         brbt_slot_reserve(&tree->records, 1)))
+      break;
+
+    /* evicting restructures the tree, walk down again */
+    if (!evict(tree))
+      return BRBT_NIL;
+  }
+
+  brbt_node const out = brbt_slot_alloc(&tree->records);
+  __builtin_memcpy(
+    brbt_get(&tree->records, out), record, tree->records._type->membs);
+
+  if (leaf == BRBT_NIL) {
+    leaf = brbt_slot_alloc(&tree->nodes);
+    char* lp = node_at(tree, leaf);
+    head(lp)->count = 0;
+    head(lp)->next = BRBT_NIL;
+
+    tree->root = leaf;
+    tree->height = 1;
+    p.depth = 0;
+  }
+
+  insert_up(tree, &p, leaf, i, record_key(tree, out), out);
+
+  if (tree->records._policy->insert_hook)
+    tree->records._policy->insert_hook(&tree->records, out);
+
+  return out;
+}
+
+/* moves a key from the left sibling l into the front of node,
+ * the separator between them sits at s in the parent */
+static void
+borrow_left(struct brbt_btree* tree,
+            char* pp,
+            unsigned s,
+            char* lp,
+            char* np,
+            _Bool inner)
+{
+  unsigned const ln = head(lp)->count;
+  unsigned const n = head(np)->count;
+
+  if (!inner) {
+    insert_key(tree, np, 0, key_at(tree, lp, ln - 1));
+    insert_link(tree, np, 0, n, links(tree, lp)[ln - 1]);
+    copy_key(tree, key_at(tree, pp, s), key_at(tree, np, 0));
+  } else {
+    insert_key(tree, np, 0, key_at(tree, pp, s));
+    insert_link(tree, np, 0, n + 1, links(tree, lp)[ln]);
+    copy_key(tree, key_at(tree, pp, s), key_at(tree, lp, ln - 1));
+  }
+
+  head(np)->count = n + 1;
+  head(lp)->count = ln - 1;
+}
+
+/* moves a key from the right sibling r onto the end of node,
+ * the separator between them sits at s in the parent */
+static void
+borrow_right(struct brbt_btree* tree,
+             char* pp,
+             unsigned s,
+             char* np,
+             char* rp,
+             _Bool inner)
+{
+  unsigned const n = head(np)->count;
+  unsigned const rn = head(rp)->count;
+
+  if (!inner) {
+    copy_key(tree, key_at(tree, np, n), key_at(tree, rp, 0));
+    links(tree, np)[n] = links(tree, rp)[0];
+    remove_key(tree, rp, 0);
+    remove_link(tree, rp, 0, rn);
+    copy_key(tree, key_at(tree, pp, s), key_at(tree, rp, 0));
+  } else {
+    copy_key(tree, key_at(tree, np, n), key_at(tree, pp, s));
+    links(tree, np)[n + 1] = links(tree, rp)[0];
+    copy_key(tree, key_at(tree, pp, s), key_at(tree, rp, 0));
+    remove_key(tree, rp, 0);
+    remove_link(tree, rp, 0, rn + 1);
+  }
+
+  head(np)->count = n + 1;
+  head(rp)->count = rn - 1;
+}
+
+/* appends the right sibling r to l, dropping the separator at s
+ * from the parent. r is released */
+static void
+merge(struct brbt_btree* tree,
+      char* pp,
+      unsigned s,
+      char* lp,
+      brbt_node r,
+      _Bool inner)
+{
+  char* rp = node_at(tree, r);
+  unsigned const stride = tree->_key_stride;
+  unsigned ln = head(lp)->count;
+  unsigned const rn = head(rp)->count;
+
+  if (!inner) {
+    head(lp)->next = head(rp)->next;
+  } else {
+    /* the separator comes down between the two halves */
+    copy_key(tree, key_at(tree, lp, ln), key_at(tree, pp, s));
+    ln++;
+  }
+
+  __builtin_memcpy(key_at(tree, lp, ln), key_at(tree, rp, 0), rn * stride);
+  __builtin_memcpy(links(tree, lp) + ln,
+                   links(tree, rp),
+                   (rn + inner) * sizeof(brbt_node));
+  head(lp)->count = ln + rn;
+
+  unsigned const pn = head(pp)->count;
+  remove_key(tree, pp, s);
+  remove_link(tree, pp, s + 1, pn + 1);
+  head(pp)->count = pn - 1;
+
+  brbt_slot_release(&tree->nodes, r);
+}
+
+/* restores the minimum fill from node up the path */
+static void
+rebalance(struct brbt_btree* tree, struct path const* p, brbt_node node)
+{
+  unsigned const min = tree->_order / 2;
+  _Bool inner = false;
+
+  for (unsigned d = p->depth;; d--) {
+    char* np = node_at(tree, node);
+
+    if (d == 0) {
+      /* an empty root goes, an inner one hands over to its only child */
+      if (head(np)->count == 0) {
+        tree->root = inner ? links(tree, np)[0] : BRBT_NIL;
+        tree->height--;
+        brbt_slot_release(&tree->nodes, node);
+      }
+      return;
+    }
+
+    if (head(np)->count >= min)
+      return;
+
+    brbt_node const parent = p->node[d - 1];
+    unsigned const idx = p->idx[d - 1];
+    char* pp = node_at(tree, parent);
+
+    if (idx > 0) {
+      char* lp = node_at(tree, links(tree, pp)[idx - 1]);
+      if (head(lp)->count > min) {
+        borrow_left(tree, pp, idx - 1, lp, np, inner);
+        return;
+      }
+      merge(tree, pp, idx - 1, lp, node, inner);
+    } else {
+      brbt_node const r = links(tree, pp)[1];
+      char* rp = node_at(tree, r);
+      if (head(rp)->count > min) {
+        borrow_right(tree, pp, 0, np, rp, inner);
+        return;
+      }
+      merge(tree, pp, 0, np, r, inner);
+    }
+
+    node = parent;
+    inner = true;
+  }
+}
+
+void
+brbt_btree_delete(struct brbt_btree* tree, void const* key)
+{
+  assert(tree);
+  assert(key);
+
+  if (tree->root == BRBT_NIL)
+    return;
+
+  struct path p;
+  brbt_node const leaf = descend(tree, key, &p);
+  char* lp = node_at(tree, leaf);
+  unsigned const i = lower(tree, lp, key);
+
+  /* key is not within the tree */
+  if (i >= head(lp)->count || compare(tree, key_at(tree, lp, i), key) != 0)
+    return;
+
+  brbt_node const record = links(tree, lp)[i];
+  unsigned const n = head(lp)->count;
+  remove_key(tree, lp, i);
+  remove_link(tree, lp, i, n);
+  head(lp)->count = n - 1;
+
+  rebalance(tree, &p, leaf);
+  brbt_slot_free(&tree->records, record);
+}
+
+void
+brbt_btree_range(struct brbt_btree* tree,
+                 void const* lo,
+                 void const* hi,
+                 brbt_iterator fn,
+                 void* userdata)
+{
+  assert(tree);
+  assert(fn);
+
+  if (tree->root == BRBT_NIL)
+    return;
+
+  struct path p;
+  brbt_node node = descend(tree, lo, &p);
+  unsigned i = lo ? lower(tree, node_at(tree, node), lo) : 0;
+
+  while (node != BRBT_NIL) {
+    char* np = node_at(tree, node);
+
+    for (; i < head(np)->count; i++) {
+      if (hi && compare(tree, key_at(tree, np, i), hi) >= 0)
+        return;
+      fn(&tree->records, userdata, links(tree, np)[i]);
+    }
+
+    node = head(np)->next;
+    i = 0;
+  }
+}
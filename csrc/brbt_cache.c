@@ -0,0 +1,341 @@
+#include "brbt_cache.h"
+
+#ifndef true
+#define true 1
+#endif
+
+#ifndef false
+#define false 0
+#endif
+
+#define assert(x) ((x) ? (void)(0) : tree->_policy->abort(tree, __LINE__))
+
+/* the policy a tree points at is the first member of its cache */
+static inline struct brbt_cache*
+cache_of(struct brbt* tree)
+{
+  return (struct brbt_cache*)tree->_policy;
+}
+
+static inline _Bool
+uses_list(struct brbt_cache const* cache)
+{
+  return cache->kind == BRBT_CACHE_FIFO || cache->kind == BRBT_CACHE_LRU;
+}
+
+/* appends node at the newest end */
+static void
+list_push(struct brbt_cache* cache, brbt_node node)
+{
+  cache->prev[node] = cache->tail;
+  cache->next[node] = BRBT_NIL;
+
+  if (cache->tail != BRBT_NIL)
+    cache->next[cache->tail] = node;
+  else
+    cache->head = node;
+
+  cache->tail = node;
+}
+
+static void
+list_unlink(struct brbt_cache* cache, brbt_node node)
+{
+  brbt_node const p = cache->prev[node];
+  brbt_node const n = cache->next[node];
+
+  if (p != BRBT_NIL)
+    cache->next[p] = n;
+  else
+    cache->head = n;
+
+  if (n != BRBT_NIL)
+    cache->prev[n] = p;
+  else
+    cache->tail = p;
+}
+
+/* resizes the state arrays of the kind in use to n entries */
+static _Bool
+state_resize(struct brbt_cache* cache, unsigned n)
+{
+  if (uses_list(cache)) {
+    brbt_node* prev = realloc(cache->prev, sizeof(brbt_node) * n);
+    if (prev)
+      cache->prev = prev;
+
+    brbt_node* next = realloc(cache->next, sizeof(brbt_node) * n);
+    if (next)
+      cache->next = next;
+
+    if (!prev || !next)
+      return false;
+  } else {
+    unsigned* count = realloc(cache->count, sizeof(unsigned) * n);
+    if (!count)
+      return false;
+
+    for (unsigned i = cache->state_capacity; i < n; i++)
+      count[i] = 0;
+    cache->count = count;
+  }
+
+  cache->state_capacity = n;
+  return true;
+}
+
+static struct brbt_allocator_out
+cache_resize(struct brbt* tree,
+             enum brbt_allocation_request req,
+             unsigned min_capacity)
+{
+  struct brbt_cache* cache = cache_of(tree);
+  struct brbt_allocator_out out =
+    brbt_default_policy_resize(tree, req, min_capacity);
+
+  if (!out.data_array || !out.bk_array || out.size <= cache->state_capacity)
+    return out;
+
+  /* the arrays have moved already, but the new nodes have no state */
+  if (!state_resize(cache, out.size))
+    out.size = brbt_capacity(tree);
+
+  return out;
+}
+
+static void
+cache_free(struct brbt* tree)
+{
+  struct brbt_cache* cache = cache_of(tree);
+
+  brbt_default_policy_free(tree);
+
+  free(cache->prev);
+  free(cache->next);
+  free(cache->count);
+  cache->prev = NULL;
+  cache->next = NULL;
+  cache->count = NULL;
+  cache->state_capacity = 0;
+  cache->head = BRBT_NIL;
+  cache->tail = BRBT_NIL;
+  cache->hand = 0;
+}
+
+static void
+cache_insert_hook(struct brbt* tree, brbt_node node)
+{
+  struct brbt_cache* cache = cache_of(tree);
+  assert(node < cache->state_capacity);
+
+  if (uses_list(cache))
+    list_push(cache, node);
+  else
+    cache->count[node] = 1;
+}
+
+static void
+cache_remove_hook(struct brbt* tree, brbt_node node)
+{
+  struct brbt_cache* cache = cache_of(tree);
+  assert(node < cache->state_capacity);
+
+  if (uses_list(cache))
+    list_unlink(cache, node);
+  else
+    cache->count[node] = 0;
+}
+
+static inline unsigned
+xorshift(struct brbt_cache* cache)
+{
+  unsigned x = cache->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  cache->seed = x;
+  return x;
+}
+
+/* sweeps the hand over the nodes, taking away one chance
+ * from every referenced node until it finds an unreferenced one */
+static brbt_node
+clock_select(struct brbt* tree, struct brbt_cache* cache)
+{
+  unsigned const cap = brbt_capacity(tree);
+
+  for (unsigned long i = 0; i < 2ul * cap + 1; i++) {
+    brbt_node const node = cache->hand;
+    cache->hand = (cache->hand + 1 < cap) ? cache->hand + 1 : 0;
+
+    if (cache->count[node] == 1)
+      return node;
+    if (cache->count[node] > 1)
+      cache->count[node] = 1;
+  }
+
+  return BRBT_NIL;
+}
+
+/* picks the least used of a few random nodes, and ages the
+ * rest so that past popularity does not pin them forever */
+static brbt_node
+lfu_select(struct brbt* tree, struct brbt_cache* cache)
+{
+  unsigned const cap = brbt_capacity(tree);
+  brbt_node samples[BRBT_CACHE_LFU_SAMPLES];
+  unsigned n = 0;
+
+  /* select only runs on a full tree, so misses are rare */
+  for (unsigned tries = 0; n < BRBT_CACHE_LFU_SAMPLES &&
+                           tries < 4 * BRBT_CACHE_LFU_SAMPLES;
+       tries++) {
+    brbt_node const node = xorshift(cache) % cap;
+    if (cache->count[node] != 0)
+      samples[n++] = node;
+  }
+
+  if (n == 0)
+    return BRBT_NIL;
+
+  brbt_node victim = samples[0];
+  for (unsigned i = 1; i < n; i++)
+    if (cache->count[samples[i]] < cache->count[victim])
+      victim = samples[i];
+
+  for (unsigned i = 0; i < n; i++)
+    if (cache->count[samples[i]] > 1)
+      cache->count[samples[i]] /= 2;
+
+  return victim;
+}
+
+static brbt_node
+cache_select(struct brbt* tree)
+{
+  struct brbt_cache* cache = cache_of(tree);
+
+  switch (cache->kind) {
+    case BRBT_CACHE_FIFO:
+    case BRBT_CACHE_LRU:
+      return cache->head;
+    case BRBT_CACHE_CLOCK:
+      return clock_select(tree, cache);
+    case BRBT_CACHE_LFU:
+      return lfu_select(tree, cache);
+  }
+
+  return BRBT_NIL;
+}
+
+void
+brbt_cache_init(struct brbt_cache* cache,
+                enum brbt_cache_kind kind,
+                unsigned max_capacity)
+{
+  cache->policy = brbt_create_default_policy();
+  cache->policy.insert_hook = cache_insert_hook;
+  cache->policy.remove_hook = cache_remove_hook;
+  cache->policy.resize = cache_resize;
+  cache->policy.free = cache_free;
+  cache->policy.select = cache_select;
+  cache->policy.max_capacity = max_capacity;
+  cache->policy.pinned = 1;
+
+  cache->kind = kind;
+  cache->prev = NULL;
+  cache->next = NULL;
+  cache->count = NULL;
+  cache->state_capacity = 0;
+  cache->head = BRBT_NIL;
+  cache->tail = BRBT_NIL;
+  cache->hand = 0;
+  cache->seed = 2463534242u;
+}
+
+void
+brbt_cache_touch(struct brbt* tree, brbt_node node)
+{
+  struct brbt_cache* cache = cache_of(tree);
+  assert(node < cache->state_capacity);
+
+  switch (cache->kind) {
+    case BRBT_CACHE_FIFO:
+      break;
+
+    case BRBT_CACHE_LRU:
+      if (cache->tail != node) {
+        list_unlink(cache, node);
+        list_push(cache, node);
+      }
+      break;
+
+    case BRBT_CACHE_CLOCK:
+      cache->count[node] = 2;
+      break;
+
+    case BRBT_CACHE_LFU:
+      if (cache->count[node] < (unsigned)-1)
+        cache->count[node]++;
+      break;
+  }
+}
+
+brbt_node
+brbt_cache_find(struct brbt* tree, void const* key)
+{
+  brbt_node const node = brbt_find(tree, key);
+  if (node != BRBT_NIL)
+    brbt_cache_touch(tree, node);
+  return node;
+}
+
+void
+brbt_cache_remap(struct brbt* tree, brbt_node const* remap)
+{
+  struct brbt_cache* cache = cache_of(tree);
+  unsigned const cap = brbt_capacity(tree);
+  unsigned const n = cache->state_capacity;
+
+  assert(remap);
+  assert(cap <= n);
+
+  if (uses_list(cache)) {
+    brbt_node* prev = malloc(sizeof(brbt_node) * n);
+    brbt_node* next = malloc(sizeof(brbt_node) * n);
+    assert(prev && next);
+
+    for (unsigned i = 0; i < cap; i++) {
+      if (remap[i] == BRBT_NIL)
+        continue;
+
+      brbt_node const p = cache->prev[i];
+      brbt_node const x = cache->next[i];
+      prev[remap[i]] = (p == BRBT_NIL) ? BRBT_NIL : remap[p];
+      next[remap[i]] = (x == BRBT_NIL) ? BRBT_NIL : remap[x];
+    }
+
+    if (cache->head != BRBT_NIL) {
+      cache->head = remap[cache->head];
+      cache->tail = remap[cache->tail];
+    }
+
+    free(cache->prev);
+    free(cache->next);
+    cache->prev = prev;
+    cache->next = next;
+  } else {
+    unsigned* count = malloc(sizeof(unsigned) * n);
+    assert(count);
+
+    for (unsigned i = 0; i < n; i++)
+      count[i] = 0;
+    for (unsigned i = 0; i < cap; i++)
+      if (remap[i] != BRBT_NIL)
+        count[remap[i]] = cache->count[i];
+
+    free(cache->count);
+    cache->count = count;
+    cache->hand = 0;
+  }
+}
@@ -0,0 +1,204 @@
+/* for the writer preferring rwlocks of glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "brbt_concurrent.h"
+#include "brbt_internal.h"
+
+#ifndef true
+#define true 1
+#endif
+
+#ifndef false
+#define false 0
+#endif
+
+#define assert(x) ((x) ? (void)(0) : c->tree._policy->abort(&c->tree, __LINE__))
+
+/* a reader that saw the number before a write also sees it changed
+ * after, as soon as it saw any of what the write did */
+static void
+write_begin(struct brbt_concurrent* c)
+{
+  if (c->mode == BRBT_CONCURRENT_RWLOCK) {
+    pthread_rwlock_wrlock(&c->rwlock);
+    return;
+  }
+
+  pthread_mutex_lock(&c->writer);
+  unsigned long const seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(struct brbt_concurrent* c)
+{
+  if (c->mode == BRBT_CONCURRENT_RWLOCK) {
+    pthread_rwlock_unlock(&c->rwlock);
+    return;
+  }
+
+  unsigned long const seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->seq, seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&c->writer);
+}
+
+static brbt_node
+find_copy(struct brbt_concurrent* c, void const* key, void* out)
+{
+  brbt_node const node = brbt_find(&c->tree, key);
+  if (node != BRBT_NIL && out)
+    __builtin_memcpy(out, brbt_get(&c->tree, node), c->tree._type->membs);
+  return node;
+}
+
+/* one lock free attempt at a find, false if a write got in the way */
+static _Bool
+find_optimistic(struct brbt_concurrent* c,
+                void const* key,
+                void* out,
+                brbt_node* found)
+{
+  unsigned long const seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1)
+    return false;
+
+  brbt_node const node = brbt_find_racy(&c->tree, key, c->_limit);
+  if (node != BRBT_NIL && out)
+    __builtin_memcpy(out, brbt_get(&c->tree, node), c->tree._type->membs);
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq)
+    return false;
+
+  *found = node;
+  return true;
+}
+
+_Bool
+brbt_concurrent_init(struct brbt_concurrent* c,
+                     struct brbt_type const* type,
+                     struct brbt_policy const* policy,
+                     void* userdata,
+                     enum brbt_concurrency mode)
+{
+  c->tree = brbt_create(type, policy, userdata);
+  c->mode = mode;
+  c->seq = 0;
+  c->_limit = 0;
+
+  /* readers come in a steady stream, a lock preferring them would
+   * never let the writer in */
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+  int const err = pthread_rwlock_init(&c->rwlock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  if (err != 0) {
+    brbt_destroy(&c->tree);
+    return false;
+  }
+
+  if (pthread_mutex_init(&c->writer, NULL) != 0) {
+    pthread_rwlock_destroy(&c->rwlock);
+    brbt_destroy(&c->tree);
+    return false;
+  }
+
+  /* reserving everything on an empty tree allocates the arrays once,
+   * later inserts never grow them and evict or fail instead */
+  if (mode == BRBT_CONCURRENT_OPTIMISTIC) {
+    if (policy->max_capacity == 0 ||
+        !brbt_slot_reserve(&c->tree, policy->max_capacity)) {
+      brbt_concurrent_destroy(c);
+      return false;
+    }
+    c->_limit = brbt_capacity(&c->tree);
+  }
+
+  return true;
+}
+
+void
+brbt_concurrent_destroy(struct brbt_concurrent* c)
+{
+  brbt_destroy(&c->tree);
+  pthread_mutex_destroy(&c->writer);
+  pthread_rwlock_destroy(&c->rwlock);
+}
+
+brbt_node
+brbt_concurrent_find(struct brbt_concurrent* c, void const* key, void* out)
+{
+  assert(key);
+
+  brbt_node node;
+
+  if (c->mode == BRBT_CONCURRENT_RWLOCK) {
+    pthread_rwlock_rdlock(&c->rwlock);
+    node = find_copy(c, key, out);
+    pthread_rwlock_unlock(&c->rwlock);
+    return node;
+  }
+
+  for (unsigned tries = 0; tries < BRBT_CONCURRENT_RETRIES; tries++)
+    if (find_optimistic(c, key, out, &node))
+      return node;
+
+  /* a steady stream of writes starves the readers, queue up with them */
+  pthread_mutex_lock(&c->writer);
+  node = find_copy(c, key, out);
+  pthread_mutex_unlock(&c->writer);
+  return node;
+}
+
+brbt_node
+brbt_concurrent_insert(struct brbt_concurrent* c, void* record, _Bool replace)
+{
+  write_begin(c);
+  brbt_node const node = brbt_insert(&c->tree, record, replace);
+  write_end(c);
+  return node;
+}
+
+void
+brbt_concurrent_delete(struct brbt_concurrent* c, void* key)
+{
+  write_begin(c);
+  brbt_delete(&c->tree, key);
+  write_end(c);
+}
+
+void
+brbt_concurrent_write(struct brbt_concurrent* c,
+                      brbt_concurrent_fn fn,
+                      void* userdata)
+{
+  write_begin(c);
+  fn(&c->tree, userdata);
+  write_end(c);
+}
+
+void
+brbt_concurrent_read(struct brbt_concurrent* c,
+                     brbt_concurrent_fn fn,
+                     void* userdata)
+{
+  if (c->mode == BRBT_CONCURRENT_RWLOCK) {
+    pthread_rwlock_rdlock(&c->rwlock);
+    fn(&c->tree, userdata);
+    pthread_rwlock_unlock(&c->rwlock);
+    return;
+  }
+
+  pthread_mutex_lock(&c->writer);
+  fn(&c->tree, userdata);
+  pthread_mutex_unlock(&c->writer);
+}
@@ -0,0 +1,634 @@
+/* for the mmap extensions under a strict -std */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include "brbt_file.h"
+#include "brbt_internal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef true
+#define true 1
+#endif
+
+#ifndef false
+#define false 0
+#endif
+
+#define assert(x) ((x) ? (void)(0) : tree->_policy->abort(tree, __LINE__))
+
+#if defined(BRBT_BOOKKEEPING_SMALL)
+#define BOOKKEEPING 2
+#elif defined(BRBT_BOOKKEEPING_PACKED)
+#define BOOKKEEPING 1
+#else
+#define BOOKKEEPING 0
+#endif
+
+#define BYTE_ORDER_MARK 0x01020304u
+
+static inline unsigned long long
+align_up(unsigned long long bytes)
+{
+  return (bytes + BRBT_FILE_ALIGN - 1) / BRBT_FILE_ALIGN * BRBT_FILE_ALIGN;
+}
+
+static inline _Bool
+interleaved(struct brbt const* tree)
+{
+  return tree->_type->layout == BRBT_LAYOUT_INTERLEAVED;
+}
+
+/* the header a tree is saved with, and checked against on open */
+static struct brbt_file_header
+make_header(struct brbt* tree)
+{
+  struct brbt_file_header h;
+  __builtin_memset(&h, 0, sizeof h);
+  __builtin_memcpy(h.magic, BRBT_FILE_MAGIC, sizeof h.magic);
+  h.version = BRBT_FILE_VERSION;
+  h.byte_order = BYTE_ORDER_MARK;
+
+  h.membs = tree->_type->membs;
+  h.keyoff = tree->_type->keyoff;
+  h.kind = tree->_type->kind;
+  h.keylen = tree->_type->keylen;
+  h.inline_key = tree->_type->inline_key;
+  h.flags = tree->_type->flags;
+  h.aggbs = tree->_type->aggregate ? tree->_type->aggbs : 0;
+  h.layout = tree->_type->layout;
+  h.bookkeeping = BOOKKEEPING;
+  h.bk_stride = tree->_bk_stride;
+  h.data_off = tree->_data_off;
+
+  h.root = tree->root;
+  h.first_free = tree->first_free;
+  h.size = tree->size;
+  h.capacity = tree->next_uninitialized;
+
+  unsigned long long const n = h.capacity;
+  h.data_bytes = interleaved(tree) ? 0 : n * h.membs;
+  h.bk_bytes = n * h.bk_stride;
+  h.data_offset = align_up(sizeof h);
+  h.bk_offset = h.data_offset + align_up(h.data_bytes);
+  return h;
+}
+
+/* forgets about every change so far */
+static void
+dirty_clear(struct brbt* tree)
+{
+#ifdef BRBT_DIRTY
+  for (unsigned i = 0; i < tree->_dirty_words; i++)
+    tree->_dirty[i] = 0;
+#else
+  (void)tree;
+#endif
+}
+
+/* writes bytes, then zeros up to to */
+static _Bool
+write_padded(FILE* f,
+             void const* p,
+             unsigned long long bytes,
+             unsigned long long to)
+{
+  static char const zeros[BRBT_FILE_ALIGN];
+
+  if (bytes && fwrite(p, 1, bytes, f) != bytes)
+    return false;
+
+  for (unsigned long long n = to - bytes; n > 0;) {
+    unsigned long long const chunk = n < sizeof zeros ? n : sizeof zeros;
+    if (fwrite(zeros, 1, chunk, f) != chunk)
+      return false;
+    n -= chunk;
+  }
+
+  return true;
+}
+
+_Bool
+brbt_save(struct brbt* tree, char const* path)
+{
+  assert(tree);
+  assert(path);
+
+  /* tombstones are not saved, the nodes go first */
+  brbt_maintenance(tree, (unsigned)-1);
+
+  struct brbt_file_header const h = make_header(tree);
+
+  FILE* f = fopen(path, "wb");
+  if (!f)
+    return false;
+
+  _Bool ok =
+    write_padded(f, &h, sizeof h, h.data_offset) &&
+    write_padded(f, tree->ptr, h.data_bytes, h.bk_offset - h.data_offset) &&
+    write_padded(f, tree->bk, h.bk_bytes, h.bk_bytes);
+
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok)
+    remove(path);
+  else
+    dirty_clear(tree);
+
+  return ok;
+}
+
+static struct brbt_mapping*
+mapping_of(struct brbt* tree)
+{
+  return (struct brbt_mapping*)tree->_policy;
+}
+
+/* copies the arrays onto the heap at new_cap nodes and drops the mapping,
+ * from then on the tree is managed by the default policy */
+static struct brbt_allocator_out
+mapping_detach(struct brbt* tree, unsigned new_cap)
+{
+  struct brbt_mapping* map = mapping_of(tree);
+  unsigned long const data =
+    (unsigned long)tree->_type->membs * tree->capacity;
+  unsigned long const rows =
+    (unsigned long)tree->_bk_stride * tree->capacity;
+
+  struct brbt_allocator_out out;
+  out.data_array = NULL;
+  out.bk_array = NULL;
+  out.size = brbt_capacity(tree);
+  out.realloc = 0;
+
+  if (tree->_type->layout == BRBT_LAYOUT_SPLIT) {
+    void* p = malloc((unsigned long)tree->_type->membs * new_cap);
+    void* b = malloc((unsigned long)tree->_bk_stride * new_cap);
+    if (!p || !b) {
+      free(p);
+      free(b);
+      return out;
+    }
+
+    out.data_array = p;
+    out.bk_array = b;
+  } else {
+    void* p = malloc(brbt_layout_bytes(tree, new_cap));
+    if (!p)
+      return out;
+
+    brbt_layout_place(tree, p, new_cap, &out);
+  }
+
+  /* interleaved records are copied along with the rows */
+  if (tree->capacity > 0) {
+    if (!interleaved(tree))
+      __builtin_memcpy(out.data_array, tree->ptr, data);
+    __builtin_memcpy(out.bk_array, tree->bk, rows);
+  }
+
+  munmap(map->base, map->bytes);
+  map->base = NULL;
+  map->bytes = 0;
+
+  out.size = new_cap;
+  return out;
+}
+
+static struct brbt_allocator_out
+mapping_resize(struct brbt* tree,
+               enum brbt_allocation_request req,
+               unsigned min_capacity)
+{
+  struct brbt_mapping* map = mapping_of(tree);
+
+  if (!map->base)
+    return brbt_default_policy_resize(tree, req, min_capacity);
+
+  /* a mapped tree stays where it is */
+  struct brbt_allocator_out out;
+  out.data_array = tree->ptr;
+  out.bk_array = tree->bk;
+  out.size = brbt_capacity(tree);
+  out.realloc = 1;
+
+  if (req == BRBT_GROW && map->mode == BRBT_MAP_PRIVATE)
+    return mapping_detach(tree, brbt_next_capacity(tree, min_capacity));
+
+  return out;
+}
+
+static void
+mapping_free(struct brbt* tree)
+{
+  struct brbt_mapping* map = mapping_of(tree);
+
+  if (!map->base) {
+    brbt_default_policy_free(tree);
+    return;
+  }
+
+  munmap(map->base, map->bytes);
+  map->base = NULL;
+  map->bytes = 0;
+}
+
+/* whether two headers were written for the same node layout */
+static _Bool
+same_layout(struct brbt_file_header const* a,
+            struct brbt_file_header const* b)
+{
+  return a->version == b->version && a->byte_order == b->byte_order &&
+         a->membs == b->membs && a->keyoff == b->keyoff &&
+         a->kind == b->kind && a->keylen == b->keylen &&
+         a->inline_key == b->inline_key && a->flags == b->flags &&
+         a->aggbs == b->aggbs && a->layout == b->layout &&
+         a->bookkeeping == b->bookkeeping && a->bk_stride == b->bk_stride &&
+         a->data_off == b->data_off;
+}
+
+/* whether the tree a header describes is consistent in itself */
+static _Bool
+valid_tree(struct brbt_file_header const* h)
+{
+  unsigned long long const n = h->capacity;
+
+  if (n > BRBT_MAX_CAPACITY || h->size > n)
+    return false;
+  if (h->root != BRBT_NIL && h->root >= n)
+    return false;
+  return h->first_free == BRBT_NIL || h->first_free < n;
+}
+
+/* whether the arrays of an image hold capacity nodes within bytes */
+static _Bool
+arrays_fit(struct brbt_file_header const* h, unsigned long long bytes)
+{
+  unsigned long long const n = h->capacity;
+
+  if (h->data_offset < sizeof *h || h->data_offset % BRBT_FILE_ALIGN != 0 ||
+      h->bk_offset % BRBT_FILE_ALIGN != 0)
+    return false;
+
+  if (h->layout != BRBT_LAYOUT_INTERLEAVED && h->data_bytes < n * h->membs)
+    return false;
+
+  return h->bk_offset >= h->data_offset + h->data_bytes &&
+         h->bk_bytes >= n * h->bk_stride &&
+         h->bk_offset + h->bk_bytes <= bytes;
+}
+
+/* whether the image describes a tree of the layout of tree,
+ * with arrays within a file of bytes */
+static _Bool
+header_matches(struct brbt* tree,
+               struct brbt_file_header const* h,
+               unsigned long bytes)
+{
+  struct brbt_file_header const want = make_header(tree);
+
+  return __builtin_memcmp(h->magic, want.magic, sizeof h->magic) == 0 &&
+         same_layout(h, &want) && valid_tree(h) && arrays_fit(h, bytes);
+}
+
+_Bool
+brbt_open_mmap(struct brbt* tree,
+               struct brbt_mapping* map,
+               struct brbt_type const* type,
+               char const* path,
+               enum brbt_map_mode mode,
+               void* userdata)
+{
+  map->policy = brbt_create_default_policy();
+  map->policy.resize = mapping_resize;
+  map->policy.free = mapping_free;
+  map->mode = mode;
+  map->base = NULL;
+  map->bytes = 0;
+
+  *tree = brbt_create(type, &map->policy, userdata);
+  assert(path);
+
+  int const fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (unsigned long long)st.st_size < sizeof(struct brbt_file_header)) {
+    close(fd);
+    return false;
+  }
+
+  /* copy on write needs a writable view, even of a read only file */
+  int const prot =
+    mode == BRBT_MAP_PRIVATE ? PROT_READ | PROT_WRITE : PROT_READ;
+  void* base = mmap(NULL, st.st_size, prot, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return false;
+
+  struct brbt_file_header const* h = base;
+  if (!header_matches(tree, h, st.st_size)) {
+    munmap(base, st.st_size);
+    return false;
+  }
+
+  map->base = base;
+  map->bytes = st.st_size;
+
+  char* const p = base;
+  tree->bk = (struct brbt_bookkeeping_info*)(p + h->bk_offset);
+  tree->ptr = interleaved(tree) ? (char*)tree->bk + tree->_data_off
+                                : p + h->data_offset;
+  tree->root = h->root;
+  tree->first_free = h->first_free;
+  tree->size = h->size;
+  tree->capacity = h->capacity;
+  tree->next_uninitialized = h->capacity;
+
+  /* the tree starts out as clean as the image, and the index is built
+   * from it, which unlike the rest of opening takes O(size) */
+  if (!brbt_dirty_fit(tree) || !brbt_index_fit(tree)) {
+    /* closes the mapping, with no node to drop */
+    tree->size = 0;
+    tree->next_uninitialized = 0;
+    brbt_destroy(tree);
+
+    *tree = brbt_create(type, &map->policy, userdata);
+    return false;
+  }
+
+  brbt_index_rebuild(tree);
+  return true;
+}
+
+/* streams the records and rows of count nodes from first */
+static _Bool
+write_run(struct brbt* tree,
+          brbt_writer fn,
+          void* userdata,
+          brbt_node first,
+          unsigned count)
+{
+  struct brbt_checkpoint_run const run = { first, count };
+  if (!fn(userdata, &run, sizeof run))
+    return false;
+
+  unsigned long const membs = tree->_type->membs;
+  if (!interleaved(tree) &&
+      !fn(userdata, tree->ptr + membs * first, membs * count))
+    return false;
+
+  unsigned long const stride = tree->_bk_stride;
+  return fn(userdata, (char*)tree->bk + stride * first, stride * count);
+}
+
+/* whether a run of the dirty map is set */
+static inline _Bool
+run_dirty(struct brbt* tree, unsigned long long run)
+{
+#ifdef BRBT_DIRTY
+  return (tree->_dirty[run / 64] >> (run % 64)) & 1;
+#else
+  (void)tree;
+  (void)run;
+  return true;
+#endif
+}
+
+_Bool
+brbt_checkpoint(struct brbt* tree, brbt_writer fn, void* userdata)
+{
+  assert(tree);
+  assert(fn);
+
+  brbt_maintenance(tree, (unsigned)-1);
+
+  struct brbt_file_header h = make_header(tree);
+  __builtin_memcpy(h.magic, BRBT_CHECKPOINT_MAGIC, sizeof h.magic);
+  if (!fn(userdata, &h, sizeof h))
+    return false;
+
+  /* adjacent dirty runs are streamed as one, clipped to the mark */
+  unsigned long long const hwm = tree->next_uninitialized;
+  unsigned long long const runs =
+    (hwm + (1ull << BRBT_DIRTY_SHIFT) - 1) >> BRBT_DIRTY_SHIFT;
+
+  for (unsigned long long r = 0; r < runs;) {
+#ifdef BRBT_DIRTY
+    if (r % 64 == 0 && tree->_dirty[r / 64] == 0) {
+      r += 64;
+      continue;
+    }
+#endif
+    if (!run_dirty(tree, r)) {
+      r++;
+      continue;
+    }
+
+    unsigned long long end = r + 1;
+    while (end < runs && run_dirty(tree, end))
+      end++;
+
+    unsigned long long const first = r << BRBT_DIRTY_SHIFT;
+    unsigned long long last = end << BRBT_DIRTY_SHIFT;
+    last = last > hwm ? hwm : last;
+    if (!write_run(tree, fn, userdata, first, last - first))
+      return false;
+
+    r = end;
+  }
+
+  struct brbt_checkpoint_run const done = { 0, 0 };
+  if (!fn(userdata, &done, sizeof done))
+    return false;
+
+  dirty_clear(tree);
+  return true;
+}
+
+/* bytes moved through the file at once while applying a checkpoint */
+#define APPLY_CHUNK (1ul << 16)
+
+static _Bool
+pread_all(int fd, void* p, unsigned long long n, unsigned long long off)
+{
+  for (char* b = p; n > 0;) {
+    ssize_t const r = pread(fd, b, n, off);
+    if (r <= 0)
+      return false;
+    b += r, n -= r, off += r;
+  }
+  return true;
+}
+
+static _Bool
+pwrite_all(int fd,
+           void const* p,
+           unsigned long long n,
+           unsigned long long off)
+{
+  for (char const* b = p; n > 0;) {
+    ssize_t const r = pwrite(fd, b, n, off);
+    if (r <= 0)
+      return false;
+    b += r, n -= r, off += r;
+  }
+  return true;
+}
+
+/* moves n bytes of the file from from up to to, back to front
+ * since the two may overlap */
+static _Bool
+move_up(int fd,
+        char* buf,
+        unsigned long long from,
+        unsigned long long to,
+        unsigned long long n)
+{
+  while (n > 0) {
+    unsigned long long const c = n < APPLY_CHUNK ? n : APPLY_CHUNK;
+    n -= c;
+    if (!pread_all(fd, buf, c, from + n) || !pwrite_all(fd, buf, c, to + n))
+      return false;
+  }
+  return true;
+}
+
+/* makes room in the image for the nodes of the checkpoint. records
+ * that outgrew their array move the rows behind them up, leaving
+ * room for half as many nodes again */
+static _Bool
+make_room(int fd, char* buf, struct brbt_file_header* f, unsigned capacity)
+{
+  unsigned long long const n = capacity;
+
+  if (f->layout != BRBT_LAYOUT_INTERLEAVED && n * f->membs > f->data_bytes) {
+    unsigned long long const data_bytes = (n + n / 2) * f->membs;
+    unsigned long long const bk_offset =
+      f->data_offset + align_up(data_bytes);
+
+    if (!move_up(fd,
+                 buf,
+                 f->bk_offset,
+                 bk_offset,
+                 (unsigned long long)f->capacity * f->bk_stride))
+      return false;
+
+    f->data_bytes = data_bytes;
+    f->bk_offset = bk_offset;
+  }
+
+  if (n * f->bk_stride > f->bk_bytes)
+    f->bk_bytes = n * f->bk_stride;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return false;
+  if ((unsigned long long)st.st_size >= f->bk_offset + f->bk_bytes)
+    return true;
+  return ftruncate(fd, f->bk_offset + f->bk_bytes) == 0;
+}
+
+/* copies n bytes of the stream into the file at off */
+static _Bool
+copy_in(int fd,
+        char* buf,
+        brbt_reader fn,
+        void* userdata,
+        unsigned long long off,
+        unsigned long long n)
+{
+  while (n > 0) {
+    unsigned long long const c = n < APPLY_CHUNK ? n : APPLY_CHUNK;
+    if (!fn(userdata, buf, c) || !pwrite_all(fd, buf, c, off))
+      return false;
+    off += c, n -= c;
+  }
+  return true;
+}
+
+static _Bool
+apply_runs(int fd,
+           char* buf,
+           struct brbt_file_header const* f,
+           struct brbt_file_header const* c,
+           brbt_reader fn,
+           void* userdata)
+{
+  unsigned long long const membs = f->membs;
+  unsigned long long const stride = f->bk_stride;
+
+  for (;;) {
+    struct brbt_checkpoint_run run;
+    if (!fn(userdata, &run, sizeof run))
+      return false;
+    if (run.count == 0)
+      return true;
+    if (run.first >= c->capacity || run.count > c->capacity - run.first)
+      return false;
+
+    if (f->layout != BRBT_LAYOUT_INTERLEAVED &&
+        !copy_in(fd,
+                 buf,
+                 fn,
+                 userdata,
+                 f->data_offset + membs * run.first,
+                 membs * run.count))
+      return false;
+
+    if (!copy_in(fd,
+                 buf,
+                 fn,
+                 userdata,
+                 f->bk_offset + stride * run.first,
+                 stride * run.count))
+      return false;
+  }
+}
+
+_Bool
+brbt_apply_checkpoint(char const* path, brbt_reader fn, void* userdata)
+{
+  struct brbt_file_header c;
+  if (!path || !fn || !fn(userdata, &c, sizeof c))
+    return false;
+
+  if (__builtin_memcmp(c.magic, BRBT_CHECKPOINT_MAGIC, sizeof c.magic) ||
+      !valid_tree(&c))
+    return false;
+
+  int const fd = open(path, O_RDWR);
+  if (fd < 0)
+    return false;
+
+  char* buf = malloc(APPLY_CHUNK);
+  struct brbt_file_header f;
+  struct stat st;
+
+  _Bool ok = buf && fstat(fd, &st) == 0 && pread_all(fd, &f, sizeof f, 0) &&
+             __builtin_memcmp(f.magic, BRBT_FILE_MAGIC, sizeof f.magic) == 0 &&
+             same_layout(&f, &c) && arrays_fit(&f, st.st_size) &&
+             make_room(fd, buf, &f, c.capacity) &&
+             apply_runs(fd, buf, &f, &c, fn, userdata);
+
+  /* the nodes reach the disk before the header pointing at them */
+  if (ok) {
+    f.root = c.root;
+    f.first_free = c.first_free;
+    f.size = c.size;
+    f.capacity = c.capacity;
+    ok = fsync(fd) == 0 && pwrite_all(fd, &f, sizeof f, 0) && fsync(fd) == 0;
+  }
+
+  free(buf);
+  if (close(fd) != 0)
+    ok = false;
+
+  return ok;
+}
@@ -0,0 +1,83 @@
+#include "brbt_parallel.h"
+#include "brbt_internal.h"
+
+#include <pthread.h>
+
+struct side
+{
+  void (*fn)(void*);
+  void* arg;
+};
+
+static void*
+side_run(void* arg)
+{
+  struct side const* const s = arg;
+  s->fn(s->arg);
+  return NULL;
+}
+
+/* runs lhs on a thread of its own and rhs on this one. without a thread
+ * to spare both run here */
+static void
+both(void (*fn)(void*), void* lhs, void* rhs)
+{
+  struct side s;
+  s.fn = fn;
+  s.arg = lhs;
+
+  pthread_t thread;
+  _Bool const forked = pthread_create(&thread, NULL, side_run, &s) == 0;
+  if (!forked)
+    fn(lhs);
+
+  fn(rhs);
+
+  if (forked)
+    pthread_join(thread, NULL);
+}
+
+/* every level forks once per subtree, doubling the threads running */
+static struct brbt_fork
+fork_for(unsigned threads)
+{
+  struct brbt_fork out;
+  out.both = both;
+  out.levels = 0;
+
+  while (out.levels < 16 && (1u << out.levels) < threads)
+    out.levels++;
+
+  return out;
+}
+
+_Bool
+brbt_build_sorted_parallel(struct brbt* tree,
+                           void const* records,
+                           unsigned count,
+                           unsigned threads)
+{
+  struct brbt_fork const fork = fork_for(threads);
+  return brbt_build_sorted_fork(tree, records, count, &fork);
+}
+
+_Bool
+brbt_union_parallel(struct brbt* a, struct brbt* b, unsigned threads)
+{
+  struct brbt_fork const fork = fork_for(threads);
+  return brbt_union_fork(a, b, &fork);
+}
+
+void
+brbt_intersection_parallel(struct brbt* a, struct brbt* b, unsigned threads)
+{
+  struct brbt_fork const fork = fork_for(threads);
+  brbt_intersection_fork(a, b, &fork);
+}
+
+void
+brbt_difference_parallel(struct brbt* a, struct brbt* b, unsigned threads)
+{
+  struct brbt_fork const fork = fork_for(threads);
+  brbt_difference_fork(a, b, &fork);
+}
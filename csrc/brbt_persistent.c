@@ -0,0 +1,600 @@
+#include "brbt_persistent.h"
+#include "brbt_internal.h"
+
+#ifndef true
+#define true 1
+#endif
+
+#ifndef false
+#define false 0
+#endif
+
+#define assert(x)                                                              \
+  ((x) ? (void)(0)                                                             \
+       : tree->records._policy->abort(&tree->records, __LINE__))
+/* assert guarding a write past a fixed array, which traps
+ * should the abort function return */
+#define assert_bounds(x)                                                       \
+  ((x) ? (void)(0)                                                             \
+       : (tree->records._policy->abort(&tree->records, __LINE__),              \
+          __builtin_trap()))
+
+/*
+ * the llrb of brbt.c made functional. writes only ever change nodes
+ * allocated by that same write, any other node on the way is copied
+ * first and the old one retired. published nodes are never written to
+ * again, until reclaimed.
+ *
+ * reclamation is epoch based. a reader announces the epoch before it
+ * loads the root, a write publishes its root, tags what it retired with
+ * the epoch and only then moves the epoch on. a reader announcing a later
+ * epoch loads a root that no longer reaches the retired nodes, so they
+ * can go once every announced epoch is past their tag
+ */
+
+struct node
+{
+  brbt_node left, right;
+  brbt_node record;
+  unsigned red;
+
+  /* write that allocated the node */
+  unsigned long long gen;
+};
+
+static struct brbt_type const node_type = { .membs = sizeof(struct node) };
+
+/* nodes a single write may allocate, a delete copies four per level */
+#define PATH_NODES (4 * BRBT_MAX_DEPTH + 1)
+
+static inline struct node*
+pn(struct brbt_persistent* tree, brbt_node x)
+{
+  return brbt_get(&tree->nodes, x);
+}
+
+static inline _Bool
+is_red(struct brbt_persistent* tree, brbt_node x)
+{
+  return x != BRBT_NIL && pn(tree, x)->red;
+}
+
+/* compares a key against the key of the record of a node */
+__attribute__((always_inline)) static inline int
+compare_kind(struct brbt_persistent* tree,
+             void const* key,
+             brbt_node x,
+             enum brbt_key_kind const kind)
+{
+  char* data = brbt_get(&tree->records, pn(tree, x)->record);
+  return compare_keys(
+    &tree->records, key, data + tree->records._type->keyoff, kind);
+}
+
+static inline int
+compare(struct brbt_persistent* tree, void const* key, brbt_node x)
+{
+  return compare_kind(tree, key, x, tree->records._type->kind);
+}
+
+void
+brbt_persistent_init(struct brbt_persistent* tree,
+                     struct brbt_type const* type,
+                     struct brbt_policy const* policy,
+                     void* userdata)
+{
+  tree->records = brbt_create(type, policy, userdata);
+
+  if (policy->max_capacity == 0)
+    policy->abort(&tree->records, __LINE__);
+
+  /* room for two versions of every record, and a write on top */
+  unsigned long long nodes = 2ull * policy->max_capacity + PATH_NODES;
+  tree->_node_policy = brbt_create_default_policy();
+  tree->_node_policy.abort = policy->abort;
+  tree->_node_policy.max_capacity =
+    nodes > BRBT_MAX_CAPACITY ? BRBT_MAX_CAPACITY : (unsigned)nodes;
+  tree->nodes = brbt_create(&node_type, &tree->_node_policy, userdata);
+
+  tree->root = BRBT_NIL;
+  tree->epoch = 1;
+  for (unsigned i = 0; i < BRBT_PERSISTENT_READERS; i++)
+    tree->readers[i].epoch = 0;
+
+  tree->retired = NULL;
+  tree->retired_count = 0;
+  tree->size = 0;
+  tree->_gen = 0;
+}
+
+void
+brbt_persistent_destroy(struct brbt_persistent* tree)
+{
+  /* retired records are in use until reclaimed, this runs their
+   * deleter along with the one of the live records */
+  brbt_destroy(&tree->records);
+
+  /* no node has a record of its own, emptied first the node array only
+   * has its arrays and side tables released */
+  tree->nodes.size = 0;
+  brbt_destroy(&tree->nodes);
+  free(tree->retired);
+}
+
+void*
+brbt_persistent_get(struct brbt_persistent* tree, brbt_node record)
+{
+  return brbt_get(&tree->records, record);
+}
+
+__attribute__((always_inline)) static inline brbt_node
+find_kind(struct brbt_persistent* tree,
+          brbt_node h,
+          void const* key,
+          enum brbt_key_kind const kind)
+{
+  while (h != BRBT_NIL) {
+    int const cmp = compare_kind(tree, key, h, kind);
+    if (cmp == 0)
+      return pn(tree, h)->record;
+
+    h = cmp < 0 ? pn(tree, h)->left : pn(tree, h)->right;
+  }
+
+  return BRBT_NIL;
+}
+
+static brbt_node
+find_from(struct brbt_persistent* tree, brbt_node root, void const* key)
+{
+  brbt_dispatch_kind(
+    tree->records._type->kind, find_kind, tree, root, key);
+}
+
+brbt_node
+brbt_persistent_find(struct brbt_persistent* tree, void const* key)
+{
+  assert(key);
+  return find_from(tree, tree->root, key);
+}
+
+/* allocates both arrays at their final capacity, readers never see
+ * them move. the retired list can hold every slot of either */
+static _Bool
+reserve(struct brbt_persistent* tree)
+{
+  if (tree->retired)
+    return true;
+
+  if (!brbt_slot_reserve(&tree->records, tree->records._policy->max_capacity))
+    return false;
+  if (!brbt_slot_reserve(&tree->nodes, tree->nodes._policy->max_capacity))
+    return false;
+
+  unsigned long const n = (unsigned long)brbt_capacity(&tree->records) +
+                          brbt_capacity(&tree->nodes);
+  tree->retired = malloc(sizeof(struct brbt_retired) * n);
+  return tree->retired != NULL;
+}
+
+/* whether a write can allocate everything it may need without growing */
+static inline _Bool
+has_room(struct brbt_persistent* tree, unsigned records)
+{
+  return brbt_capacity(&tree->nodes) - tree->nodes.size >= PATH_NODES &&
+         brbt_capacity(&tree->records) - tree->records.size >= records;
+}
+
+static _Bool
+begin_write(struct brbt_persistent* tree, unsigned records)
+{
+  if (!reserve(tree))
+    return false;
+
+  if (!has_room(tree, records)) {
+    brbt_persistent_reclaim(tree);
+    if (!has_room(tree, records))
+      return false;
+  }
+
+  tree->_gen++;
+  return true;
+}
+
+static inline void
+retire(struct brbt_persistent* tree, brbt_node slot, _Bool record)
+{
+  struct brbt_retired* r = &tree->retired[tree->retired_count++];
+  r->slot = slot;
+  r->record = record;
+  r->epoch = 0;
+}
+
+static void
+publish(struct brbt_persistent* tree, brbt_node root, unsigned first_retired)
+{
+  __atomic_store_n(&tree->root, root, __ATOMIC_SEQ_CST);
+
+  unsigned long const epoch = __atomic_load_n(&tree->epoch, __ATOMIC_RELAXED);
+  for (unsigned i = first_retired; i < tree->retired_count; i++)
+    tree->retired[i].epoch = epoch;
+
+  __atomic_store_n(&tree->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+
+  brbt_persistent_reclaim(tree);
+}
+
+void
+brbt_persistent_reclaim(struct brbt_persistent* tree)
+{
+  unsigned long oldest = (unsigned long)-1;
+  for (unsigned i = 0; i < BRBT_PERSISTENT_READERS; i++) {
+    unsigned long const e =
+      __atomic_load_n(&tree->readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (e != 0 && e < oldest)
+      oldest = e;
+  }
+
+  unsigned n = 0;
+  for (; n < tree->retired_count && tree->retired[n].epoch < oldest; n++) {
+    if (tree->retired[n].record)
+      brbt_slot_free(&tree->records, tree->retired[n].slot);
+    else
+      brbt_slot_release(&tree->nodes, tree->retired[n].slot);
+  }
+
+  if (n == 0)
+    return;
+
+  tree->retired_count -= n;
+  __builtin_memmove(tree->retired,
+                    tree->retired + n,
+                    sizeof(struct brbt_retired) * tree->retired_count);
+}
+
+static brbt_node
+new_node(struct brbt_persistent* tree, brbt_node record)
+{
+  brbt_node const x = brbt_slot_alloc(&tree->nodes);
+  assert(x != BRBT_NIL);
+
+  struct node* n = pn(tree, x);
+  n->left = BRBT_NIL;
+  n->right = BRBT_NIL;
+  n->record = record;
+  n->red = true;
+  n->gen = tree->_gen;
+  return x;
+}
+
+/* x as a node of the version being written, copied if it is older */
+static brbt_node
+own(struct brbt_persistent* tree, brbt_node x)
+{
+  if (x == BRBT_NIL || pn(tree, x)->gen == tree->_gen)
+    return x;
+
+  brbt_node const y = brbt_slot_alloc(&tree->nodes);
+  assert(y != BRBT_NIL);
+
+  *pn(tree, y) = *pn(tree, x);
+  pn(tree, y)->gen = tree->_gen;
+  retire(tree, x, false);
+  return y;
+}
+
+/* drops a node that no longer is in the version being written */
+static void
+drop(struct brbt_persistent* tree, brbt_node x)
+{
+  if (pn(tree, x)->gen == tree->_gen)
+    brbt_slot_release(&tree->nodes, x);
+  else
+    retire(tree, x, false);
+}
+
+/* the rotations and flips all take an owned h */
+static brbt_node
+rotate_left(struct brbt_persistent* tree, brbt_node h)
+{
+  brbt_node const x = own(tree, pn(tree, h)->right);
+  pn(tree, h)->right = pn(tree, x)->left;
+  pn(tree, x)->left = h;
+  pn(tree, x)->red = pn(tree, h)->red;
+  pn(tree, h)->red = true;
+  return x;
+}
+
+static brbt_node
+rotate_right(struct brbt_persistent* tree, brbt_node h)
+{
+  brbt_node const x = own(tree, pn(tree, h)->left);
+  pn(tree, h)->left = pn(tree, x)->right;
+  pn(tree, x)->right = h;
+  pn(tree, x)->red = pn(tree, h)->red;
+  pn(tree, h)->red = true;
+  return x;
+}
+
+static void
+color_flip(struct brbt_persistent* tree, brbt_node h)
+{
+  struct node* n = pn(tree, h);
+  n->left = own(tree, n->left);
+  n->right = own(tree, n->right);
+
+  n->red = !n->red;
+  pn(tree, n->left)->red = !pn(tree, n->left)->red;
+  pn(tree, n->right)->red = !pn(tree, n->right)->red;
+}
+
+static brbt_node
+fix_up(struct brbt_persistent* tree, brbt_node h)
+{
+  if (is_red(tree, pn(tree, h)->right) && !is_red(tree, pn(tree, h)->left))
+    h = rotate_left(tree, h);
+  if (is_red(tree, pn(tree, h)->left) &&
+      is_red(tree, pn(tree, pn(tree, h)->left)->left))
+    h = rotate_right(tree, h);
+  if (is_red(tree, pn(tree, h)->left) && is_red(tree, pn(tree, h)->right))
+    color_flip(tree, h);
+  return h;
+}
+
+/* inserts a record whose key is not in the tree, or replaces the
+ * record with its key */
+static brbt_node
+put(struct brbt_persistent* tree,
+    brbt_node h,
+    void const* key,
+    brbt_node record)
+{
+  if (h == BRBT_NIL)
+    return new_node(tree, record);
+
+  h = own(tree, h);
+
+  int const cmp = compare(tree, key, h);
+  if (cmp == 0) {
+    retire(tree, pn(tree, h)->record, true);
+    pn(tree, h)->record = record;
+  } else if (cmp < 0) {
+    brbt_node const l = put(tree, pn(tree, h)->left, key, record);
+    pn(tree, h)->left = l;
+  } else {
+    brbt_node const r = put(tree, pn(tree, h)->right, key, record);
+    pn(tree, h)->right = r;
+  }
+
+  return fix_up(tree, h);
+}
+
+brbt_node
+brbt_persistent_insert(struct brbt_persistent* tree,
+                       void* record,
+                       _Bool replace)
+{
+  assert(record);
+
+  void const* key = (char*)record + tree->records._type->keyoff;
+  brbt_node const found = brbt_persistent_find(tree, key);
+  if (found != BRBT_NIL && !replace)
+    return found;
+
+  if (!begin_write(tree, 1))
+    return BRBT_NIL;
+
+  brbt_node const out = brbt_slot_alloc(&tree->records);
+  __builtin_memcpy(
+    brbt_get(&tree->records, out), record, tree->records._type->membs);
+
+  /* the new copy holds the key from here on */
+  key = (char*)brbt_get(&tree->records, out) + tree->records._type->keyoff;
+
+  unsigned const first_retired = tree->retired_count;
+  brbt_node root = put(tree, tree->root, key, out);
+  pn(tree, root)->red = false;
+
+  if (found == BRBT_NIL)
+    tree->size++;
+
+  publish(tree, root, first_retired);
+
+  if (tree->records._policy->insert_hook)
+    tree->records._policy->insert_hook(&tree->records, out);
+
+  return out;
+}
+
+static brbt_node
+move_red_left(struct brbt_persistent* tree, brbt_node h)
+{
+  color_flip(tree, h);
+
+  if (is_red(tree, pn(tree, pn(tree, h)->right)->left)) {
+    brbt_node const r = rotate_right(tree, pn(tree, h)->right);
+    pn(tree, h)->right = r;
+    h = rotate_left(tree, h);
+    color_flip(tree, h);
+  }
+
+  return h;
+}
+
+static brbt_node
+move_red_right(struct brbt_persistent* tree, brbt_node h)
+{
+  color_flip(tree, h);
+
+  if (is_red(tree, pn(tree, pn(tree, h)->left)->left)) {
+    h = rotate_right(tree, h);
+    color_flip(tree, h);
+  }
+
+  return h;
+}
+
+/* unlinks the smallest node below h, whose record moved elsewhere */
+static brbt_node
+remove_min(struct brbt_persistent* tree, brbt_node h)
+{
+  if (pn(tree, h)->left == BRBT_NIL) {
+    drop(tree, h);
+    return BRBT_NIL;
+  }
+
+  h = own(tree, h);
+
+  if (!is_red(tree, pn(tree, h)->left) &&
+      !is_red(tree, pn(tree, pn(tree, h)->left)->left))
+    h = move_red_left(tree, h);
+
+  brbt_node const l = remove_min(tree, pn(tree, h)->left);
+  pn(tree, h)->left = l;
+  return fix_up(tree, h);
+}
+
+/* removes the node with key, which is in the tree */
+static brbt_node
+remove_key(struct brbt_persistent* tree, brbt_node h, void const* key)
+{
+  h = own(tree, h);
+
+  if (compare(tree, key, h) < 0) {
+    if (!is_red(tree, pn(tree, h)->left) &&
+        !is_red(tree, pn(tree, pn(tree, h)->left)->left))
+      h = move_red_left(tree, h);
+
+    brbt_node const l = remove_key(tree, pn(tree, h)->left, key);
+    pn(tree, h)->left = l;
+    return fix_up(tree, h);
+  }
+
+  if (is_red(tree, pn(tree, h)->left))
+    h = rotate_right(tree, h);
+
+  if (compare(tree, key, h) == 0 && pn(tree, h)->right == BRBT_NIL) {
+    retire(tree, pn(tree, h)->record, true);
+    drop(tree, h);
+    return BRBT_NIL;
+  }
+
+  if (!is_red(tree, pn(tree, h)->right) &&
+      !is_red(tree, pn(tree, pn(tree, h)->right)->left))
+    h = move_red_right(tree, h);
+
+  if (compare(tree, key, h) == 0) {
+    /* the successor takes the place of the record */
+    brbt_node m = pn(tree, h)->right;
+    while (pn(tree, m)->left != BRBT_NIL)
+      m = pn(tree, m)->left;
+
+    retire(tree, pn(tree, h)->record, true);
+    pn(tree, h)->record = pn(tree, m)->record;
+
+    brbt_node const r = remove_min(tree, pn(tree, h)->right);
+    pn(tree, h)->right = r;
+  } else {
+    brbt_node const r = remove_key(tree, pn(tree, h)->right, key);
+    pn(tree, h)->right = r;
+  }
+
+  return fix_up(tree, h);
+}
+
+_Bool
+brbt_persistent_delete(struct brbt_persistent* tree, void const* key)
+{
+  assert(key);
+
+  if (brbt_persistent_find(tree, key) == BRBT_NIL)
+    return false;
+
+  /* unlinking a record needs no room for one, only for the path */
+  if (!begin_write(tree, 0))
+    return false;
+
+  unsigned const first_retired = tree->retired_count;
+  brbt_node root = own(tree, tree->root);
+
+  if (!is_red(tree, pn(tree, root)->left) &&
+      !is_red(tree, pn(tree, root)->right))
+    pn(tree, root)->red = true;
+
+  root = remove_key(tree, root, key);
+  if (root != BRBT_NIL)
+    pn(tree, root)->red = false;
+
+  tree->size--;
+  publish(tree, root, first_retired);
+  return true;
+}
+
+struct brbt_snapshot
+brbt_persistent_acquire(struct brbt_persistent* tree, unsigned reader)
+{
+  assert(reader < BRBT_PERSISTENT_READERS);
+
+  struct brbt_snapshot snap;
+  snap.tree = tree;
+  snap.reader = reader;
+
+  unsigned long const epoch = __atomic_load_n(&tree->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&tree->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+  snap.root = __atomic_load_n(&tree->root, __ATOMIC_SEQ_CST);
+  return snap;
+}
+
+void
+brbt_snapshot_release(struct brbt_snapshot* snap)
+{
+  __atomic_store_n(
+    &snap->tree->readers[snap->reader].epoch, 0, __ATOMIC_RELEASE);
+  snap->root = BRBT_NIL;
+}
+
+brbt_node
+brbt_snapshot_find(struct brbt_snapshot const* snap, void const* key)
+{
+  struct brbt_persistent* tree = snap->tree;
+  assert(key);
+  return find_from(tree, snap->root, key);
+}
+
+void
+brbt_snapshot_range(struct brbt_snapshot const* snap,
+                    void const* lo,
+                    void const* hi,
+                    brbt_iterator fn,
+                    void* userdata)
+{
+  struct brbt_persistent* tree = snap->tree;
+  assert(fn);
+
+  /* ancestors still to be visited, those the walk went left at */
+  brbt_node stack[BRBT_MAX_DEPTH];
+  unsigned depth = 0;
+
+  for (brbt_node h = snap->root;;) {
+    while (h != BRBT_NIL) {
+      if (lo && compare(tree, lo, h) > 0) {
+        h = pn(tree, h)->right;
+        continue;
+      }
+
+      assert_bounds(depth < BRBT_MAX_DEPTH);
+      stack[depth++] = h;
+      h = pn(tree, h)->left;
+    }
+
+    if (depth == 0)
+      return;
+
+    h = stack[--depth];
+    if (hi && compare(tree, hi, h) <= 0)
+      return;
+
+    fn(&tree->records, userdata, pn(tree, h)->record);
+    h = pn(tree, h)->right;
+  }
+}
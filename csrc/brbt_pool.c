@@ -0,0 +1,339 @@
+#include "brbt_pool.h"
+
+#include <stdlib.h>
+
+#ifndef true
+#define true 1
+#endif
+
+#ifndef false
+#define false 0
+#endif
+
+/* slabs start with their link, keeping chunks aligned to 16 bytes */
+#define SLAB_HEADER 16
+
+static inline struct brbt_pool*
+pool_of(struct brbt* tree)
+{
+  return (struct brbt_pool*)tree->_policy;
+}
+
+static inline unsigned long
+chunk_bytes(unsigned c)
+{
+  return (unsigned long)BRBT_POOL_MIN_CHUNK << c;
+}
+
+/* smallest class with room for bytes, BRBT_POOL_CLASSES if none has */
+static unsigned
+class_of(unsigned long bytes)
+{
+  unsigned c = 0;
+  while (c < BRBT_POOL_CLASSES && chunk_bytes(c) < bytes)
+    c++;
+
+  return c;
+}
+
+/* bytes a chunk holding bytes has room for */
+static unsigned long
+room_of(unsigned long bytes)
+{
+  unsigned const c = class_of(bytes);
+  return c < BRBT_POOL_CLASSES ? chunk_bytes(c) : bytes;
+}
+
+/* whether arrays of both bytesizes live in the same kind of chunk */
+static _Bool
+same_chunk(unsigned long a, unsigned long b)
+{
+  unsigned const c = class_of(a);
+  return a == b || (c < BRBT_POOL_CLASSES && c == class_of(b));
+}
+
+/* cuts a new slab into chunks of class c */
+static _Bool
+carve(struct brbt_pool* pool, unsigned c)
+{
+  unsigned long const size = chunk_bytes(c);
+  unsigned long const bytes =
+    SLAB_HEADER + (size > BRBT_POOL_SLAB ? size : BRBT_POOL_SLAB);
+
+  char* const slab = malloc(bytes);
+  if (!slab)
+    return false;
+
+  *(void**)slab = pool->_slabs;
+  pool->_slabs = slab;
+  pool->reserved += bytes;
+
+  for (char* p = slab + SLAB_HEADER; p + size <= slab + bytes; p += size) {
+    *(void**)p = pool->_free[c];
+    pool->_free[c] = p;
+  }
+
+  return true;
+}
+
+static void*
+chunk_get(struct brbt_pool* pool, unsigned long bytes)
+{
+  unsigned const c = class_of(bytes);
+
+  if (c == BRBT_POOL_CLASSES) {
+    void* const p = malloc(bytes);
+    if (p)
+      pool->in_use += bytes;
+    return p;
+  }
+
+  if (!pool->_free[c] && !carve(pool, c))
+    return NULL;
+
+  void* const p = pool->_free[c];
+  pool->_free[c] = *(void**)p;
+  pool->in_use += chunk_bytes(c);
+  return p;
+}
+
+static void
+chunk_put(struct brbt_pool* pool, void* p, unsigned long bytes)
+{
+  if (!p)
+    return;
+
+  unsigned const c = class_of(bytes);
+
+  if (c == BRBT_POOL_CLASSES) {
+    free(p);
+    pool->in_use -= bytes;
+    return;
+  }
+
+  *(void**)p = pool->_free[c];
+  pool->_free[c] = p;
+  pool->in_use -= chunk_bytes(c);
+}
+
+/* the chunk of new_bytes taking over from the one of old_bytes at p,
+ * which is p itself if the two are of one class */
+static void*
+chunk_for(struct brbt_pool* pool,
+          void* p,
+          unsigned long old_bytes,
+          unsigned long new_bytes)
+{
+  if (p && same_chunk(old_bytes, new_bytes))
+    return p;
+  return chunk_get(pool, new_bytes);
+}
+
+static inline _Bool
+split(struct brbt* tree)
+{
+  return tree->_type->layout == BRBT_LAYOUT_SPLIT;
+}
+
+/* bytesizes of the chunk at brbt_layout_block, and of the one holding
+ * the bookkeeping array of the split layout */
+static unsigned long
+block_bytes(struct brbt* tree, unsigned capacity)
+{
+  if (split(tree))
+    return (unsigned long)tree->_type->membs * capacity;
+  return brbt_layout_bytes(tree, capacity);
+}
+
+static unsigned long
+bk_bytes(struct brbt* tree, unsigned capacity)
+{
+  if (split(tree))
+    return (unsigned long)brbt_bk_stride(tree) * capacity;
+  return 0;
+}
+
+/* raises capacity, up to max, to the most nodes its chunks have room
+ * for, which leaves them in the same classes */
+static unsigned
+fill(struct brbt* tree, unsigned capacity, unsigned max)
+{
+  unsigned long const membs = tree->_type->membs;
+  unsigned long const stride = brbt_bk_stride(tree);
+  unsigned long const room = room_of(block_bytes(tree, capacity));
+  unsigned long long n;
+
+  if (split(tree)) {
+    unsigned long const bk_room = room_of(bk_bytes(tree, capacity));
+    n = room / membs < bk_room / stride ? room / membs : bk_room / stride;
+  } else if (tree->_type->layout == BRBT_LAYOUT_INTERLEAVED) {
+    n = room / stride;
+  } else {
+    /* the bookkeeping array starts within 15 bytes past the records */
+    n = room > 15 ? (room - 15) / (membs + stride) : 0;
+  }
+
+  if (n > max)
+    n = max;
+  return n > capacity ? n : capacity;
+}
+
+/* moves the arrays over to chunks for capacity nodes, carrying along the
+ * nodes below the high-water mark. returns false, leaving them where they
+ * are, if a chunk could not be had */
+static _Bool
+move_arrays(struct brbt* tree,
+            unsigned capacity,
+            struct brbt_allocator_out* out)
+{
+  struct brbt_pool* const pool = pool_of(tree);
+  unsigned const old = tree->capacity;
+  unsigned long const hwm = tree->next_uninitialized;
+  unsigned long const stride = brbt_bk_stride(tree);
+
+  char* const block = brbt_layout_block(tree);
+  unsigned long const old_bytes = block_bytes(tree, old);
+  unsigned long const new_bytes = block_bytes(tree, capacity);
+
+  char* const to = chunk_for(pool, block, old_bytes, new_bytes);
+  if (!to)
+    return false;
+
+  if (split(tree)) {
+    void* const bk = tree->bk;
+    unsigned long const old_bk = bk_bytes(tree, old);
+    unsigned long const new_bk = bk_bytes(tree, capacity);
+
+    void* const bk_to = chunk_for(pool, bk, old_bk, new_bk);
+    if (!bk_to) {
+      if (to != block)
+        chunk_put(pool, to, new_bytes);
+      return false;
+    }
+
+    if (bk_to != bk) {
+      if (hwm)
+        __builtin_memcpy(bk_to, bk, stride * hwm);
+      chunk_put(pool, bk, old_bk);
+    }
+
+    if (to != block) {
+      if (hwm)
+        __builtin_memcpy(to, block, tree->_type->membs * hwm);
+      chunk_put(pool, block, old_bytes);
+    }
+
+    out->data_array = to;
+    out->bk_array = bk_to;
+    out->size = capacity;
+    return true;
+  }
+
+  if (tree->_type->layout == BRBT_LAYOUT_COMBINED) {
+    /* the bookkeeping array moves along with the capacity */
+    unsigned long const from = brbt_layout_bk_offset(tree, old);
+    unsigned long const at = brbt_layout_bk_offset(tree, capacity);
+
+    if (to == block) {
+      __builtin_memmove(to + at, block + from, stride * hwm);
+    } else if (hwm) {
+      __builtin_memcpy(to, block, tree->_type->membs * hwm);
+      __builtin_memcpy(to + at, block + from, stride * hwm);
+    }
+  } else if (to != block && hwm) {
+    __builtin_memcpy(to, block, stride * hwm);
+  }
+
+  if (to != block)
+    chunk_put(pool, block, old_bytes);
+
+  brbt_layout_place(tree, to, capacity, out);
+  out->size = capacity;
+  return true;
+}
+
+static struct brbt_allocator_out
+pool_resize(struct brbt* tree,
+            enum brbt_allocation_request req,
+            unsigned min_capacity)
+{
+  struct brbt_allocator_out out;
+  out.data_array = tree->ptr;
+  out.bk_array = tree->bk;
+  out.size = tree->capacity;
+  out.realloc = 0;
+
+  unsigned max = tree->_policy->max_capacity;
+  if (max == 0 || max > BRBT_MAX_CAPACITY)
+    max = BRBT_MAX_CAPACITY;
+
+  unsigned capacity = 0;
+
+  switch (req) {
+    case BRBT_GROW:
+      capacity = fill(tree, brbt_next_capacity(tree, min_capacity), max);
+      break;
+
+    case BRBT_SHRINK:
+      /* only worth it once the nodes fit smaller chunks */
+      capacity = fill(tree, min_capacity, tree->capacity);
+      if (same_chunk(block_bytes(tree, capacity),
+                     block_bytes(tree, tree->capacity)) &&
+          same_chunk(bk_bytes(tree, capacity), bk_bytes(tree, tree->capacity)))
+        return out;
+      break;
+  }
+
+  move_arrays(tree, capacity, &out);
+  return out;
+}
+
+static void
+pool_free(struct brbt* tree)
+{
+  struct brbt_pool* const pool = pool_of(tree);
+
+  chunk_put(pool, brbt_layout_block(tree), block_bytes(tree, tree->capacity));
+  if (split(tree))
+    chunk_put(pool, tree->bk, bk_bytes(tree, tree->capacity));
+}
+
+/* doubles from BRBT_POOL_MIN_CAPACITY */
+static unsigned
+pool_growth(struct brbt* tree, unsigned min_capacity)
+{
+  (void)min_capacity;
+  unsigned long long const old_cap = brbt_capacity(tree);
+  return old_cap == 0 ? BRBT_POOL_MIN_CAPACITY : old_cap * 2;
+}
+
+void
+brbt_pool_init(struct brbt_pool* pool)
+{
+  pool->policy = brbt_create_default_policy();
+  pool->policy.resize = pool_resize;
+  pool->policy.free = pool_free;
+  pool->policy.growth = pool_growth;
+
+  for (unsigned c = 0; c < BRBT_POOL_CLASSES; c++)
+    pool->_free[c] = NULL;
+  pool->_slabs = NULL;
+
+  pool->reserved = 0;
+  pool->in_use = 0;
+}
+
+void
+brbt_pool_destroy(struct brbt_pool* pool)
+{
+  while (pool->_slabs) {
+    void* const next = *(void**)pool->_slabs;
+    free(pool->_slabs);
+    pool->_slabs = next;
+  }
+
+  for (unsigned c = 0; c < BRBT_POOL_CLASSES; c++)
+    pool->_free[c] = NULL;
+
+  pool->reserved = 0;
+}
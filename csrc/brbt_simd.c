@@ -0,0 +1,144 @@
+#include "brbt_internal.h"
+
+/* vector rank kernels for the integer key kinds. unsigned keys are
+ * compared through the signed compares by flipping their top bit, and
+ * lanes past the key count are masked off before counting */
+
+#if !defined(BRBT_NO_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#define RANK_AVX2 1
+#include <immintrin.h>
+#elif !defined(BRBT_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define RANK_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(RANK_AVX2)
+
+/* bits of the lanes of a block holding one of the rem keys left */
+static inline unsigned
+block_mask(unsigned rem, unsigned lanes)
+{
+  return rem >= lanes ? (1u << lanes) - 1 : (1u << rem) - 1;
+}
+
+#define RANK_AVX2_32(name, T, bias)                                            \
+  __attribute__((target("avx2"))) static unsigned name(                        \
+    void const* keys, unsigned n, void const* probe, _Bool upper)              \
+  {                                                                            \
+    T p;                                                                       \
+    __builtin_memcpy(&p, probe, sizeof p);                                     \
+                                                                               \
+    __m256i const b = _mm256_set1_epi32(bias);                                 \
+    __m256i const v = _mm256_xor_si256(_mm256_set1_epi32((int)p), b);          \
+    unsigned count = 0;                                                        \
+                                                                               \
+    for (unsigned i = 0; i < n; i += 8) {                                      \
+      __m256i k = _mm256_loadu_si256(                                          \
+        (__m256i const*)((char const*)keys + sizeof(T) * i));                  \
+      k = _mm256_xor_si256(k, b);                                              \
+                                                                               \
+      /* upper counts the keys that are not greater */                         \
+      __m256i const m =                                                        \
+        upper ? _mm256_cmpgt_epi32(k, v) : _mm256_cmpgt_epi32(v, k);           \
+      unsigned bits = _mm256_movemask_ps(_mm256_castsi256_ps(m));              \
+      if (upper)                                                               \
+        bits = ~bits;                                                          \
+      count += __builtin_popcount(bits & block_mask(n - i, 8));                \
+    }                                                                          \
+                                                                               \
+    return count;                                                              \
+  }
+
+#define RANK_AVX2_64(name, T, bias)                                            \
+  __attribute__((target("avx2"))) static unsigned name(                        \
+    void const* keys, unsigned n, void const* probe, _Bool upper)              \
+  {                                                                            \
+    T p;                                                                       \
+    __builtin_memcpy(&p, probe, sizeof p);                                     \
+                                                                               \
+    __m256i const b = _mm256_set1_epi64x(bias);                                \
+    __m256i const v = _mm256_xor_si256(_mm256_set1_epi64x((long long)p), b);   \
+    unsigned count = 0;                                                        \
+                                                                               \
+    for (unsigned i = 0; i < n; i += 4) {                                      \
+      __m256i k = _mm256_loadu_si256(                                          \
+        (__m256i const*)((char const*)keys + sizeof(T) * i));                  \
+      k = _mm256_xor_si256(k, b);                                              \
+                                                                               \
+      __m256i const m =                                                        \
+        upper ? _mm256_cmpgt_epi64(k, v) : _mm256_cmpgt_epi64(v, k);           \
+      unsigned bits = _mm256_movemask_pd(_mm256_castsi256_pd(m));              \
+      if (upper)                                                               \
+        bits = ~bits;                                                          \
+      count += __builtin_popcount(bits & block_mask(n - i, 4));                \
+    }                                                                          \
+                                                                               \
+    return count;                                                              \
+  }
+
+RANK_AVX2_32(rank_u32, uint32_t, INT32_MIN)
+RANK_AVX2_32(rank_i32, int32_t, 0)
+RANK_AVX2_64(rank_u64, uint64_t, INT64_MIN)
+RANK_AVX2_64(rank_i64, int64_t, 0)
+
+#elif defined(RANK_NEON)
+
+/* W is the lane bitsize, L the lanes in a vector, vt and sfx the vector
+ * type and intrinsic suffix of the keys. compares yield all ones lanes,
+ * shifted down to ones and summed */
+#define RANK_NEON(name, T, vt, sfx, W, L)                                      \
+  static unsigned name(                                                        \
+    void const* keys, unsigned n, void const* probe, _Bool upper)              \
+  {                                                                            \
+    T p;                                                                       \
+    __builtin_memcpy(&p, probe, sizeof p);                                     \
+                                                                               \
+    uint##W##_t const lane[4] = { 0, 1, 2, 3 };                                \
+    uint##W##x##L##_t const idx = vld1q_u##W(lane);                            \
+    vt const v = vdupq_n_##sfx(p);                                             \
+    unsigned count = 0;                                                        \
+                                                                               \
+    for (unsigned i = 0; i < n; i += L) {                                      \
+      vt const k = vld1q_##sfx((T const*)keys + i);                            \
+      uint##W##x##L##_t m = upper ? vcleq_##sfx(k, v) : vcltq_##sfx(k, v);     \
+      m = vandq_u##W(m, vcltq_u##W(idx, vdupq_n_u##W(n - i)));                 \
+      count += vaddvq_u##W(vshrq_n_u##W(m, W - 1));                            \
+    }                                                                          \
+                                                                               \
+    return count;                                                              \
+  }
+
+RANK_NEON(rank_u32, uint32_t, uint32x4_t, u32, 32, 4)
+RANK_NEON(rank_i32, int32_t, int32x4_t, s32, 32, 4)
+RANK_NEON(rank_u64, uint64_t, uint64x2_t, u64, 64, 2)
+RANK_NEON(rank_i64, int64_t, int64x2_t, s64, 64, 2)
+
+#endif
+
+brbt_rank_fn
+brbt_rank_kernel(enum brbt_key_kind kind)
+{
+#if defined(RANK_AVX2) || defined(RANK_NEON)
+#if defined(RANK_AVX2)
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("avx2"))
+    return NULL;
+#endif
+
+  switch (kind) {
+    case BRBT_KEY_U32:
+      return rank_u32;
+    case BRBT_KEY_I32:
+      return rank_i32;
+    case BRBT_KEY_U64:
+      return rank_u64;
+    case BRBT_KEY_I64:
+      return rank_i64;
+    default:
+      break;
+  }
+#endif
+
+  (void)kind;
+  return NULL;
+}
@@ -2,6 +2,31 @@
 
 #define BRBT_NIL ((unsigned)-1)
 
+/* an LLRB is at most 2 * log2(n + 1) nodes deep,
+ * which for 2^32 nodes is 64 */
+#define BRBT_MAX_DEPTH 64
+
+/* largest per node aggregate, see brbt_type::aggregate */
+#define BRBT_AGGREGATE_MAX 64
+
+/* largest key prefix that can be mirrored into the bookkeeping array */
+#define BRBT_INLINE_KEY_MAX 16
+
+/* the bookkeeping array takes 12 bytes per node by default.
+ * BRBT_BOOKKEEPING_PACKED moves the color into the top bit of
+ * the right link for 8 bytes, BRBT_BOOKKEEPING_SMALL also narrows
+ * the links to 16 bits for 4 bytes. either lowers the capacity
+ * a tree can reach, and has to be defined the same for every
+ * translation unit */
+#if defined(BRBT_BOOKKEEPING_SMALL)
+#define BRBT_MAX_CAPACITY 0x7fffu
+#elif defined(BRBT_BOOKKEEPING_PACKED)
+#define BRBT_MAX_CAPACITY 0x7fffffffu
+#else
+/* the two largest indices are reserved as markers */
+#define BRBT_MAX_CAPACITY ((unsigned)-2)
+#endif
+
 struct brbt;
 typedef unsigned brbt_node;
 
@@ -17,6 +42,18 @@ enum brbt_node_flags : unsigned char
   BRBT_NODE_RED = 0b10,
 };
 
+#if defined(BRBT_BOOKKEEPING_SMALL)
+struct brbt_bookkeeping_info
+{
+  /* right doubles as the free list link */
+  unsigned short left, right;
+};
+#elif defined(BRBT_BOOKKEEPING_PACKED)
+struct brbt_bookkeeping_info
+{
+  brbt_node left, right;
+};
+#else
 struct brbt_bookkeeping_info
 {
   brbt_node left, right;
@@ -27,6 +64,7 @@ struct brbt_bookkeeping_info
     _Bool red;
   };
 };
+#endif
 
 /*
  * NOTE: do not pass any data structure that is aligned to
@@ -36,12 +74,30 @@ struct brbt_bookkeeping_info
 typedef void (*brbt_iterator)(struct brbt*, void* userdata, brbt_node);
 
 typedef int (*brbt_comparator)(void const* key_lhs, void const* key_rhs);
+
+/* hashes a key, keys comparing equal have to hash equal */
+typedef unsigned long long (*brbt_hash)(void const* key);
 typedef void (*brbt_deleter)(struct brbt*, brbt_node);
 
+/* combines out = lhs . node . rhs for a monoid over node data.
+ * lhs and rhs are aggregates of whole subtrees or ranges,
+ * any of the three terms may be missing, signalled by a null
+ * pointer or BRBT_NIL, and then acts as the identity.
+ * out never aliases lhs or rhs
+ */
+typedef void (*brbt_aggregate)(struct brbt*,
+                               void* out,
+                               void const* lhs,
+                               brbt_node node,
+                               void const* rhs);
+
 /* function ran when the internal tree becomes full, and
  * the array is defined by the user, therefore the array may not be
  * reallocated.
- * the function must return a valid node index to which node should be freed
+ * the function must return a valid node index to which node should be freed,
+ * or BRBT_NIL to fail the insert.
+ * the victim is deleted from the tree as by brbt_delete, firing
+ * the deleter and remove hook, before the insert carries on
  */
 typedef brbt_node (*brbt_policy_select)(struct brbt*);
 
@@ -62,8 +118,15 @@ typedef void (*brbt_abort)(struct brbt*, int internal_source_line);
 
 typedef void (*brbt_free)(struct brbt*);
 
-typedef struct brbt_allocator_out (
-  *brbt_reallocator)(struct brbt*, enum brbt_allocation_request);
+/* picks the capacity a growing tree moves to,
+ * the result must be at least min_capacity */
+typedef unsigned (*brbt_policy_growth)(struct brbt*, unsigned min_capacity);
+
+/* min_capacity is the smallest capacity that satisfies the request */
+typedef struct brbt_allocator_out (*brbt_reallocator)(
+  struct brbt*,
+  enum brbt_allocation_request,
+  unsigned min_capacity);
 
 struct brbt_allocator_out
 {
@@ -90,16 +153,73 @@ struct brbt_policy
   /* function that is called whenever a tree runs out of space
    * in the middle of an insert operation. this function is
    * allowed to return an empty allocation, which will
-   * in turn cause the tree to call the "free" function to try
+   * in turn cause the tree to call the "select" function to try
    * and remove a value from the tree to create space for the
-   * inserted function. if free is non-existent or fails,
+   * inserted function. if select is non-existent or fails,
    * then the insert operation shall fail.
+   * the tree adopts every non-null array that is returned,
+   * a size no larger than the current capacity is an empty allocation.
+   * shrinking is only ever requested after the tree moved
+   * all of its nodes below min_capacity.
    */
   brbt_reallocator resize;
   brbt_free free;
   brbt_policy_select select;
+
+  /* growth strategy used by the stock resize functions,
+   * if null, capacity grows by 1.5x */
+  brbt_policy_growth growth;
+
+  /* upper bound on the capacity, 0 for unbounded */
+  unsigned max_capacity;
+
+  /* the policy keeps state indexed by node, brbt_shrink then leaves the
+   * tree as it is rather than renumbering the nodes behind its back */
+  _Bool pinned;
+};
+
+/* key kinds the implementation can compare without calling
+ * the comparator. integer keys are read in native byte order
+ */
+enum brbt_key_kind
+{
+  /* keys are compared with brbt_type::cmp */
+  BRBT_KEY_CUSTOM,
+  BRBT_KEY_U32,
+  BRBT_KEY_I32,
+  BRBT_KEY_U64,
+  BRBT_KEY_I64,
+
+  /* keys are brbt_type::keylen bytes compared with memcmp */
+  BRBT_KEY_BYTES,
+};
+
+enum brbt_type_flags
+{
+  /* keep the node count of every subtree, enables
+   * brbt_select, brbt_rank and brbt_count_range */
+  BRBT_COUNTED = 1u << 0,
 };
 
+/* how the data and bookkeeping arrays sit in memory */
+enum brbt_layout
+{
+  /* two allocations, keeps descents off the records of large types */
+  BRBT_LAYOUT_SPLIT,
+
+  /* one allocation, the bookkeeping array follows the data array */
+  BRBT_LAYOUT_COMBINED,
+
+  /* one allocation of whole nodes, every bookkeeping row is followed
+   * by its record, padded to 8 bytes. suits records of a few words,
+   * a descent then touches a single line per node */
+  BRBT_LAYOUT_INTERLEAVED,
+};
+
+/* designated initializer fragment for fixed-length byte string keys,
+ * e.g. { .membs = ..., BRBT_KEY_MEMCMP(16) } */
+#define BRBT_KEY_MEMCMP(n) .kind = BRBT_KEY_BYTES, .keylen = (n)
+
 struct brbt_type
 {
   /* member bytesize */
@@ -107,6 +227,117 @@ struct brbt_type
   unsigned keyoff;
   brbt_comparator cmp;
   brbt_deleter deleter;
+
+  /* number of leading key bytes mirrored next to the links of every node,
+   * up to BRBT_INLINE_KEY_MAX. when set, descents compare against the
+   * copy and only touch the data array on a hit. the comparator must then
+   * only look at the first inline_key bytes of a key, and will be handed
+   * pointers aligned to 8 bytes. 0 disables the copy
+   */
+  unsigned inline_key;
+
+  /* how keys are compared, cmp may be null for the built-in kinds */
+  enum brbt_key_kind kind;
+
+  /* key bytesize for BRBT_KEY_BYTES, and for BRBT_KEY_CUSTOM
+   * keys a brbt_btree copies into its nodes or brbt_emplace
+   * copies into a record */
+  unsigned keylen;
+
+  /* enum brbt_type_flags, optional per node bookkeeping */
+  unsigned flags;
+
+  /* if set, every node keeps the aggregate of its subtree, aggbs bytes
+   * of at most BRBT_AGGREGATE_MAX aligned to 8, in the bookkeeping array.
+   * they are refreshed along modified paths and at rotations.
+   * data changed in place must be followed by brbt_refresh
+   */
+  brbt_aggregate aggregate;
+  unsigned aggbs;
+
+  /* placement of the arrays, honoured by the stock policies.
+   * see brbt_layout_place for policies of their own */
+  enum brbt_layout layout;
+
+  /* if set, the tree keeps an open addressing index from the hash of
+   * every key to its node next to the arrays, and brbt_find probes it
+   * in O(1) expected instead of descending. everything else still goes
+   * through the tree. the index takes 8 bytes or more per node of
+   * capacity, is allocated with malloc, and limits the capacity to
+   * 2^31 nodes
+   */
+  brbt_hash hash;
+};
+
+/* bytesize of a key of a built-in kind, 0 for BRBT_KEY_CUSTOM */
+static inline unsigned
+brbt_key_size(struct brbt_type const* type)
+{
+  switch (type->kind) {
+    case BRBT_KEY_U32:
+    case BRBT_KEY_I32:
+      return 4;
+    case BRBT_KEY_U64:
+    case BRBT_KEY_I64:
+      return 8;
+    case BRBT_KEY_BYTES:
+      return type->keylen;
+    case BRBT_KEY_CUSTOM:
+    default:
+      return 0;
+  }
+}
+
+/* builds defining BRBT_DIRTY keep a bit per run of 1 << BRBT_DIRTY_SHIFT
+ * nodes, set whenever the record or bookkeeping row of one of them is
+ * written, see brbt_checkpoint. it has to be defined the same for every
+ * translation unit, and needs the stdlib */
+#ifndef BRBT_DIRTY_SHIFT
+#define BRBT_DIRTY_SHIFT 6
+#endif
+
+#if defined(BRBT_DIRTY) && defined(BRBT_NO_STDLIB)
+#error "BRBT_DIRTY allocates its map with malloc"
+#endif
+
+/* counters of the hot paths, only kept by builds defining BRBT_STATS,
+ * which has to be defined the same for every translation unit.
+ * they are as unsynchronized as the rest of a tree, threads reading
+ * one tree at once race on them */
+struct brbt_counters
+{
+  unsigned long long compares;
+  unsigned long long rotations;
+  unsigned long long color_flips;
+
+  /* calls to the resize of the policy, and the bytes its grows added */
+  unsigned long long resizes;
+  unsigned long long grown_bytes;
+
+  /* nodes picked by select and deleted to make room */
+  unsigned long long evictions;
+};
+
+struct brbt_stats
+{
+  /* all zero without BRBT_STATS */
+  struct brbt_counters counters;
+
+  unsigned size;
+  unsigned capacity;
+
+  /* free nodes on the free list, and nodes past the high-water mark */
+  unsigned free_list;
+  unsigned untouched;
+
+  /* nodes on the longest path from the root, 0 when empty */
+  unsigned height;
+
+  /* black nodes on every path from the root */
+  unsigned black_height;
+
+  /* mean number of links from the root to a node */
+  double average_depth;
 };
 
 struct brbt
@@ -133,17 +364,64 @@ struct brbt
   /* first free node in the list */
   brbt_node first_free;
 
+  /* high-water mark, nodes at or past this index
+   * have never been handed out and are not on the free list */
+  brbt_node next_uninitialized;
+
   struct brbt_type const* _type;
   struct brbt_policy const* _policy;
+
+  /* layout of a row in the bookkeeping array, derived from the type */
+  unsigned _bk_stride;
+  unsigned _bk_count;
+  unsigned _bk_agg;
+  unsigned _bk_key;
+
+  /* step between records, and the offset of a record
+   * within an interleaved node */
+  unsigned _data_stride;
+  unsigned _data_off;
+
+  /* the hash index, slots hold a node or BRBT_NIL, and number
+   * _index_mask + 1. NULL until the tree first grows, or without a hash */
+  brbt_node* _index;
+  unsigned _index_mask;
+
+  /* a bit per node for the tombstones of deferred deletes, covering the
+   * capacity, NULL until the first deferred delete */
+  unsigned long long* _tombs;
+  unsigned _tomb_words;
+  unsigned _tomb_count;
+
+  /* word of _tombs brbt_maintenance resumes at */
+  unsigned _tomb_scan;
+
+#ifdef BRBT_STATS
+  struct brbt_counters _counters;
+#endif
+
+#ifdef BRBT_DIRTY
+  /* the dirty map, covering the capacity */
+  unsigned long long* _dirty;
+  unsigned _dirty_words;
+#endif
 };
 
 #define brbt_usage(tree) ((tree).capacity * (tree)._type->membs)
 
-/* expects tree to be a pointer */
+/* whether node was deleted by brbt_delete_deferred, and is still linked
+ * in until brbt_maintenance gets to it */
+static inline _Bool
+brbt_tombstone(struct brbt const* tree, brbt_node node)
+{
+  return tree->_tomb_count && (tree->_tombs[node / 64] >> (node % 64) & 1);
+}
+
+/* expects tree to be a pointer, skips tombstones */
 #define brbt_for(tree, id, lambda)                                             \
   do {                                                                         \
-    /* up to 2^32 node depth */                                                \
-    unsigned _brbt_stack[32][2];                                               \
+    /* every node of the deepest path, plus the nil link below it */           \
+    unsigned _brbt_stack[BRBT_MAX_DEPTH + 1][2];                               \
     unsigned _brbt_si = 0;                                                     \
     _brbt_stack[_brbt_si][0] = 0;                                              \
     _brbt_stack[_brbt_si++][1] = (tree)->root;                                 \
@@ -160,7 +438,7 @@ struct brbt
         _brbt_stack[_brbt_si++][1] = lhs;                                      \
       } else {                                                                 \
         unsigned id = (*_brbt_state)[1];                                       \
-        {                                                                      \
+        if (!brbt_tombstone((tree), id)) {                                     \
           lambda;                                                              \
         }                                                                      \
         (*_brbt_state)[1] = brbt_right((tree), (*_brbt_state)[1]);             \
@@ -169,6 +447,22 @@ struct brbt
     }                                                                          \
   } while (0)
 
+/* a position within the in-order sequence of a tree.
+ * it holds the path from the root down to the current node,
+ * so stepping is amortized O(1) and it can be paused and resumed
+ * at will. any insert or delete invalidates it, a cursor can be
+ * repositioned afterwards with brbt_cursor_upper_bound on the last
+ * key it visited
+ */
+struct brbt_cursor
+{
+  struct brbt* tree;
+  brbt_node path[BRBT_MAX_DEPTH];
+
+  /* 0 when the cursor is past either end */
+  unsigned depth;
+};
+
 struct brbt
 brbt_create(struct brbt_type const* type,
             struct brbt_policy const* policy,
@@ -189,6 +483,83 @@ brbt_capacity(struct brbt*);
 brbt_node
 brbt_find(struct brbt* tree, void const* key);
 
+/* looks up n keys at once, out[i] receives the node of keys[i]
+ * or BRBT_NIL. the descents are interleaved and prefetch ahead,
+ * which hides most of the memory latency of independent lookups
+ */
+void
+brbt_find_many(struct brbt* tree,
+               void const* const* keys,
+               unsigned n,
+               brbt_node* out);
+
+/* the first node not less than key, or BRBT_NIL */
+brbt_node
+brbt_lower_bound(struct brbt* tree, void const* key);
+
+/* the first node greater than key, or BRBT_NIL */
+brbt_node
+brbt_upper_bound(struct brbt* tree, void const* key);
+
+/* the last node not greater than key, or BRBT_NIL */
+brbt_node
+brbt_floor(struct brbt* tree, void const* key);
+
+/* the first node not less than key, or BRBT_NIL */
+brbt_node
+brbt_ceil(struct brbt* tree, void const* key);
+
+/* order statistics, the type must be BRBT_COUNTED.
+ * all of them run in O(log n)
+ */
+
+/* the k-th smallest node counting from 0, or BRBT_NIL */
+brbt_node
+brbt_select(struct brbt* tree, unsigned k);
+
+/* the number of nodes less than key */
+unsigned
+brbt_rank(struct brbt* tree, void const* key);
+
+/* the number of nodes with a key in [lo, hi),
+ * a null bound leaves that side open */
+unsigned
+brbt_count_range(struct brbt* tree, void const* lo, void const* hi);
+
+/* subtree aggregates, the type must have an aggregate */
+
+/* the aggregate over the subtree of node */
+void*
+brbt_aggregate_of(struct brbt* tree, brbt_node node);
+
+/* recomputes the aggregates depending on node,
+ * after its data was changed in place */
+void
+brbt_refresh(struct brbt* tree, brbt_node node);
+
+/* combines the aggregate of every node with a key in [lo, hi)
+ * into out from O(log n) subtree aggregates.
+ * a null bound leaves that side open.
+ * returns false, leaving out untouched, if the range is empty
+ */
+_Bool
+brbt_range_aggregate(struct brbt* tree,
+                     void const* lo,
+                     void const* hi,
+                     void* out);
+
+/* calls fn in order on every node with a key in [lo, hi).
+ * subtrees outside of the bounds are never visited,
+ * a null bound leaves that side open.
+ * the tree must not be modified from within fn
+ */
+void
+brbt_range(struct brbt* tree,
+           void const* lo,
+           void const* hi,
+           brbt_iterator fn,
+           void* userdata);
+
 /* gets the node data associated with a node index */
 void*
 brbt_get(struct brbt* tree, brbt_node);
@@ -196,18 +567,129 @@ brbt_get(struct brbt* tree, brbt_node);
 /* inserts a node with a key and returns its node index
  * if no delete operations are performed, then it is guaranteed that
  * successive insert operations will return incrementing nodes indices
+ * if the key already exists, the index of the existing node is returned,
+ * and its data is overwritten only if replace is set
+ * returns BRBT_NIL, leaving the tree as it was, if the tree is full
+ * and can neither grow nor evict a node
  */
 brbt_node
 brbt_insert(struct brbt* tree, void* node, _Bool replace);
 
+/* brbt_insert without replacing, inserted tells whether the record
+ * was copied into a new node or the key was already present */
+brbt_node
+brbt_find_or_insert(struct brbt* tree, void* node, _Bool* inserted);
+
+/* returns the data of the node with key, linking in a new node for key
+ * if there is none. a new node only has its key copied in, the rest of
+ * the record is left for the caller to construct in place, without
+ * changing the key. the insert hook has run on it already, and a type
+ * with an aggregate needs brbt_refresh once the record is complete.
+ * inserted, if non-null, tells whether the node is new.
+ * custom keys need keylen set to their bytesize.
+ * returns NULL if the tree is full, as brbt_insert would fail
+ */
+void*
+brbt_emplace(struct brbt* tree, void const* key, _Bool* inserted);
+
+/* inserts n records as by brbt_insert, in key order.
+ * records is sorted in place, and out, if non-null,
+ * receives the node of records[i] as it is after sorting
+ */
+void
+brbt_insert_many(struct brbt* tree,
+                 void** records,
+                 unsigned n,
+                 _Bool replace,
+                 brbt_node* out);
+
+/* fills an empty tree with count records laid out contiguously
+ * and sorted by strictly ascending key. the comparator is never called,
+ * and node i holds records[i] afterwards.
+ * returns false if the tree could not make room for count nodes
+ */
+_Bool
+brbt_build_sorted(struct brbt* tree, void const* records, unsigned count);
+
+/* set operations on two trees of the same type, built on joining and
+ * splitting subtrees. merging the trees costs O(m log(n / m + 1)),
+ * m being the size of the smaller one, but a moves the records of b
+ * into nodes of its own first, which takes O(size of b).
+ * brbt_parallel.h has variants forking on subtrees
+ */
+
+/* moves the records of b into a, every key of b has to be greater than
+ * every key of a. b is left empty.
+ * returns false, changing neither, if a could not make room for b */
+_Bool
+brbt_join(struct brbt* a, struct brbt* b);
+
+/* moves the records with keys not less than key into hi, an empty tree
+ * of the same type, tree keeps the rest.
+ * returns false, changing neither, if hi could not make room for them */
+_Bool
+brbt_split(struct brbt* tree, void const* key, struct brbt* hi);
+
+/* moves the records of b into a, a keeping its own record for a key
+ * both of them hold, b's is passed to the deleter. b is left empty.
+ * returns false, changing neither, if a could not make room for b */
+_Bool
+brbt_union(struct brbt* a, struct brbt* b);
+
+/* deletes the records of a whose keys are not in b */
+void
+brbt_intersection(struct brbt* a, struct brbt* b);
+
+/* deletes the records of a whose keys are in b */
+void
+brbt_difference(struct brbt* a, struct brbt* b);
+
 /* deletes a node with a given key */
 void
 brbt_delete(struct brbt* tree, void* key);
 
-/* empties a tree */
+/* deletes the node with key as far as brbt_find, brbt_find_many,
+ * brbt_size, brbt_for, cursors and brbt_range can tell, leaving it linked
+ * in as a tombstone. unlinking it, the deleter and the remove hook are
+ * left to brbt_maintenance. bounds, brbt_minimum and brbt_maximum, the
+ * order statistics and aggregates still see the node until then.
+ * inserting the key again takes over the node, running the deleter and
+ * the remove hook on it first. the bulk operations, brbt_compact,
+ * brbt_save and brbt_checkpoint run the maintenance of pending tombstones
+ * first. deletes right away if the tombstones cannot be allocated
+ */
+void
+brbt_delete_deferred(struct brbt* tree, void* key);
+
+/* deletes up to budget tombstones, in batches sorted by key, so that
+ * consecutive deletes mostly walk paths already in cache.
+ * returns the number of tombstones left */
+unsigned
+brbt_maintenance(struct brbt* tree, unsigned budget);
+
+/* empties a tree, keeping its capacity. O(1) unless there is a deleter
+ * or a remove hook, which then run on every node, or a hash index to
+ * empty */
 void
 brbt_clear(struct brbt* tree);
 
+/* renumbers the nodes such that they occupy [0, size) in key order,
+ * and relinks them into a balanced tree.
+ * if remap_out is non-null, it must have room for a node index per
+ * node of capacity, and receives the new index of every old one,
+ * or BRBT_NIL for old indices that were free
+ */
+void
+brbt_compact(struct brbt* tree, brbt_node* remap_out);
+
+/* compacts the tree and asks the policy
+ * to release the rest of the capacity.
+ * node indices held outside of the tree are invalidated.
+ * does nothing if the policy is pinned
+ */
+void
+brbt_shrink(struct brbt* tree);
+
 /* deletes the smallest node within a subtree */
 void
 brbt_delete_min(struct brbt* tree, brbt_node);
@@ -216,10 +698,126 @@ brbt_delete_min(struct brbt* tree, brbt_node);
 brbt_node
 brbt_minimum(struct brbt* tree, brbt_node);
 
+/* returns the node index of the largest node within the tree */
+brbt_node
+brbt_maximum(struct brbt* tree, brbt_node);
+
+/* creates a cursor positioned past the end of the tree */
+struct brbt_cursor
+brbt_cursor(struct brbt* tree);
+
+/* positions the cursor on the smallest node */
+void
+brbt_cursor_first(struct brbt_cursor*);
+
+/* positions the cursor on the largest node */
+void
+brbt_cursor_last(struct brbt_cursor*);
+
+/* positions the cursor on the node matching key,
+ * or past the end if there is none */
+void
+brbt_cursor_seek(struct brbt_cursor*, void const* key);
+
+/* positions the cursor on the first node not less than key */
+void
+brbt_cursor_lower_bound(struct brbt_cursor*, void const* key);
+
+/* positions the cursor on the first node greater than key */
+void
+brbt_cursor_upper_bound(struct brbt_cursor*, void const* key);
+
+/* steps to the next or previous node in order.
+ * stepping past either end leaves the cursor past the end,
+ * and returns false */
+_Bool
+brbt_cursor_next(struct brbt_cursor*);
+_Bool
+brbt_cursor_prev(struct brbt_cursor*);
+
+_Bool
+brbt_cursor_at_end(struct brbt_cursor const*);
+
+/* the current node, BRBT_NIL when past the end */
+brbt_node
+brbt_cursor_node(struct brbt_cursor const*);
+
 /* returns the node index to the root of the tree */
 brbt_node
 brbt_root(struct brbt* tree);
 
+/* fills out with the counters, and with the shape of the tree,
+ * which is measured in O(n) */
+void
+brbt_stats(struct brbt* tree, struct brbt_stats* out);
+
+/* zeroes the counters */
+void
+brbt_stats_reset(struct brbt* tree);
+
+/* marks the record of node as changed, after it was written in place,
+ * a no-op without BRBT_DIRTY */
+void
+brbt_mark_dirty(struct brbt* tree, brbt_node node);
+
+/* bytesize of a single node in the bookkeeping array,
+ * allocators must size bk_array as capacity times this */
+static inline unsigned
+brbt_bk_stride(struct brbt const* tree)
+{
+  return tree->_bk_stride;
+}
+
+/* offset of the bookkeeping array within a combined allocation */
+static inline unsigned long
+brbt_layout_bk_offset(struct brbt const* tree, unsigned capacity)
+{
+  unsigned long const data = (unsigned long)tree->_type->membs * capacity;
+  return (data + 15) / 16 * 16;
+}
+
+/* bytesize of the single allocation holding capacity nodes,
+ * for the combined and interleaved layouts */
+static inline unsigned long
+brbt_layout_bytes(struct brbt const* tree, unsigned capacity)
+{
+  unsigned long const bk = (unsigned long)tree->_bk_stride * capacity;
+
+  if (tree->_type->layout == BRBT_LAYOUT_COMBINED)
+    return brbt_layout_bk_offset(tree, capacity) + bk;
+  return bk;
+}
+
+/* the single allocation backing the arrays of the tree */
+static inline void*
+brbt_layout_block(struct brbt const* tree)
+{
+  if (tree->_type->layout == BRBT_LAYOUT_INTERLEAVED)
+    return tree->bk;
+  return tree->ptr;
+}
+
+/* points both arrays of out into a single allocation of capacity nodes.
+ * a combined block has to move its bookkeeping array along whenever
+ * the capacity changes, see brbt_layout_bk_offset */
+static inline void
+brbt_layout_place(struct brbt const* tree,
+                  void* block,
+                  unsigned capacity,
+                  struct brbt_allocator_out* out)
+{
+  char* const p = (char*)block;
+
+  if (tree->_type->layout == BRBT_LAYOUT_INTERLEAVED) {
+    out->bk_array = (struct brbt_bookkeeping_info*)p;
+    out->data_array = p + tree->_data_off;
+  } else {
+    unsigned long const off = brbt_layout_bk_offset(tree, capacity);
+    out->data_array = p;
+    out->bk_array = (struct brbt_bookkeeping_info*)(p + off);
+  }
+}
+
 brbt_node
 brbt_left(struct brbt*, brbt_node);
 brbt_node
@@ -236,39 +834,151 @@ brbt_right(struct brbt*, brbt_node);
 static inline void
 brbt_default_policy_free(struct brbt* tree)
 {
-  free(tree->ptr);
-  free(tree->bk);
+  if (tree->_type->layout == BRBT_LAYOUT_SPLIT) {
+    free(tree->ptr);
+    free(tree->bk);
+  } else {
+    free(brbt_layout_block(tree));
+  }
+}
+
+/* grows by 1.5x */
+static inline unsigned
+brbt_growth_default(struct brbt* tree, unsigned min_capacity)
+{
+  (void)min_capacity;
+  unsigned long long const old_cap = brbt_capacity(tree);
+  return old_cap == 0 ? BRBT_DEFAULT_CAPACITY : old_cap * 3 / 2;
+}
+
+/* grows by 2x */
+static inline unsigned
+brbt_growth_double(struct brbt* tree, unsigned min_capacity)
+{
+  (void)min_capacity;
+  unsigned long long const old_cap = brbt_capacity(tree);
+  return old_cap == 0 ? BRBT_DEFAULT_CAPACITY : old_cap * 2;
+}
+
+/* grows by exactly what was asked for, for trees
+ * that are sized up front */
+static inline unsigned
+brbt_growth_exact(struct brbt* tree, unsigned min_capacity)
+{
+  (void)tree;
+  return min_capacity;
+}
+
+/* runs the growth strategy of the policy and clamps the result */
+static inline unsigned
+brbt_next_capacity(struct brbt* tree, unsigned min_capacity)
+{
+  brbt_policy_growth growth = tree->_policy->growth;
+  unsigned long long new_cap =
+    (growth ? growth : brbt_growth_default)(tree, min_capacity);
+
+  unsigned long long max_cap = tree->_policy->max_capacity;
+  if (max_cap == 0 || max_cap > BRBT_MAX_CAPACITY)
+    max_cap = BRBT_MAX_CAPACITY;
+
+  new_cap = (new_cap < min_capacity) ? min_capacity : new_cap;
+  new_cap = (new_cap > max_cap) ? max_cap : new_cap;
+  return new_cap;
+}
+
+/* resizes the single allocation of the combined and interleaved layouts,
+ * one realloc for both arrays */
+static inline struct brbt_allocator_out
+brbt_realloc_block(struct brbt* tree, unsigned new_cap)
+{
+  unsigned const old_cap = brbt_capacity(tree);
+  unsigned long const rows =
+    (unsigned long)brbt_bk_stride(tree) * tree->next_uninitialized;
+  _Bool const combined = tree->_type->layout == BRBT_LAYOUT_COMBINED;
+  char* block = (char*)brbt_layout_block(tree);
+
+  struct brbt_allocator_out out;
+  out.realloc = 1;
+
+  /* the rows in use move down before the block loses its tail */
+  if (combined && block && new_cap < old_cap)
+    __builtin_memmove(block + brbt_layout_bk_offset(tree, new_cap),
+                      block + brbt_layout_bk_offset(tree, old_cap),
+                      rows);
+
+  char* p = (char*)realloc(block, brbt_layout_bytes(tree, new_cap));
+  if (!p) {
+    /* the old block stays, but may already be laid out for new_cap */
+    out.data_array = NULL;
+    out.bk_array = NULL;
+    out.size = old_cap;
+    if (block && new_cap < old_cap) {
+      brbt_layout_place(tree, block, new_cap, &out);
+      out.size = new_cap;
+    }
+    return out;
+  }
+
+  /* and up once the block has room for them */
+  if (combined && new_cap > old_cap && rows)
+    __builtin_memmove(p + brbt_layout_bk_offset(tree, new_cap),
+                      p + brbt_layout_bk_offset(tree, old_cap),
+                      rows);
+
+  brbt_layout_place(tree, p, new_cap, &out);
+  out.size = new_cap;
+  return out;
 }
 
 static inline struct brbt_allocator_out
-brbt_default_policy_resize(struct brbt* tree, enum brbt_allocation_request req)
+brbt_default_policy_resize(struct brbt* tree,
+                           enum brbt_allocation_request req,
+                           unsigned min_capacity)
 {
   struct brbt_allocator_out out;
-  unsigned old_cap = brbt_capacity(tree);
   unsigned new_cap = 0;
 
   switch (req) {
-    case BRBT_GROW:
-      if (old_cap == 0)
-        new_cap = BRBT_DEFAULT_CAPACITY;
-      else
-        new_cap = old_cap * 1.5;
+    case BRBT_GROW: {
+      unsigned const max_cap = tree->_policy->max_capacity;
+      new_cap = brbt_next_capacity(tree, min_capacity);
+      /* min of 32, unless the policy caps the tree below that */
+      if (new_cap < 32 && (max_cap == 0 || max_cap >= 32))
+        new_cap = 32;
       out.realloc = 1;
       break;
+    }
 
     case BRBT_SHRINK:
-      tree->_policy->abort(tree, __LINE__);
-      out.realloc = 0;
+      new_cap = (min_capacity < 32) ? 32 : min_capacity;
+      new_cap = (new_cap > brbt_capacity(tree)) ? brbt_capacity(tree) : new_cap;
+      out.realloc = 1;
+      break;
   }
 
-  /* min of 32 */
-  new_cap = (new_cap < 32) ? 32 : new_cap;
+  /* nothing to move, the arrays stay where they are */
+  if (new_cap == brbt_capacity(tree)) {
+    out.data_array = tree->ptr;
+    out.bk_array = tree->bk;
+    out.size = new_cap;
+    return out;
+  }
+
+  if (tree->_type->layout != BRBT_LAYOUT_SPLIT)
+    return brbt_realloc_block(tree, new_cap);
 
   out.bk_array =
-    realloc(tree->bk, sizeof(struct brbt_bookkeeping_info) * new_cap);
-  out.data_array = realloc(tree->ptr, tree->_type->membs * new_cap);
+    realloc(tree->bk, (unsigned long)brbt_bk_stride(tree) * new_cap);
+  out.data_array =
+    realloc(tree->ptr, (unsigned long)tree->_type->membs * new_cap);
   out.size = new_cap;
 
+  /* a failed realloc leaves the old array in place, and the tree
+   * adopts the one that did move. when growing, the old one is too
+   * small for the new size, shrinking fits either */
+  if (req == BRBT_GROW && (!out.bk_array || !out.data_array))
+    out.size = brbt_capacity(tree);
+
   return out;
 }
 
@@ -290,9 +1000,186 @@ brbt_create_default_policy()
   out.resize = brbt_default_policy_resize;
   out.free = brbt_default_policy_free;
   out.select = 0;
+  out.growth = 0;
+  out.max_capacity = 0;
+  out.pinned = 0;
+  return out;
+}
+
+#if !defined(BRBT_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* anonymous mappings and madvise are extensions, building under a strict
+ * -std=c17 hides them unless e.g. _DEFAULT_SOURCE is defined */
+#if defined(MAP_ANONYMOUS) && defined(MADV_DONTNEED)
+#define BRBT_HAS_MMAP 1
+
+/* rounds a byte size up to whole pages */
+static inline unsigned long
+brbt_mmap_round(unsigned long bytes)
+{
+  unsigned long const page = sysconf(_SC_PAGESIZE);
+  return (bytes + page - 1) / page * page;
+}
+
+/* reserves address space that is only backed once touched */
+static inline void*
+brbt_mmap_reserve(unsigned long bytes)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif
+
+  void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+
+  return p;
+}
+
+/* hands the pages past the first bytes of an array back to the os */
+static inline void
+brbt_mmap_release_tail(void* p, unsigned long bytes, unsigned long total)
+{
+  unsigned long const keep = brbt_mmap_round(bytes);
+  if (keep < total)
+    madvise((char*)p + keep, total - keep, MADV_DONTNEED);
+}
+
+/* page rounded bytesizes of the arrays at max_capacity, the bookkeeping
+ * array of a combined reservation starts on a page of its own.
+ * interleaved nodes all live in the bookkeeping array */
+static inline unsigned long
+brbt_mmap_data_bytes(struct brbt* tree)
+{
+  if (tree->_type->layout == BRBT_LAYOUT_INTERLEAVED)
+    return 0;
+  return brbt_mmap_round((unsigned long)tree->_type->membs *
+                         tree->_policy->max_capacity);
+}
+
+static inline unsigned long
+brbt_mmap_bk_bytes(struct brbt* tree)
+{
+  return brbt_mmap_round((unsigned long)brbt_bk_stride(tree) *
+                         tree->_policy->max_capacity);
+}
+
+static inline void
+brbt_mmap_policy_free(struct brbt* tree)
+{
+  unsigned long const data_bytes = brbt_mmap_data_bytes(tree);
+  unsigned long const bk_bytes = brbt_mmap_bk_bytes(tree);
+
+  switch (tree->_type->layout) {
+    case BRBT_LAYOUT_SPLIT:
+      if (tree->ptr)
+        munmap(tree->ptr, data_bytes);
+      if (tree->bk)
+        munmap(tree->bk, bk_bytes);
+      break;
+
+    case BRBT_LAYOUT_COMBINED:
+    case BRBT_LAYOUT_INTERLEAVED:
+      if (brbt_layout_block(tree))
+        munmap(brbt_layout_block(tree), data_bytes + bk_bytes);
+      break;
+  }
+}
+
+/* reserves the arrays that are still missing */
+static inline void
+brbt_mmap_reserve_arrays(struct brbt* tree, struct brbt_allocator_out* out)
+{
+  unsigned long const data_bytes = brbt_mmap_data_bytes(tree);
+  unsigned long const bk_bytes = brbt_mmap_bk_bytes(tree);
+
+  if (tree->_type->layout == BRBT_LAYOUT_SPLIT) {
+    if (!out->data_array)
+      out->data_array = brbt_mmap_reserve(data_bytes);
+    if (!out->bk_array)
+      out->bk_array = brbt_mmap_reserve(bk_bytes);
+    return;
+  }
+
+  if (out->data_array && out->bk_array)
+    return;
+
+  char* p = (char*)brbt_mmap_reserve(data_bytes + bk_bytes);
+  if (!p)
+    return;
+
+  if (tree->_type->layout == BRBT_LAYOUT_INTERLEAVED) {
+    out->bk_array = (struct brbt_bookkeeping_info*)p;
+    out->data_array = p + tree->_data_off;
+  } else {
+    out->data_array = p;
+    out->bk_array = (struct brbt_bookkeeping_info*)(p + data_bytes);
+  }
+}
+
+/* both arrays are reserved at max_capacity on the first grow,
+ * growing afterwards never moves or copies them */
+static inline struct brbt_allocator_out
+brbt_mmap_policy_resize(struct brbt* tree,
+                        enum brbt_allocation_request req,
+                        unsigned min_capacity)
+{
+  struct brbt_allocator_out out;
+  out.data_array = tree->ptr;
+  out.bk_array = tree->bk;
+  out.size = brbt_capacity(tree);
+  out.realloc = 1;
+
+  switch (req) {
+    case BRBT_GROW:
+      brbt_mmap_reserve_arrays(tree, &out);
+
+      if (out.data_array && out.bk_array)
+        out.size = brbt_next_capacity(tree, min_capacity);
+      break;
+
+    case BRBT_SHRINK:
+      if (!out.data_array || !out.bk_array)
+        break;
+
+      if (tree->_type->layout != BRBT_LAYOUT_INTERLEAVED)
+        brbt_mmap_release_tail(
+          out.data_array,
+          (unsigned long)tree->_type->membs * min_capacity,
+          brbt_mmap_data_bytes(tree));
+      brbt_mmap_release_tail(
+        out.bk_array,
+        (unsigned long)brbt_bk_stride(tree) * min_capacity,
+        brbt_mmap_bk_bytes(tree));
+      out.size = min_capacity;
+      break;
+  }
+
   return out;
 }
 
+/* policy backed by a single mmap reservation of max_capacity nodes,
+ * with transparent hugepages requested where available */
+static inline struct brbt_policy
+brbt_create_mmap_policy(unsigned max_capacity)
+{
+  struct brbt_policy out = brbt_create_default_policy();
+  out.resize = brbt_mmap_policy_resize;
+  out.free = brbt_mmap_policy_free;
+  out.max_capacity = max_capacity;
+  return out;
+}
+
+#endif
+
 #endif
 
 /* helper combination function of find and get */
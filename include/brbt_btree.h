@@ -0,0 +1,101 @@
+#pragma once
+
+#include "brbt.h"
+
+/* a B+ tree over the same types and policies as a brbt, for read mostly
+ * indices. nodes hold up to a dozen or so keys inline, so a lookup takes
+ * a handful of node visits where a brbt takes dozens of dependent loads.
+ *
+ * records live in a slot array of their own and keep their index for
+ * as long as they are in the tree, like the nodes of a brbt. the deleter,
+ * the hooks and select all see that record array. the nodes of the tree
+ * are allocated through the same policy, in a second array.
+ *
+ * keys are copied into the nodes, the type needs a built-in key kind,
+ * or a custom one with keylen set to the key bytesize. the inline key,
+ * flags and aggregate of the type do not apply
+ */
+
+/* bytesize of a node, a multiple of the cache line size */
+#ifndef BRBT_BTREE_NODE_BYTES
+#define BRBT_BTREE_NODE_BYTES 128
+#endif
+
+/* deepest b tree walked by the modifying operations */
+#define BRBT_BTREE_MAX_HEIGHT 32
+
+struct brbt_btree
+{
+  /* the records, only the arrays and the free list of it are used */
+  struct brbt records;
+
+  /* nodes of BRBT_BTREE_NODE_BYTES */
+  struct brbt nodes;
+
+  brbt_node root;
+
+  /* levels of nodes, leaves are at height 1, 0 when empty */
+  unsigned height;
+
+  /* node layout derived from the key bytesize */
+  unsigned _order;
+  unsigned _key_stride;
+  unsigned _links_off;
+
+  /* vector bound of a node for the integer kinds, NULL to scan */
+  unsigned (*_rank)(void const*, unsigned, void const*, _Bool);
+};
+
+struct brbt_btree
+brbt_btree_create(struct brbt_type const* type,
+                  struct brbt_policy const* policy,
+                  void* userdata);
+
+void
+brbt_btree_destroy(struct brbt_btree* tree);
+
+/* empties a tree */
+void
+brbt_btree_clear(struct brbt_btree* tree);
+
+unsigned
+brbt_btree_size(struct brbt_btree* tree);
+
+/* the data of a record */
+void*
+brbt_btree_get(struct brbt_btree* tree, brbt_node record);
+
+/* returns the record with key, BRBT_NIL if not found */
+brbt_node
+brbt_btree_find(struct brbt_btree* tree, void const* key);
+
+/* inserts a record as by brbt_insert, and returns its index.
+ * the existing record is returned if its key is present,
+ * and overwritten only if replace is set.
+ * returns BRBT_NIL, leaving the tree as it was, if there is no room
+ * for the record or the nodes it needs, and nothing can be evicted
+ */
+brbt_node
+brbt_btree_insert(struct brbt_btree* tree, void* record, _Bool replace);
+
+void
+brbt_btree_delete(struct brbt_btree* tree, void const* key);
+
+/* calls fn in order on every record with a key in [lo, hi),
+ * a null bound leaves that side open. fn is handed the record array */
+void
+brbt_btree_range(struct brbt_btree* tree,
+                 void const* lo,
+                 void const* hi,
+                 brbt_iterator fn,
+                 void* userdata);
+
+/* helper combination function of find and get */
+static inline void*
+brbt_btree_find_get(struct brbt_btree* tree, void const* key)
+{
+  brbt_node idx = brbt_btree_find(tree, key);
+  if (idx == BRBT_NIL)
+    return NULL;
+  return brbt_btree_get(tree, idx);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "brbt.h"
+
+/* stock eviction policies turning a tree bounded by max_capacity into a
+ * cache. the policy keeps its own per node state in arrays sized to the
+ * capacity of the tree, maintained from the insert and remove hooks, and
+ * picks the victim through select in O(1) amortized.
+ * a cache serves exactly one tree, and owns the hooks of its policy.
+ * node indices must stay put, so after brbt_compact the state has to be
+ * moved along with brbt_cache_remap. the policy is pinned, brbt_shrink
+ * leaves the tree alone
+ */
+
+enum brbt_cache_kind
+{
+  /* evicts the oldest insert */
+  BRBT_CACHE_FIFO,
+
+  /* evicts the least recently inserted or touched node */
+  BRBT_CACHE_LRU,
+
+  /* second chance approximation of lru, touching only sets a bit */
+  BRBT_CACHE_CLOCK,
+
+  /* evicts the least often touched out of a few random nodes */
+  BRBT_CACHE_LFU,
+};
+
+/* nodes sampled per eviction by BRBT_CACHE_LFU */
+#ifndef BRBT_CACHE_LFU_SAMPLES
+#define BRBT_CACHE_LFU_SAMPLES 5
+#endif
+
+struct brbt_cache
+{
+  /* trees are created with &cache->policy, must stay first */
+  struct brbt_policy policy;
+
+  enum brbt_cache_kind kind;
+
+  /* per node state, state_capacity entries each.
+   * fifo and lru chain live nodes from oldest to newest,
+   * clock and lfu keep a counter that is 0 for free nodes */
+  brbt_node* prev;
+  brbt_node* next;
+  unsigned* count;
+  unsigned state_capacity;
+
+  brbt_node head;
+  brbt_node tail;
+
+  /* next node the clock looks at */
+  brbt_node hand;
+
+  /* xorshift state for lfu sampling */
+  unsigned seed;
+};
+
+/* sets up a cache holding at most max_capacity nodes */
+void
+brbt_cache_init(struct brbt_cache* cache,
+                enum brbt_cache_kind kind,
+                unsigned max_capacity);
+
+/* marks node as used, for lru, clock and lfu */
+void
+brbt_cache_touch(struct brbt* tree, brbt_node node);
+
+/* brbt_find that touches the node it found */
+brbt_node
+brbt_cache_find(struct brbt* tree, void const* key);
+
+/* moves the per node state along with the remap of brbt_compact */
+void
+brbt_cache_remap(struct brbt* tree, brbt_node const* remap);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "brbt.h"
+
+#include <pthread.h>
+
+/* a brbt shared between threads. the tree itself has no synchronization,
+ * everything done to it has to go through the wrapper, which keeps the
+ * readers apart from the writers in one of two ways */
+
+enum brbt_concurrency
+{
+  /* readers share a reader-writer lock, writers take it exclusively */
+  BRBT_CONCURRENT_RWLOCK,
+
+  /* readers take no lock at all. writers serialize on a mutex and bump a
+   * sequence number around every change, readers walk the tree racing
+   * them and start over if the number moved meanwhile.
+   * the arrays are allocated at max_capacity up front so they never move,
+   * and a custom comparator has to cope with keys torn by a write */
+  BRBT_CONCURRENT_OPTIMISTIC,
+};
+
+/* failed optimistic reads before a reader falls back to the writer lock */
+#ifndef BRBT_CONCURRENT_RETRIES
+#define BRBT_CONCURRENT_RETRIES 8
+#endif
+
+struct brbt_concurrent
+{
+  struct brbt tree;
+  enum brbt_concurrency mode;
+
+  pthread_rwlock_t rwlock;
+  pthread_mutex_t writer;
+
+  /* odd while a write is in progress, accessed atomically */
+  unsigned long seq;
+
+  /* capacity the optimistic arrays were allocated at */
+  unsigned _limit;
+};
+
+typedef void (*brbt_concurrent_fn)(struct brbt*, void* userdata);
+
+/* creates the tree as by brbt_create. the optimistic mode needs a policy
+ * with max_capacity set, returns false if its arrays cannot be allocated
+ * or the locks cannot be set up */
+_Bool
+brbt_concurrent_init(struct brbt_concurrent* c,
+                     struct brbt_type const* type,
+                     struct brbt_policy const* policy,
+                     void* userdata,
+                     enum brbt_concurrency mode);
+
+/* destroys the tree, no other thread may be using it */
+void
+brbt_concurrent_destroy(struct brbt_concurrent* c);
+
+/* returns the node with key, BRBT_NIL if not found, and copies its record
+ * to out if set. the record may change once this returns, out is the only
+ * consistent view of it */
+brbt_node
+brbt_concurrent_find(struct brbt_concurrent* c, void const* key, void* out);
+
+/* brbt_insert under the writer lock */
+brbt_node
+brbt_concurrent_insert(struct brbt_concurrent* c, void* record, _Bool replace);
+
+/* brbt_delete under the writer lock */
+void
+brbt_concurrent_delete(struct brbt_concurrent* c, void* key);
+
+/* runs fn on the tree with every reader shut out, for changes beyond
+ * insert and delete. an optimistic tree must not be shrunk */
+void
+brbt_concurrent_write(struct brbt_concurrent* c,
+                      brbt_concurrent_fn fn,
+                      void* userdata);
+
+/* runs fn on the tree while nothing writes to it, for reads beyond find.
+ * readers share it in the rwlock mode, the optimistic mode runs fn under
+ * the writer lock as it cannot retry it */
+void
+brbt_concurrent_read(struct brbt_concurrent* c,
+                     brbt_concurrent_fn fn,
+                     void* userdata);
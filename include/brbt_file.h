@@ -0,0 +1,144 @@
+#pragma once
+
+#include "brbt.h"
+
+/* an on-disk image of a tree that maps back in without deserializing.
+ * nodes are indices, so the arrays are written out as they are, one
+ * after the other on pages of their own behind a header, and a mapped
+ * file is used in place. opening is O(1), pages are read in as they are
+ * first touched.
+ *
+ * the image is only readable by a build and type that lay out nodes the
+ * same way, this is checked on open. records are copied byte for byte,
+ * pointers within them do not survive, and integer keys are stored in
+ * native byte order.
+ *
+ * a saved image is kept current with checkpoints, which only carry the
+ * runs of nodes written since the image or the last checkpoint, and are
+ * applied to the image in place
+ */
+
+#define BRBT_FILE_MAGIC "brbtfile"
+#define BRBT_CHECKPOINT_MAGIC "brbtdiff"
+#define BRBT_FILE_VERSION 1
+
+/* alignment of the arrays within the file */
+#define BRBT_FILE_ALIGN 4096
+
+struct brbt_file_header
+{
+  char magic[8];
+  unsigned version;
+
+  /* 0x01020304 as the writer saw it */
+  unsigned byte_order;
+
+  /* layout the arrays were written for */
+  unsigned membs;
+  unsigned keyoff;
+  unsigned kind;
+  unsigned keylen;
+  unsigned inline_key;
+  unsigned flags;
+  unsigned aggbs;
+  unsigned layout;
+  unsigned bookkeeping;
+  unsigned bk_stride;
+  unsigned data_off;
+
+  /* the tree, nodes at or past capacity were never handed out,
+   * so capacity is the high-water mark of the saved tree */
+  brbt_node root;
+  brbt_node first_free;
+  unsigned size;
+  unsigned capacity;
+
+  /* file offsets and bytesizes of the arrays, which have room for at
+   * least capacity nodes. interleaved nodes all live in the bookkeeping
+   * array */
+  unsigned long long data_offset;
+  unsigned long long data_bytes;
+  unsigned long long bk_offset;
+  unsigned long long bk_bytes;
+};
+
+enum brbt_map_mode
+{
+  /* mapped read only, modifying the tree faults */
+  BRBT_MAP_READONLY,
+
+  /* copy on write, changes stay private to the process and never reach
+   * the file. the first grow moves the tree off the mapping onto the heap
+   */
+  BRBT_MAP_PRIVATE,
+};
+
+struct brbt_mapping
+{
+  /* trees are opened with &map->policy, must stay first.
+   * it starts out as the default policy, the hooks, select and
+   * max_capacity may be set before the tree is modified */
+  struct brbt_policy policy;
+
+  enum brbt_map_mode mode;
+
+  /* the whole file, NULL once the tree moved to the heap */
+  void* base;
+  unsigned long bytes;
+};
+
+/* a checkpoint starts with the header the tree would be saved with,
+ * under BRBT_CHECKPOINT_MAGIC, and is followed by runs of nodes. every
+ * run is followed by the records of its nodes, unless they are
+ * interleaved, and then by their bookkeeping rows. a run of no nodes
+ * ends the checkpoint */
+struct brbt_checkpoint_run
+{
+  brbt_node first;
+  unsigned count;
+};
+
+/* stream callbacks moving n bytes, returning false on failure */
+typedef _Bool (*brbt_writer)(void* userdata,
+                             void const* bytes,
+                             unsigned long n);
+typedef _Bool (*brbt_reader)(void* userdata, void* bytes, unsigned long n);
+
+/* writes tree to path, replacing the file, and starts a new checkpoint.
+ * returns false, removing the file, if it could not be written */
+_Bool
+brbt_save(struct brbt* tree, char const* path);
+
+/* opens the tree saved to path, backed by a mapping of the file.
+ * map has to outlive the tree, which is closed by brbt_destroy,
+ * running the deleter on every record as usual.
+ * returns false, leaving tree empty, if the file could not be mapped,
+ * or does not hold a tree of type
+ */
+_Bool
+brbt_open_mmap(struct brbt* tree,
+               struct brbt_mapping* map,
+               struct brbt_type const* type,
+               char const* path,
+               enum brbt_map_mode mode,
+               void* userdata);
+
+/* streams the nodes changed since the tree was saved, opened or last
+ * checkpointed to fn. BRBT_DIRTY builds track them in runs of
+ * 1 << BRBT_DIRTY_SHIFT nodes, other builds stream every node below the
+ * high-water mark. records changed in place need brbt_mark_dirty.
+ * returns false if fn failed, the next checkpoint then carries the
+ * changes again
+ */
+_Bool
+brbt_checkpoint(struct brbt* tree, brbt_writer fn, void* userdata);
+
+/* reads a checkpoint from fn and applies it to the image saved to path,
+ * after which it opens as the checkpointed tree. checkpoints have to be
+ * applied in the order they were taken. the header is written last, but
+ * a failure part way through may leave the image unusable.
+ * returns false if the checkpoint was cut short, does not fit the image,
+ * or the image could not be written
+ */
+_Bool
+brbt_apply_checkpoint(char const* path, brbt_reader fn, void* userdata);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "brbt.h"
+
+/* the bulk operations of brbt.h spread over threads. the join based
+ * algorithms recurse on disjoint subtrees, which touch disjoint nodes, so
+ * the top levels of the recursion fork into a new thread per subtree
+ * until threads are busy, and the levels below run serially.
+ * no other thread may be using the trees meanwhile, and the hooks, the
+ * deleter and the aggregate may be called from any of the threads.
+ * threads may be 0 or 1 to run serially. BRBT_STATS counters are not
+ * kept accurately while threads run */
+
+_Bool
+brbt_build_sorted_parallel(struct brbt* tree,
+                           void const* records,
+                           unsigned count,
+                           unsigned threads);
+
+_Bool
+brbt_union_parallel(struct brbt* a, struct brbt* b, unsigned threads);
+
+void
+brbt_intersection_parallel(struct brbt* a, struct brbt* b, unsigned threads);
+
+void
+brbt_difference_parallel(struct brbt* a, struct brbt* b, unsigned threads);
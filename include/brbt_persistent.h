@@ -0,0 +1,151 @@
+#pragma once
+
+#include "brbt.h"
+
+/* a left leaning red-black tree whose versions are immutable once
+ * published. a write copies the nodes on the path it changes instead of
+ * changing them in place, and publishes the new root atomically, so
+ * readers keep walking the version they started on without any lock.
+ *
+ * there is one writer at a time, serialized by the caller, and up to
+ * BRBT_PERSISTENT_READERS readers, each owning one reader slot.
+ * nodes and records that a write replaced are retired, and only freed,
+ * running the deleter and the remove hook, once no reader can still be
+ * on a version that reaches them.
+ *
+ * records live in a slot array of their own and keep their index while
+ * they are live, like in a brbt_btree. readers walk the arrays while the
+ * writer allocates from them, so they are allocated once, at the first
+ * write, at max_capacity records, which the policy has to set. the nodes
+ * come from the default policy. a full tree fails inserts, nothing is
+ * evicted. the inline key, flags and aggregate of the type do not apply
+ */
+
+#ifndef BRBT_PERSISTENT_READERS
+#define BRBT_PERSISTENT_READERS 64
+#endif
+
+/* cache line of its own per reader, readers never share a write */
+struct brbt_reader_slot
+{
+  /* epoch the reader entered at, 0 when it holds no snapshot */
+  unsigned long epoch;
+  char _pad[64 - sizeof(unsigned long)];
+};
+
+struct brbt_retired
+{
+  brbt_node slot;
+  _Bool record;
+
+  /* last epoch that may still reach it */
+  unsigned long epoch;
+};
+
+struct brbt_persistent
+{
+  /* the records, only the arrays and the free list of it are used */
+  struct brbt records;
+
+  /* nodes of the versions still visible */
+  struct brbt nodes;
+  struct brbt_policy _node_policy;
+
+  /* latest version, and the epoch readers entering now get.
+   * both are accessed atomically */
+  brbt_node root;
+  unsigned long epoch;
+
+  struct brbt_reader_slot readers[BRBT_PERSISTENT_READERS];
+
+  /* oldest first */
+  struct brbt_retired* retired;
+  unsigned retired_count;
+
+  /* live records of the latest version */
+  unsigned size;
+
+  /* write in progress, its own nodes may be changed in place */
+  unsigned long long _gen;
+};
+
+/* the version of the tree a reader holds on to */
+struct brbt_snapshot
+{
+  struct brbt_persistent* tree;
+  brbt_node root;
+  unsigned reader;
+};
+
+/* sets up an empty tree, the policy must have max_capacity set */
+void
+brbt_persistent_init(struct brbt_persistent* tree,
+                     struct brbt_type const* type,
+                     struct brbt_policy const* policy,
+                     void* userdata);
+
+/* destroys the tree, no reader may be holding a snapshot */
+void
+brbt_persistent_destroy(struct brbt_persistent* tree);
+
+/* the data of a record */
+void*
+brbt_persistent_get(struct brbt_persistent* tree, brbt_node record);
+
+/* returns the record with key in the latest version, BRBT_NIL if not
+ * found. for the writer, readers go through a snapshot */
+brbt_node
+brbt_persistent_find(struct brbt_persistent* tree, void const* key);
+
+/* publishes a version with the record inserted, as by brbt_insert, and
+ * returns the index of its record. the existing record is returned if
+ * its key is present, and only replaced, by a new copy at a new index,
+ * if replace is set. returns BRBT_NIL, leaving the tree as it was, if
+ * the arrays are full of records and nodes readers may still see */
+brbt_node
+brbt_persistent_insert(struct brbt_persistent* tree,
+                       void* record,
+                       _Bool replace);
+
+/* publishes a version without the record with key. returns false if
+ * there was none, or, leaving the tree as it was, if there is no room
+ * left to copy the path to it */
+_Bool
+brbt_persistent_delete(struct brbt_persistent* tree, void const* key);
+
+/* frees what no reader can see anymore, which every write also does */
+void
+brbt_persistent_reclaim(struct brbt_persistent* tree);
+
+/* takes a snapshot of the latest version, from the thread owning
+ * reader, which holds at most one at a time */
+struct brbt_snapshot
+brbt_persistent_acquire(struct brbt_persistent* tree, unsigned reader);
+
+/* lets the version of a snapshot be reclaimed */
+void
+brbt_snapshot_release(struct brbt_snapshot* snap);
+
+/* returns the record with key in the version of a snapshot */
+brbt_node
+brbt_snapshot_find(struct brbt_snapshot const* snap, void const* key);
+
+/* calls fn in order on every record of the version of a snapshot with
+ * a key in [lo, hi), a null bound leaves that side open.
+ * fn is handed the record array */
+void
+brbt_snapshot_range(struct brbt_snapshot const* snap,
+                    void const* lo,
+                    void const* hi,
+                    brbt_iterator fn,
+                    void* userdata);
+
+/* helper combination function of find and get */
+static inline void*
+brbt_snapshot_find_get(struct brbt_snapshot const* snap, void const* key)
+{
+  brbt_node idx = brbt_snapshot_find(snap, key);
+  if (idx == BRBT_NIL)
+    return NULL;
+  return brbt_persistent_get(snap->tree, idx);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "brbt.h"
+
+/* a policy for many small trees drawing their arrays from one arena.
+ * arrays are carved out of slabs as chunks of BRBT_POOL_MIN_CHUNK << i
+ * bytes for classes i below BRBT_POOL_CLASSES, and go back onto the
+ * free list of their class when a tree moves to another class, shrinks or
+ * is destroyed. trees start out at BRBT_POOL_MIN_CAPACITY nodes and
+ * double, filling whatever their chunks have room for, so a tree of a few
+ * nodes costs a single chunk of a few cache lines, two with the split
+ * layout. arrays larger than the largest class come from malloc.
+ *
+ * slabs are only released by brbt_pool_destroy. the pool is as
+ * unsynchronized as a tree, trees sharing a pool may not be modified from
+ * several threads at once
+ */
+
+#ifndef BRBT_POOL_MIN_CHUNK
+#define BRBT_POOL_MIN_CHUNK 64
+#endif
+
+#ifndef BRBT_POOL_CLASSES
+#define BRBT_POOL_CLASSES 12
+#endif
+
+/* bytesize of the slabs chunks are carved from, at least one chunk */
+#ifndef BRBT_POOL_SLAB
+#define BRBT_POOL_SLAB (256u << 10)
+#endif
+
+#ifndef BRBT_POOL_MIN_CAPACITY
+#define BRBT_POOL_MIN_CAPACITY 4
+#endif
+
+struct brbt_pool
+{
+  /* trees are created with &pool->policy, must stay first.
+   * it starts out as the default policy growing by 2x, the hooks,
+   * select, growth and max_capacity may be changed before any tree
+   * of the pool grows */
+  struct brbt_policy policy;
+
+  /* free chunks of every class, chained through their first bytes */
+  void* _free[BRBT_POOL_CLASSES];
+
+  /* slabs, chained through their first bytes */
+  void* _slabs;
+
+  /* bytes held in slabs, and in chunks handed out to trees */
+  unsigned long long reserved;
+  unsigned long long in_use;
+};
+
+void
+brbt_pool_init(struct brbt_pool* pool);
+
+/* releases the slabs, every tree of the pool has to be destroyed first */
+void
+brbt_pool_destroy(struct brbt_pool* pool);
@@ -0,0 +1,155 @@
+#pragma once
+
+/* shared between the containers of the library, not installed */
+
+#include "brbt.h"
+#include <stdint.h>
+
+#define cmp3(a, b) (((a) > (b)) - ((a) < (b)))
+
+/* compares two keys. kind is a constant wherever this is inlined
+ * into a loop, which removes the dispatch and, for the built-in
+ * kinds, the indirect call */
+__attribute__((always_inline)) static inline int
+compare_keys(struct brbt* tree,
+             void const* lhs,
+             void const* rhs,
+             enum brbt_key_kind const kind)
+{
+  switch (kind) {
+#define load_cmp(T)                                                            \
+  {                                                                            \
+    T a, b;                                                                    \
+    __builtin_memcpy(&a, lhs, sizeof a);                                       \
+    __builtin_memcpy(&b, rhs, sizeof b);                                       \
+    return cmp3(a, b);                                                         \
+  }
+    case BRBT_KEY_U32:
+      load_cmp(uint32_t);
+    case BRBT_KEY_I32:
+      load_cmp(int32_t);
+    case BRBT_KEY_U64:
+      load_cmp(uint64_t);
+    case BRBT_KEY_I64:
+      load_cmp(int64_t);
+#undef load_cmp
+
+    case BRBT_KEY_BYTES:
+      return __builtin_memcmp(lhs, rhs, tree->_type->keylen);
+
+    case BRBT_KEY_CUSTOM:
+    default:
+      return tree->_type->cmp(lhs, rhs);
+  }
+}
+
+/* returns fn called with kind as a constant trailing argument,
+ * giving every kind its own specialized loop */
+#define brbt_dispatch_kind(kind, fn, ...)                                      \
+  switch (kind) {                                                              \
+    case BRBT_KEY_U32:                                                         \
+      return fn(__VA_ARGS__, BRBT_KEY_U32);                                    \
+    case BRBT_KEY_I32:                                                         \
+      return fn(__VA_ARGS__, BRBT_KEY_I32);                                    \
+    case BRBT_KEY_U64:                                                         \
+      return fn(__VA_ARGS__, BRBT_KEY_U64);                                    \
+    case BRBT_KEY_I64:                                                         \
+      return fn(__VA_ARGS__, BRBT_KEY_I64);                                    \
+    case BRBT_KEY_BYTES:                                                       \
+      return fn(__VA_ARGS__, BRBT_KEY_BYTES);                                  \
+    case BRBT_KEY_CUSTOM:                                                      \
+    default:                                                                   \
+      return fn(__VA_ARGS__, BRBT_KEY_CUSTOM);                                 \
+  }
+
+/* raw slot storage of a tree, for containers that keep links of their
+ * own and only borrow the arrays, the free list and the policy of a brbt.
+ * the root of such a tree stays BRBT_NIL */
+
+/* makes sure n slots can be allocated without evicting, growing the
+ * arrays through the policy if needed */
+_Bool
+brbt_slot_reserve(struct brbt* tree, unsigned n);
+
+/* hands out a slot, or BRBT_NIL if there is no room. runs no hooks */
+brbt_node
+brbt_slot_alloc(struct brbt* tree);
+
+/* puts a slot back, running the deleter and the remove hook */
+void
+brbt_slot_free(struct brbt* tree, brbt_node slot);
+
+/* puts a slot back without running anything */
+void
+brbt_slot_release(struct brbt* tree, brbt_node slot);
+
+/* frees every slot in use, as by brbt_slot_free */
+void
+brbt_slot_clear(struct brbt* tree);
+
+/* sizes the dirty map of a BRBT_DIRTY build to the capacity, with the
+ * nodes it newly covers clean. returns false if it could not grow */
+_Bool
+brbt_dirty_fit(struct brbt* tree);
+
+/* sizes the hash index of a tree whose type has a hash to twice its
+ * capacity, keeping the entries. returns false if it could not grow */
+_Bool
+brbt_index_fit(struct brbt* tree);
+
+/* indexes the nodes linked into the tree afresh */
+void
+brbt_index_rebuild(struct brbt* tree);
+
+/* lets the bulk operations fork on subtrees. both runs fn on lhs and on
+ * rhs, possibly at once, and returns once both are done. the recursion
+ * only forks on its top levels, the ones below run serially */
+struct brbt_fork
+{
+  void (*both)(void (*fn)(void*), void* lhs, void* rhs);
+  unsigned levels;
+};
+
+/* the bulk operations of brbt.h, forking through fork unless it is null */
+_Bool
+brbt_build_sorted_fork(struct brbt* tree,
+                       void const* records,
+                       unsigned count,
+                       struct brbt_fork const* fork);
+
+_Bool
+brbt_union_fork(struct brbt* a, struct brbt* b, struct brbt_fork const* fork);
+
+void
+brbt_intersection_fork(struct brbt* a,
+                       struct brbt* b,
+                       struct brbt_fork const* fork);
+
+void
+brbt_difference_fork(struct brbt* a,
+                     struct brbt* b,
+                     struct brbt_fork const* fork);
+
+/* rank kernels, counting the sorted keys of a node below a probe, or not
+ * above it with upper set, which is the lower or upper bound of the probe.
+ * they read whole blocks of BRBT_RANK_BLOCK bytes, so the keys must be
+ * followed by readable memory up to the next multiple of it */
+#define BRBT_RANK_BLOCK 32
+
+typedef unsigned (*brbt_rank_fn)(void const* keys,
+                                 unsigned n,
+                                 void const* probe,
+                                 _Bool upper);
+
+/* the kernel for the vector unit of the running cpu, BRBT_NO_SIMD
+ * builds, kinds other than the integer ones and cpus without one get
+ * NULL, leaving the scalar scan to the caller */
+brbt_rank_fn
+brbt_rank_kernel(enum brbt_key_kind kind);
+
+/* find for readers racing a writer, which may see the tree halfway
+ * through a change. it reads no index at or past limit, and terminates
+ * whatever the links hold, but its result only holds if no write
+ * overlapped it. the arrays must stay where they are meanwhile */
+brbt_node
+brbt_find_racy(struct brbt* tree, void const* key, unsigned limit);
@@ -0,0 +1,593 @@
+#include "brbt.h"
+#include "brbt_btree.h"
+#include "brbt_cache.h"
+#include "brbt_file.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/*
+ * regression tests, every test returns the number of failed checks.
+ * the program exits with 1 if any of them failed
+ */
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%i: %s\n", __FILE__, __LINE__, #cond);              \
+      failed++;                                                               \
+    }                                                                         \
+  } while (0)
+
+struct rec
+{
+  uint64_t key;
+  uint64_t value;
+};
+
+/* keys in the order the cache evicted them */
+static uint64_t evicted[16];
+static unsigned evicted_count;
+
+static void
+record_eviction(struct brbt* tree, brbt_node node)
+{
+  struct rec const* r = brbt_get(tree, node);
+  if (evicted_count < sizeof evicted / sizeof *evicted)
+    evicted[evicted_count] = r->key;
+  evicted_count++;
+}
+
+/* shrinking a cache after deletes must keep its eviction order */
+static unsigned
+test_cache_shrink(enum brbt_cache_kind kind)
+{
+  unsigned failed = 0;
+
+  struct brbt_type type = { 0 };
+  type.membs = sizeof(struct rec);
+  type.kind = BRBT_KEY_U64;
+  type.deleter = record_eviction;
+
+  struct brbt_cache cache;
+  brbt_cache_init(&cache, kind, 8);
+  struct brbt tree = brbt_create(&type, &cache.policy, NULL);
+
+  for (uint64_t k = 0; k < 8; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  /* leave holes below the high-water mark, then make 0 the most recently
+   * used for lru */
+  for (uint64_t k = 1; k < 6; k += 2)
+    brbt_delete(&tree, &k);
+  uint64_t const zero = 0;
+  CHECK(brbt_cache_find(&tree, &zero) != BRBT_NIL);
+
+  unsigned const capacity = brbt_capacity(&tree);
+  brbt_shrink(&tree);
+  CHECK(brbt_capacity(&tree) == capacity);
+  CHECK(brbt_size(&tree) == 5);
+
+  /* three inserts fill the holes, the next five evict every old key */
+  evicted_count = 0;
+  for (uint64_t k = 100; k < 108; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  uint64_t const fifo[] = { 0, 2, 4, 6, 7 };
+  uint64_t const lru[] = { 2, 4, 6, 7, 0 };
+  uint64_t const* const expected = kind == BRBT_CACHE_LRU ? lru : fifo;
+
+  CHECK(evicted_count == 5);
+  for (unsigned i = 0; i < 5 && i < evicted_count; i++)
+    CHECK(evicted[i] == expected[i]);
+  CHECK(brbt_size(&tree) == 8);
+
+  type.deleter = NULL;
+  brbt_destroy(&tree);
+  return failed;
+}
+
+static unsigned resize_calls;
+
+/* only resizes of this tree are counted, any when null */
+static struct brbt* resize_counted;
+
+static struct brbt_allocator_out
+counting_resize(struct brbt* tree,
+                enum brbt_allocation_request req,
+                unsigned min_capacity)
+{
+  if (!resize_counted || tree == resize_counted)
+    resize_calls++;
+  return brbt_default_policy_resize(tree, req, min_capacity);
+}
+
+static brbt_node
+select_root(struct brbt* tree)
+{
+  return tree->root;
+}
+
+/* a full tree evicts without asking the policy to resize again,
+ * and its arrays stay put */
+static unsigned
+test_eviction_resizes(void)
+{
+  unsigned failed = 0;
+
+  struct brbt_type type = { 0 };
+  type.membs = sizeof(struct rec);
+  type.kind = BRBT_KEY_U64;
+
+  struct brbt_policy policy = brbt_create_default_policy();
+  policy.resize = counting_resize;
+  policy.select = select_root;
+  policy.max_capacity = 40;
+
+  resize_calls = 0;
+  resize_counted = NULL;
+  struct brbt tree = brbt_create(&type, &policy, NULL);
+
+  for (uint64_t k = 0; k < 40; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  unsigned const calls = resize_calls;
+  void* const data = tree.ptr;
+  CHECK(brbt_capacity(&tree) == 40);
+
+  for (uint64_t k = 40; k < 1000; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  CHECK(resize_calls == calls);
+  CHECK(tree.ptr == data);
+  CHECK(brbt_size(&tree) == 40);
+
+  brbt_destroy(&tree);
+  return failed;
+}
+
+/* record owning the storage of its key */
+struct srec
+{
+  char* s;
+  unsigned value;
+};
+
+static int
+compare_str(void const* lhs, void const* rhs)
+{
+  return strcmp(*(char* const*)lhs, *(char* const*)rhs);
+}
+
+static unsigned long long
+hash_str(void const* key)
+{
+  unsigned long long h = 14695981039346656037ull;
+  for (char const* c = *(char* const*)key; *c; c++)
+    h = (h ^ (unsigned char)*c) * 1099511628211ull;
+  return h;
+}
+
+static void
+free_str(struct brbt* tree, brbt_node node)
+{
+  struct srec* r = brbt_get(tree, node);
+  free(r->s);
+  r->s = NULL;
+}
+
+static brbt_node
+select_first(struct brbt* tree)
+{
+  (void)tree;
+  return 0;
+}
+
+/* the same for the records of a b tree, which are slots */
+static unsigned
+test_btree_eviction_resizes(void)
+{
+  unsigned failed = 0;
+
+  struct brbt_type type = { 0 };
+  type.membs = sizeof(struct rec);
+  type.kind = BRBT_KEY_U64;
+
+  struct brbt_policy policy = brbt_create_default_policy();
+  policy.resize = counting_resize;
+  policy.select = select_first;
+  policy.max_capacity = 40;
+
+  struct brbt_btree tree = brbt_btree_create(&type, &policy, NULL);
+  resize_calls = 0;
+  resize_counted = &tree.records;
+
+  for (uint64_t k = 0; k < 40; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_btree_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  unsigned const calls = resize_calls;
+  void* const data = tree.records.ptr;
+  CHECK(brbt_capacity(&tree.records) == 40);
+
+  for (uint64_t k = 40; k < 1000; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_btree_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  CHECK(resize_calls == calls);
+  CHECK(tree.records.ptr == data);
+  CHECK(brbt_btree_size(&tree) == 40);
+
+  uint64_t const last = 999;
+  CHECK(brbt_btree_find(&tree, &last) != BRBT_NIL);
+
+  resize_counted = NULL;
+  brbt_btree_destroy(&tree);
+  return failed;
+}
+
+/* the deleter of a hashed tree may free the key, the index must not
+ * look at it afterwards */
+static unsigned
+test_index_owned_keys(void)
+{
+  unsigned failed = 0;
+
+  struct brbt_type type = { 0 };
+  type.membs = sizeof(struct srec);
+  type.kind = BRBT_KEY_CUSTOM;
+  type.cmp = compare_str;
+  type.hash = hash_str;
+  type.deleter = free_str;
+
+  struct brbt_policy policy = brbt_create_default_policy();
+  struct brbt tree = brbt_create(&type, &policy, NULL);
+
+  char buf[16];
+  for (unsigned i = 0; i < 200; i++) {
+    snprintf(buf, sizeof buf, "key%u", i);
+    struct srec r = { strdup(buf), i };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  for (unsigned i = 0; i < 200; i += 2) {
+    snprintf(buf, sizeof buf, "key%u", i);
+    char* key = buf;
+    brbt_delete(&tree, &key);
+  }
+
+  CHECK(brbt_size(&tree) == 100);
+  for (unsigned i = 0; i < 200; i++) {
+    snprintf(buf, sizeof buf, "key%u", i);
+    char* key = buf;
+    brbt_node const node = brbt_find(&tree, &key);
+    CHECK((node != BRBT_NIL) == (i % 2 == 1));
+    if (node != BRBT_NIL)
+      CHECK(((struct srec*)brbt_get(&tree, node))->value == i);
+  }
+
+  brbt_destroy(&tree);
+  return failed;
+}
+
+/* a checkpoint held in memory */
+struct stream
+{
+  char* bytes;
+  unsigned long size;
+  unsigned long capacity;
+  unsigned long pos;
+};
+
+static _Bool
+stream_write(void* userdata, void const* bytes, unsigned long n)
+{
+  struct stream* s = userdata;
+
+  if (s->size + n > s->capacity) {
+    unsigned long capacity = s->capacity ? s->capacity : 4096;
+    while (capacity < s->size + n)
+      capacity *= 2;
+
+    char* p = realloc(s->bytes, capacity);
+    if (!p)
+      return 0;
+    s->bytes = p;
+    s->capacity = capacity;
+  }
+
+  memcpy(s->bytes + s->size, bytes, n);
+  s->size += n;
+  return 1;
+}
+
+static _Bool
+stream_read(void* userdata, void* bytes, unsigned long n)
+{
+  struct stream* s = userdata;
+
+  if (n > s->size - s->pos)
+    return 0;
+
+  memcpy(bytes, s->bytes + s->pos, n);
+  s->pos += n;
+  return 1;
+}
+
+/* a path for a scratch image, removed by the caller */
+static void
+scratch_path(char* path, unsigned bytes)
+{
+  snprintf(path, bytes, "/tmp/brbt-test-XXXXXX");
+  int const fd = mkstemp(path);
+  if (fd >= 0)
+    close(fd);
+}
+
+static struct brbt_type
+rec_type(enum brbt_layout layout)
+{
+  struct brbt_type type = { 0 };
+  type.membs = sizeof(struct rec);
+  type.kind = BRBT_KEY_U64;
+  type.layout = layout;
+  return type;
+}
+
+/* whether b holds the same records as a, in order */
+static unsigned
+same_records(struct brbt* a, struct brbt* b)
+{
+  unsigned failed = 0;
+  uint64_t last = 0;
+  unsigned n = 0;
+
+  CHECK(brbt_size(a) == brbt_size(b));
+
+  brbt_for(a, i, {
+    struct rec const* r = brbt_get(a, i);
+    brbt_node const node = brbt_find(b, &r->key);
+    CHECK(node != BRBT_NIL);
+    if (node != BRBT_NIL)
+      CHECK(((struct rec*)brbt_get(b, node))->value == r->value);
+  });
+
+  brbt_for(b, i, {
+    struct rec const* r = brbt_get(b, i);
+    CHECK(n == 0 || r->key > last);
+    last = r->key;
+    n++;
+  });
+
+  CHECK(n == brbt_size(b));
+  return failed;
+}
+
+static enum brbt_layout const layouts[] = {
+  BRBT_LAYOUT_SPLIT,
+  BRBT_LAYOUT_COMBINED,
+  BRBT_LAYOUT_INTERLEAVED,
+};
+
+/* a saved tree opens in both modes with the same records, and changes
+ * of a private mapping never reach the file */
+static unsigned
+test_file_round_trip(enum brbt_layout layout)
+{
+  unsigned failed = 0;
+
+  struct brbt_type const type = rec_type(layout);
+  struct brbt_policy policy = brbt_create_default_policy();
+  struct brbt tree = brbt_create(&type, &policy, NULL);
+
+  for (uint64_t k = 0; k < 3000; k += 3) {
+    struct rec r = { k, k + 1 };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+  for (uint64_t k = 0; k < 3000; k += 30)
+    brbt_delete(&tree, &k);
+
+  char path[64];
+  scratch_path(path, sizeof path);
+  CHECK(brbt_save(&tree, path));
+
+  struct brbt_mapping map;
+  struct brbt mapped;
+  CHECK(brbt_open_mmap(&mapped, &map, &type, path, BRBT_MAP_READONLY, NULL));
+  failed += same_records(&tree, &mapped);
+  brbt_destroy(&mapped);
+
+  CHECK(brbt_open_mmap(&mapped, &map, &type, path, BRBT_MAP_PRIVATE, NULL));
+  failed += same_records(&tree, &mapped);
+
+  /* filling the holes stays on the mapping, growing moves to the heap */
+  for (uint64_t k = 1; k < 3000; k += 3) {
+    struct rec r = { k, k + 1 };
+    CHECK(brbt_insert(&mapped, &r, 0) != BRBT_NIL);
+  }
+  CHECK(map.base == NULL);
+  CHECK(brbt_size(&mapped) == brbt_size(&tree) + 1000);
+  for (uint64_t k = 0; k < 3000; k += 3) {
+    brbt_node const node = brbt_find(&mapped, &k);
+    CHECK((node != BRBT_NIL) == (k % 30 != 0));
+  }
+  brbt_destroy(&mapped);
+
+  CHECK(brbt_open_mmap(&mapped, &map, &type, path, BRBT_MAP_READONLY, NULL));
+  failed += same_records(&tree, &mapped);
+  brbt_destroy(&mapped);
+
+  brbt_destroy(&tree);
+  unlink(path);
+  return failed;
+}
+
+/* checkpoints applied in order bring the image up to date, also once
+ * the records outgrew the array they were saved with */
+static unsigned
+test_file_checkpoint(enum brbt_layout layout)
+{
+  unsigned failed = 0;
+
+  struct brbt_type const type = rec_type(layout);
+  struct brbt_policy policy = brbt_create_default_policy();
+  struct brbt tree = brbt_create(&type, &policy, NULL);
+
+  for (uint64_t k = 0; k < 100; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  char path[64];
+  scratch_path(path, sizeof path);
+  CHECK(brbt_save(&tree, path));
+
+  for (unsigned round = 0; round < 2; round++) {
+    /* ten times the saved nodes, then changes in place */
+    for (uint64_t k = 100; k < 1000 + round * 2000; k++) {
+      struct rec r = { k, k * 2 };
+      CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+    }
+    for (uint64_t k = round; k < 1000; k += 7)
+      brbt_delete(&tree, &k);
+    for (uint64_t k = 50; k < 80; k++) {
+      struct rec r = { k, k + round + 100 };
+      brbt_insert(&tree, &r, 1);
+    }
+
+    struct stream s = { 0 };
+    CHECK(brbt_checkpoint(&tree, stream_write, &s));
+    CHECK(brbt_apply_checkpoint(path, stream_read, &s));
+    CHECK(s.pos == s.size);
+    free(s.bytes);
+
+    struct brbt_mapping map;
+    struct brbt mapped;
+    CHECK(
+      brbt_open_mmap(&mapped, &map, &type, path, BRBT_MAP_READONLY, NULL));
+    failed += same_records(&tree, &mapped);
+    brbt_destroy(&mapped);
+  }
+
+  brbt_destroy(&tree);
+  unlink(path);
+  return failed;
+}
+
+/* images and checkpoints of another layout, or cut short, are refused */
+static unsigned
+test_file_mismatch(void)
+{
+  unsigned failed = 0;
+
+  struct brbt_type const type = rec_type(BRBT_LAYOUT_SPLIT);
+  struct brbt_policy policy = brbt_create_default_policy();
+  struct brbt tree = brbt_create(&type, &policy, NULL);
+
+  for (uint64_t k = 0; k < 100; k++) {
+    struct rec r = { k, k };
+    CHECK(brbt_insert(&tree, &r, 0) != BRBT_NIL);
+  }
+
+  char path[64];
+  scratch_path(path, sizeof path);
+  CHECK(brbt_save(&tree, path));
+
+  struct brbt_mapping map;
+  struct brbt mapped;
+
+  struct brbt_type other = type;
+  other.layout = BRBT_LAYOUT_INTERLEAVED;
+  CHECK(!brbt_open_mmap(&mapped, &map, &other, path, BRBT_MAP_READONLY, 0));
+  CHECK(brbt_size(&mapped) == 0);
+  brbt_destroy(&mapped);
+
+  other = type;
+  other.keyoff = sizeof(uint64_t);
+  CHECK(!brbt_open_mmap(&mapped, &map, &other, path, BRBT_MAP_READONLY, 0));
+  brbt_destroy(&mapped);
+
+  /* a checkpoint of a tree of another layout */
+  struct brbt_type const interleaved = rec_type(BRBT_LAYOUT_INTERLEAVED);
+  struct brbt foreign = brbt_create(&interleaved, &policy, NULL);
+  struct rec r = { 7, 7 };
+  CHECK(brbt_insert(&foreign, &r, 0) != BRBT_NIL);
+
+  struct stream s = { 0 };
+  CHECK(brbt_checkpoint(&foreign, stream_write, &s));
+  CHECK(!brbt_apply_checkpoint(path, stream_read, &s));
+  free(s.bytes);
+  brbt_destroy(&foreign);
+
+  /* a checkpoint cut short leaves the header alone */
+  s = (struct stream){ 0 };
+  CHECK(brbt_checkpoint(&tree, stream_write, &s));
+  s.size -= sizeof(struct brbt_checkpoint_run);
+  CHECK(!brbt_apply_checkpoint(path, stream_read, &s));
+  free(s.bytes);
+
+  CHECK(brbt_open_mmap(&mapped, &map, &type, path, BRBT_MAP_READONLY, NULL));
+  failed += same_records(&tree, &mapped);
+  brbt_destroy(&mapped);
+
+  /* a file bumped to another version, and one cut short */
+  FILE* f = fopen(path, "r+b");
+  CHECK(f);
+  if (f) {
+    unsigned const version = BRBT_FILE_VERSION + 1;
+    fseek(f, offsetof(struct brbt_file_header, version), SEEK_SET);
+    fwrite(&version, sizeof version, 1, f);
+    fclose(f);
+  }
+  CHECK(!brbt_open_mmap(&mapped, &map, &type, path, BRBT_MAP_READONLY, 0));
+  brbt_destroy(&mapped);
+
+  CHECK(brbt_save(&tree, path));
+  CHECK(truncate(path, BRBT_FILE_ALIGN) == 0);
+  CHECK(!brbt_open_mmap(&mapped, &map, &type, path, BRBT_MAP_READONLY, 0));
+  brbt_destroy(&mapped);
+
+  brbt_destroy(&tree);
+  unlink(path);
+  return failed;
+}
+
+int
+main(void)
+{
+  unsigned failed = 0;
+
+  failed += test_cache_shrink(BRBT_CACHE_FIFO);
+  failed += test_cache_shrink(BRBT_CACHE_LRU);
+  failed += test_eviction_resizes();
+  failed += test_btree_eviction_resizes();
+  failed += test_index_owned_keys();
+  for (unsigned i = 0; i < sizeof layouts / sizeof *layouts; i++) {
+    failed += test_file_round_trip(layouts[i]);
+    failed += test_file_checkpoint(layouts[i]);
+  }
+  failed += test_file_mismatch();
+
+  if (failed) {
+    fprintf(stderr, "%u checks failed\n", failed);
+    return EXIT_FAILURE;
+  }
+
+  puts("ok");
+  return EXIT_SUCCESS;
+}